@@ -0,0 +1,164 @@
+#ifndef __HIREDIS_COROUTINE_H__
+#define __HIREDIS_COROUTINE_H__
+#include <coroutine>
+#include <exception>
+#include <tuple>
+#include <cstdlib>
+#include <cstring>
+#include <strings.h>
+#include "../async.h"
+
+/* C++20 coroutine support for the async API. The event library still needs
+ * to be attached to the context, e.g. with adapters/libevent.h:
+ *
+ *   RedisTask run(RedisCoroutineContext redis) {
+ *       redisReply *reply = co_await redis.command("GET %s", key);
+ *       ...
+ *   }
+ *
+ * Awaiting a command is as cheap as a plain callback: the awaiter lives in
+ * the coroutine frame and is passed to redisAsyncCommand() as privdata, so
+ * nothing is allocated per command. The coroutine is resumed from within the
+ * reply callback, which means the reply is owned by hiredis and only valid
+ * until the coroutine suspends again. A NULL reply is returned when the
+ * command couldn't be issued or the context was free'd before the reply
+ * arrived.
+ *
+ * A coroutine is resumed once per command, so commands whose callback runs
+ * more than once or never, (P)SUBSCRIBE, (P)UNSUBSCRIBE and MONITOR, are
+ * refused and return a NULL reply right away. Use redisAsyncCommand() with a
+ * plain callback for them. */
+
+/* Fire-and-forget coroutine type. The frame is allocated once per task and
+ * free'd when the coroutine returns. */
+struct RedisTask {
+    struct promise_type {
+        RedisTask get_return_object() noexcept { return {}; }
+        std::suspend_never initial_suspend() noexcept { return {}; }
+        std::suspend_never final_suspend() noexcept { return {}; }
+        void return_void() noexcept { }
+        void unhandled_exception() noexcept { std::terminate(); }
+    };
+};
+
+class RedisAwaiterBase {
+    public:
+        RedisAwaiterBase(redisAsyncContext * ac)
+            : m_ctx(ac), m_reply(0) { }
+
+        RedisAwaiterBase(const RedisAwaiterBase &) = delete;
+        RedisAwaiterBase & operator=(const RedisAwaiterBase &) = delete;
+
+        bool await_ready() const noexcept { return false; }
+        redisReply * await_resume() const noexcept { return m_reply; }
+
+    protected:
+        /* See above, the same commands redisAsyncBatchAdd() refuses. */
+        static bool refused(const char * name, size_t len) {
+            if (len > 0 && (name[0] == 'p' || name[0] == 'P')) {
+                name++;
+                len--;
+            }
+            return (len == 9 && strncasecmp(name, "subscribe", 9) == 0) ||
+                   (len == 11 && strncasecmp(name, "unsubscribe", 11) == 0) ||
+                   (len == 7 && strncasecmp(name, "monitor", 7) == 0);
+        }
+
+        /* The name is the first bulk string of a formatted command. */
+        static bool refusedFormatted(const char * cmd) {
+            const char * p = strchr(cmd, '$');
+            char * end;
+            size_t len;
+
+            if (p == 0)
+                return false;
+            len = strtoul(p + 1, &end, 10);
+            return refused(end + 2, len);
+        }
+
+        static void callback(redisAsyncContext *, void * r, void * privdata) {
+            RedisAwaiterBase * a = static_cast<RedisAwaiterBase *>(privdata);
+            a->m_reply = static_cast<redisReply *>(r);
+            /* The frame and this awaiter can be gone once resume() returns. */
+            a->m_handle.resume();
+        }
+
+        redisAsyncContext * m_ctx;
+        redisReply * m_reply;
+        std::coroutine_handle<> m_handle;
+};
+
+/* The format arguments are kept by value until the coroutine suspends. The
+ * command is formatted here rather than by redisAsyncCommand() to check its
+ * name, which costs nothing extra as that formats into a buffer as well. */
+template <typename... Args>
+class RedisCommandAwaiter : public RedisAwaiterBase {
+    public:
+        RedisCommandAwaiter(redisAsyncContext * ac, const char * format, Args... args)
+            : RedisAwaiterBase(ac), m_format(format), m_args(args...) { }
+
+        /* Don't suspend when the command was refused. */
+        bool await_suspend(std::coroutine_handle<> h) noexcept {
+            char * cmd;
+            int len, status = REDIS_ERR;
+
+            m_handle = h;
+            len = std::apply([this, &cmd](Args... args) {
+                return redisFormatCommand(&cmd, m_format, args...);
+            }, m_args);
+            if (len == -1)
+                return false;
+            if (!refusedFormatted(cmd))
+                status = redisAsyncFormattedCommand(m_ctx, callback, this, cmd, len);
+            redisFreeCommand(cmd);
+            return status == REDIS_OK;
+        }
+
+    private:
+        const char * m_format;
+        std::tuple<Args...> m_args;
+};
+
+/* The argument vectors need to stay valid until the coroutine suspends. */
+class RedisCommandArgvAwaiter : public RedisAwaiterBase {
+    public:
+        RedisCommandArgvAwaiter(redisAsyncContext * ac, int argc,
+                                const char ** argv, const size_t * argvlen)
+            : RedisAwaiterBase(ac), m_argc(argc), m_argv(argv), m_argvlen(argvlen) { }
+
+        bool await_suspend(std::coroutine_handle<> h) noexcept {
+            m_handle = h;
+            if (m_argc < 1 || refused(m_argv[0], m_argvlen ? m_argvlen[0] : strlen(m_argv[0])))
+                return false;
+            return redisAsyncCommandArgv(m_ctx, callback, this,
+                                         m_argc, m_argv, m_argvlen) == REDIS_OK;
+        }
+
+    private:
+        int m_argc;
+        const char ** m_argv;
+        const size_t * m_argvlen;
+};
+
+/* Thin, copyable handle around an async context. */
+class RedisCoroutineContext {
+    public:
+        RedisCoroutineContext(redisAsyncContext * ac) : m_ctx(ac) { }
+
+        redisAsyncContext * context() const { return m_ctx; }
+
+        template <typename... Args>
+        RedisCommandAwaiter<Args...> command(const char * format, Args... args) const {
+            return RedisCommandAwaiter<Args...>(m_ctx, format, args...);
+        }
+
+        RedisCommandArgvAwaiter commandArgv(int argc, const char ** argv,
+                                            const size_t * argvlen = 0) const {
+            return RedisCommandArgvAwaiter(m_ctx, argc, argv, argvlen);
+        }
+
+    private:
+        redisAsyncContext * m_ctx;
+};
+
+#endif /* !__HIREDIS_COROUTINE_H__ */
@@ -0,0 +1,257 @@
+#ifndef __HIREDIS_EPOLL_H__
+#define __HIREDIS_EPOLL_H__
+#include <sys/epoll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../hiredis.h"
+#include "../async.h"
+
+/* Minimal built-in event loop for Linux. Every context is registered once,
+ * edge-triggered, for both directions: the add/del hooks only flip flags and
+ * never result in an epoll_ctl(2) call. Since an edge is only reported once,
+ * the loop remembers readiness itself and keeps contexts on a ready list
+ * until their socket was drained (reads) or a write didn't complete. */
+
+struct redisEpollLoop;
+
+typedef struct redisEpollEvents {
+    redisAsyncContext *context; /* NULL once the context was free'd */
+    struct redisEpollLoop *loop;
+    int fd;
+    int reading, writing; /* what hiredis is interested in */
+    int rready, wready; /* what the kernel reported */
+    int queued; /* on the ready list */
+    struct redisEpollEvents *next_ready;
+    struct redisEpollEvents *next_garbage;
+} redisEpollEvents;
+
+typedef struct redisEpollLoop {
+    int epfd;
+    int maxevents;
+    struct epoll_event *events;
+    int contexts; /* number of attached contexts */
+    redisEpollEvents *ready, *ready_tail;
+    redisEpollEvents *garbage; /* free'd at the end of the iteration */
+} redisEpollLoop;
+
+static void redisEpollQueue(redisEpollEvents *e) {
+    redisEpollLoop *loop = e->loop;
+
+    if (e->queued || e->context == NULL)
+        return;
+    e->queued = 1;
+    e->next_ready = NULL;
+    if (loop->ready_tail != NULL)
+        loop->ready_tail->next_ready = e;
+    else
+        loop->ready = e;
+    loop->ready_tail = e;
+}
+
+static void redisEpollAddRead(void *privdata) {
+    redisEpollEvents *e = (redisEpollEvents*)privdata;
+    e->reading = 1;
+    if (e->rready)
+        redisEpollQueue(e);
+}
+
+static void redisEpollDelRead(void *privdata) {
+    redisEpollEvents *e = (redisEpollEvents*)privdata;
+    e->reading = 0;
+}
+
+static void redisEpollAddWrite(void *privdata) {
+    redisEpollEvents *e = (redisEpollEvents*)privdata;
+    e->writing = 1;
+    if (e->wready)
+        redisEpollQueue(e);
+}
+
+static void redisEpollDelWrite(void *privdata) {
+    redisEpollEvents *e = (redisEpollEvents*)privdata;
+    e->writing = 0;
+}
+
+static void redisEpollCleanup(void *privdata) {
+    redisEpollEvents *e = (redisEpollEvents*)privdata;
+    redisEpollLoop *loop = e->loop;
+    struct epoll_event ev;
+
+    /* The cleanup hook can run from within a callback, while the loop still
+     * holds a pointer to this container: only free it at the end of the
+     * current iteration. */
+    memset(&ev,0,sizeof(ev));
+    epoll_ctl(loop->epfd,EPOLL_CTL_DEL,e->fd,&ev);
+    e->context = NULL;
+    e->next_garbage = loop->garbage;
+    loop->garbage = e;
+    loop->contexts--;
+}
+
+static redisEpollLoop *redisEpollLoopCreate(int maxevents) {
+    redisEpollLoop *loop;
+
+    if (maxevents <= 0)
+        maxevents = 1024;
+
+    loop = (redisEpollLoop*)calloc(1,sizeof(*loop));
+    if (loop == NULL)
+        return NULL;
+
+    loop->maxevents = maxevents;
+    loop->events = (struct epoll_event*)malloc(sizeof(struct epoll_event)*maxevents);
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->events == NULL || loop->epfd == -1) {
+        if (loop->epfd != -1) close(loop->epfd);
+        free(loop->events);
+        free(loop);
+        return NULL;
+    }
+    return loop;
+}
+
+/* Only free the loop after all attached contexts were free'd. */
+static void redisEpollLoopFree(redisEpollLoop *loop) {
+    redisEpollEvents *e;
+
+    while ((e = loop->garbage) != NULL) {
+        loop->garbage = e->next_garbage;
+        free(e);
+    }
+    close(loop->epfd);
+    free(loop->events);
+    free(loop);
+}
+
+static int redisEpollAttach(redisAsyncContext *ac, redisEpollLoop *loop) {
+    redisContext *c = &(ac->c);
+    redisEpollEvents *e;
+    struct epoll_event ev;
+
+    /* Nothing should be attached when something is already attached */
+    if (ac->ev.data != NULL)
+        return REDIS_ERR;
+
+    /* Create container for context and r/w events */
+    e = (redisEpollEvents*)calloc(1,sizeof(*e));
+    if (e == NULL)
+        return REDIS_ERR;
+    e->context = ac;
+    e->loop = loop;
+    e->fd = c->fd;
+
+    /* Register the socket once for everything we'll ever be interested in.
+     * A freshly registered socket reports its current state, which takes
+     * care of contexts that are already connected. */
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.ptr = e;
+    if (epoll_ctl(loop->epfd,EPOLL_CTL_ADD,e->fd,&ev) == -1) {
+        free(e);
+        return REDIS_ERR;
+    }
+
+    /* Register functions to start/stop listening for events */
+    ac->ev.addRead = redisEpollAddRead;
+    ac->ev.delRead = redisEpollDelRead;
+    ac->ev.addWrite = redisEpollAddWrite;
+    ac->ev.delWrite = redisEpollDelWrite;
+    ac->ev.cleanup = redisEpollCleanup;
+    ac->ev.data = e;
+
+    /* Like other adapters, look for the connect to complete right away. */
+    e->reading = e->writing = 1;
+    loop->contexts++;
+    return REDIS_OK;
+}
+
+static void redisEpollProcess(redisEpollEvents *e) {
+    redisAsyncContext *ac = e->context;
+    int deferred;
+
+    if (e->writing && e->wready) {
+        /* Replies left by a read budget are handled on write events, and
+         * their callbacks can append new commands. */
+        deferred = ac->budget.deferred;
+        redisAsyncHandleWrite(ac);
+        if (e->context == NULL)
+            return;
+
+        /* The kernel buffer is full: wait for the next EPOLLOUT edge. */
+        if (sdslen(ac->c.obuf) > 0 && !deferred)
+            e->wready = 0;
+    }
+
+    if (e->reading && e->rready) {
+        redisAsyncHandleRead(ac);
+        if (e->context == NULL)
+            return;
+
+        /* Leave the socket on the ready list until a read comes up short,
+         * so a busy connection can't starve the others. */
+        if (!(ac->c.flags & REDIS_CONNECTED) || ac->budget.drained)
+            e->rready = 0;
+    }
+
+    if ((e->reading && e->rready) || (e->writing && e->wready))
+        redisEpollQueue(e);
+}
+
+/* Wait up to timeout milliseconds (-1 blocks) for events and handle them.
+ * Returns the number of contexts that still are attached. */
+static int redisEpollLoopRunOnce(redisEpollLoop *loop, int timeout) {
+    redisEpollEvents *e, *list, *prev;
+    int n, j;
+
+    /* Don't block when there is work left from the previous iteration. */
+    n = epoll_wait(loop->epfd,loop->events,loop->maxevents,
+                   loop->ready != NULL ? 0 : timeout);
+    for (j = 0; j < n; j++) {
+        e = (redisEpollEvents*)loop->events[j].data.ptr;
+        if (e->context == NULL)
+            continue;
+        if (loop->events[j].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR))
+            e->rready = 1;
+        if (loop->events[j].events & (EPOLLOUT | EPOLLHUP | EPOLLERR))
+            e->wready = 1;
+        redisEpollQueue(e);
+    }
+
+    /* Contexts that are queued while handling this list are handled during
+     * the next iteration. */
+    list = loop->ready;
+    loop->ready = loop->ready_tail = NULL;
+    while ((e = list) != NULL) {
+        list = e->next_ready;
+        e->queued = 0;
+        if (e->context != NULL)
+            redisEpollProcess(e);
+    }
+
+    /* Contexts can be free'd after they were queued again. */
+    prev = NULL;
+    for (e = loop->ready; e != NULL; e = e->next_ready) {
+        if (e->context == NULL) {
+            if (prev != NULL)
+                prev->next_ready = e->next_ready;
+            else
+                loop->ready = e->next_ready;
+        } else {
+            prev = e;
+        }
+    }
+    loop->ready_tail = prev;
+
+    while ((e = loop->garbage) != NULL) {
+        loop->garbage = e->next_garbage;
+        free(e);
+    }
+    return loop->contexts;
+}
+
+/* Run until no context is attached anymore. */
+static void redisEpollLoopRun(redisEpollLoop *loop) {
+    while (loop->contexts > 0)
+        redisEpollLoopRunOnce(loop,-1);
+}
+#endif
@@ -36,9 +36,17 @@
 #include <assert.h>
 #include <ctype.h>
 #include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <stdint.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 #include "async.h"
 #include "net.h"
-#include "dict.c"
+#include "subtable.c"
 #include "sds.h"
 
 #define _EL_ADD_READ(ctx) do { \
@@ -57,49 +65,44 @@
         if ((ctx)->ev.cleanup) (ctx)->ev.cleanup((ctx)->ev.data); \
     } while(0);
 
-/* Forward declaration of function in hiredis.c */
+/* Forward declaration of functions in hiredis.c */
+void __redisSetError(redisContext *c, int type, const char *str);
 int __redisAppendCommand(redisContext *c, const char *cmd, size_t len);
+int __redisSetConnectOptions(redisContext *c, const redisConnectOptions *opts);
+sds __redisFormatConnectOptions(redisContext *c, const char **names, size_t *lens, int *n);
+int __redisCheckConnectReply(redisContext *c, const char *name, redisReply *reply);
 
-/* Functions managing dictionary of callbacks for pub/sub. */
-static unsigned int callbackHash(const void *key) {
-    return dictGenHashFunction((const unsigned char *)key,
-                               sdslen((const sds)key));
-}
-
-static void *callbackValDup(void *privdata, const void *src) {
-    ((void) privdata);
-    redisCallback *dup = (redisCallback *)malloc(sizeof(*dup));
-    memcpy(dup,src,sizeof(*dup));
-    return dup;
-}
-
-static int callbackKeyCompare(void *privdata, const void *key1, const void *key2) {
-    int l1, l2;
-    ((void) privdata);
-
-    l1 = sdslen((const sds)key1);
-    l2 = sdslen((const sds)key2);
-    if (l1 != l2) return 0;
-    return memcmp(key1,key2,l1) == 0;
-}
-
-static void callbackKeyDestructor(void *privdata, void *key) {
-    ((void) privdata);
-    sdsfree((sds)key);
-}
-
-static void callbackValDestructor(void *privdata, void *val) {
-    ((void) privdata);
-    free(val);
-}
+struct redisAsyncBatch {
+    redisAsyncContext *ac;
+    redisCallbackFn *fn;
+    void *privdata;
+    sds cmds; /* formatted commands, appended to the output buffer on commit */
+    size_t count; /* number of commands */
+    size_t received; /* number of replies collected in reply */
+    redisReply *reply;
+};
 
-static dictType callbackDict = {
-    callbackHash,
-    NULL,
-    callbackValDup,
-    callbackKeyCompare,
-    callbackKeyDestructor,
-    callbackValDestructor
+/* Command pushed on a submission queue by another thread */
+typedef struct redisQueuedCommand {
+    struct redisQueuedCommand *next;
+    redisCallbackFn *fn;
+    void *privdata;
+    char *cmd;
+    size_t len;
+} redisQueuedCommand;
+
+/* Intrusive multi-producer single-consumer queue: producers atomically swap
+ * the head and link the previous head to the new node, the event loop pops
+ * from the tail. A stub node keeps the queue from ever being empty, so no
+ * producer has to touch the tail. */
+struct redisAsyncQueue {
+    redisAsyncContext *ac; /* NULL once the context was free'd */
+    redisQueuedCommand *head; /* last pushed node, written by producers */
+    int signaled; /* set by the first push after a drain */
+    char pad[64]; /* keep producers and the consumer on different cache lines */
+    redisQueuedCommand *tail; /* next node to pop, owned by the event loop */
+    redisQueuedCommand stub;
+    int rfd, wfd; /* the same eventfd, or both ends of a pipe */
 };
 
 static redisAsyncContext *redisAsyncInitialize(redisContext *c) {
@@ -134,8 +137,21 @@ static redisAsyncContext *redisAsyncInitialize(redisContext *c) {
     ac->replies.tail = NULL;
     ac->sub.invalid.head = NULL;
     ac->sub.invalid.tail = NULL;
-    ac->sub.channels = dictCreate(&callbackDict,NULL);
-    ac->sub.patterns = dictCreate(&callbackDict,NULL);
+    ac->sub.channels = subTableCreate();
+    ac->sub.patterns = subTableCreate();
+    if (ac->sub.channels == NULL || ac->sub.patterns == NULL) {
+        if (ac->sub.channels != NULL)
+            subTableRelease(ac->sub.channels);
+        if (ac->sub.patterns != NULL)
+            subTableRelease(ac->sub.patterns);
+        free(ac);
+        return NULL;
+    }
+
+    memset(&ac->flow,0,sizeof(ac->flow));
+    memset(&ac->budget,0,sizeof(ac->budget));
+    memset(&ac->setup,0,sizeof(ac->setup));
+    ac->queue = NULL;
     return ac;
 }
 
@@ -168,6 +184,24 @@ redisAsyncContext *redisAsyncConnect(const char *ip, int port) {
     return ac;
 }
 
+redisAsyncContext *redisAsyncConnectFastOpen(const char *ip, int port) {
+    redisContext *c;
+    redisAsyncContext *ac;
+
+    c = redisConnectNonBlockFastOpen(ip,port);
+    if (c == NULL)
+        return NULL;
+
+    ac = redisAsyncInitialize(c);
+    if (ac == NULL) {
+        redisFree(c);
+        return NULL;
+    }
+
+    __redisAsyncCopyError(ac);
+    return ac;
+}
+
 redisAsyncContext *redisAsyncConnectBind(const char *ip, int port,
                                          const char *source_addr) {
     redisContext *c = redisConnectBindNonBlock(ip,port,source_addr);
@@ -223,6 +257,23 @@ int redisAsyncSetDisconnectCallback(redisAsyncContext *ac, redisDisconnectCallba
     return REDIS_ERR;
 }
 
+int redisAsyncSetFlowControl(redisAsyncContext *ac, size_t high_bytes, size_t low_bytes,
+                             unsigned int high_cmds, unsigned int low_cmds,
+                             redisFlowCallback *fn, void *privdata)
+{
+    if (low_bytes > high_bytes || low_cmds > high_cmds)
+        return REDIS_ERR;
+
+    ac->flow.high_bytes = high_bytes;
+    ac->flow.low_bytes = low_bytes;
+    ac->flow.high_cmds = high_cmds;
+    ac->flow.low_cmds = low_cmds;
+    ac->flow.fn = fn;
+    ac->flow.privdata = privdata;
+    ac->flow.full = 0;
+    return REDIS_OK;
+}
+
 /* Helper functions to push/shift callbacks */
 static int __redisPushCallback(redisCallbackList *list, redisCallback *source) {
     redisCallback *cb;
@@ -271,33 +322,110 @@ static void __redisRunCallback(redisAsyncContext *ac, redisCallback *cb, redisRe
     }
 }
 
+/* Free a batch together with the replies it collected so far. The replies
+ * were created by the reader, so they are free'd the same way. */
+static void __redisFreeBatch(redisContext *c, redisAsyncBatch *b) {
+    size_t j;
+
+    if (b->reply != NULL) {
+        if (c->reader->fn && c->reader->fn->freeObject) {
+            for (j = 0; j < b->received; j++)
+                c->reader->fn->freeObject(b->reply->element[j]);
+        }
+        free(b->reply->element);
+        free(b->reply);
+    }
+    sdsfree(b->cmds);
+    free(b);
+}
+
+/* The flow callback may run while a reply callback is executing, when that
+ * reply callback issued the command that hit the high water mark. */
+static void __redisRunFlowCallback(redisAsyncContext *ac, int full) {
+    redisContext *c = &(ac->c);
+    int nested = c->flags & REDIS_IN_CALLBACK;
+
+    ac->flow.full = full;
+    if (ac->flow.fn != NULL) {
+        c->flags |= REDIS_IN_CALLBACK;
+        ac->flow.fn(ac,full,ac->flow.privdata);
+        if (!nested)
+            c->flags &= ~REDIS_IN_CALLBACK;
+    }
+}
+
+/* Bytes waiting to be written, including the ones held back by
+ * redisAsyncSetConnectOptions(). */
+static size_t __redisAsyncOutputLen(redisAsyncContext *ac) {
+    size_t len = sdslen(ac->c.obuf);
+
+    if (ac->setup.held != NULL)
+        len += sdslen(ac->setup.held);
+    return len;
+}
+
+/* Called after commands were appended. */
+static void __redisAsyncCheckHighWater(redisAsyncContext *ac) {
+    if (ac->flow.full)
+        return;
+    if ((ac->flow.high_bytes && __redisAsyncOutputLen(ac) >= ac->flow.high_bytes) ||
+        (ac->flow.high_cmds && ac->flow.pending >= ac->flow.high_cmds))
+        __redisRunFlowCallback(ac,1);
+}
+
+/* Called after the output buffer was written or replies were read. */
+static void __redisAsyncCheckLowWater(redisAsyncContext *ac) {
+    if (!ac->flow.full)
+        return;
+    if ((!ac->flow.high_bytes || __redisAsyncOutputLen(ac) <= ac->flow.low_bytes) &&
+        (!ac->flow.high_cmds || ac->flow.pending <= ac->flow.low_cmds))
+        __redisRunFlowCallback(ac,0);
+}
+
+static redisQueuedCommand *__redisQueuePop(redisAsyncQueue *q);
+
 /* Helper function to free the context. */
 static void __redisAsyncFree(redisAsyncContext *ac) {
     redisContext *c = &(ac->c);
     redisCallback cb;
-    dictIterator *it;
-    dictEntry *de;
+    redisQueuedCommand *qc;
+    redisCallback *sub;
+    unsigned long pos;
 
     /* Execute pending callbacks with NULL reply. */
-    while (__redisShiftCallback(&ac->replies,&cb) == REDIS_OK)
+    while (__redisShiftCallback(&ac->replies,&cb) == REDIS_OK) {
         __redisRunCallback(ac,&cb,NULL);
+        if (cb.batch != NULL)
+            __redisFreeBatch(c,cb.batch);
+    }
+
+    /* Commands queued by other threads never reach the context, just like
+     * the ones pushed after the queue is detached here. */
+    if (ac->queue != NULL) {
+        while ((qc = __redisQueuePop(ac->queue)) != NULL) {
+            if (qc->fn != NULL)
+                qc->fn(NULL,NULL,qc->privdata);
+            free(qc->cmd);
+            free(qc);
+        }
+        ac->queue->ac = NULL;
+        ac->queue = NULL;
+    }
 
     /* Execute callbacks for invalid commands */
     while (__redisShiftCallback(&ac->sub.invalid,&cb) == REDIS_OK)
         __redisRunCallback(ac,&cb,NULL);
 
     /* Run subscription callbacks callbacks with NULL reply */
-    it = dictGetIterator(ac->sub.channels);
-    while ((de = dictNext(it)) != NULL)
-        __redisRunCallback(ac,dictGetEntryVal(de),NULL);
-    dictReleaseIterator(it);
-    dictRelease(ac->sub.channels);
-
-    it = dictGetIterator(ac->sub.patterns);
-    while ((de = dictNext(it)) != NULL)
-        __redisRunCallback(ac,dictGetEntryVal(de),NULL);
-    dictReleaseIterator(it);
-    dictRelease(ac->sub.patterns);
+    pos = 0;
+    while ((sub = subTableNext(ac->sub.channels,&pos)) != NULL)
+        __redisRunCallback(ac,sub,NULL);
+    subTableRelease(ac->sub.channels);
+
+    pos = 0;
+    while ((sub = subTableNext(ac->sub.patterns,&pos)) != NULL)
+        __redisRunCallback(ac,sub,NULL);
+    subTableRelease(ac->sub.patterns);
 
     /* Signal event lib to clean up */
     _EL_CLEANUP(ac);
@@ -313,6 +441,7 @@ static void __redisAsyncFree(redisAsyncContext *ac) {
     }
 
     /* Cleanup self */
+    sdsfree(ac->setup.held);
     redisFree(c);
 }
 
@@ -363,11 +492,11 @@ void redisAsyncDisconnect(redisAsyncContext *ac) {
 
 static int __redisGetSubscribeCallback(redisAsyncContext *ac, redisReply *reply, redisCallback *dstcb) {
     redisContext *c = &(ac->c);
-    dict *callbacks;
-    dictEntry *de;
+    subTable *callbacks;
+    redisCallback *cb;
+    redisReply *name;
     int pvariant;
     char *stype;
-    sds sname;
 
     /* Custom reply functions are not supported for pub/sub. This will fail
      * very hard when they are used... */
@@ -384,14 +513,14 @@ static int __redisGetSubscribeCallback(redisAsyncContext *ac, redisReply *reply,
 
         /* Locate the right callback */
         assert(reply->element[1]->type == REDIS_REPLY_STRING);
-        sname = sdsnewlen(reply->element[1]->str,reply->element[1]->len);
-        de = dictFind(callbacks,sname);
-        if (de != NULL) {
-            memcpy(dstcb,dictGetEntryVal(de),sizeof(*dstcb));
+        name = reply->element[1];
+        cb = subTableFind(callbacks,name->str,name->len);
+        if (cb != NULL) {
+            memcpy(dstcb,cb,sizeof(*dstcb));
 
             /* If this is an unsubscribe message, remove it. */
             if (strcasecmp(stype+pvariant,"unsubscribe") == 0) {
-                dictDelete(callbacks,sname);
+                subTableDelete(callbacks,name->str,name->len);
 
                 /* If this was the last unsubscribe message, revert to
                  * non-subscribe mode. */
@@ -400,21 +529,70 @@ static int __redisGetSubscribeCallback(redisAsyncContext *ac, redisReply *reply,
                     c->flags &= ~REDIS_SUBSCRIBED;
             }
         }
-        sdsfree(sname);
     } else {
         /* Shift callback for invalid commands. */
-        __redisShiftCallback(&ac->sub.invalid,dstcb);
+        if (__redisShiftCallback(&ac->sub.invalid,dstcb) == REDIS_OK &&
+            dstcb->counted && ac->flow.pending > 0)
+            ac->flow.pending--;
     }
     return REDIS_OK;
 }
 
+void redisAsyncSetReadBudget(redisAsyncContext *ac, unsigned int max_replies,
+                             long max_usec, unsigned int max_reads)
+{
+    ac->budget.max_replies = max_replies;
+    ac->budget.max_usec = max_usec;
+    ac->budget.max_reads = max_reads;
+}
+
+static long long __redisMonotonicUsec(void) {
+#if defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return ((long long)ts.tv_sec)*1000000+ts.tv_nsec/1000;
+#else
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return ((long long)tv.tv_sec)*1000000+tv.tv_usec;
+#endif
+}
+
+/* Returns 1 when no more replies should be handled during this loop tick,
+ * after asking to be called again on the next one. Only replies that were
+ * already read are left for later: with nothing buffered, the next read
+ * event comes on its own. */
+static int __redisAsyncBudgetSpent(redisAsyncContext *ac, unsigned int handled, long long start) {
+    redisReader *r = ac->c.reader;
+
+    if (r->pos >= r->len)
+        return 0;
+    if ((ac->budget.max_replies && handled >= ac->budget.max_replies) ||
+        (ac->budget.max_usec && handled > 0 &&
+         __redisMonotonicUsec()-start >= ac->budget.max_usec))
+    {
+        ac->budget.deferred = 1;
+        _EL_ADD_WRITE(ac);
+        return 1;
+    }
+    return 0;
+}
+
 void redisProcessCallbacks(redisAsyncContext *ac) {
     redisContext *c = &(ac->c);
-    redisCallback cb = {NULL, NULL, NULL};
+    redisCallback cb = {NULL, NULL, NULL, NULL, 0};
+    redisAsyncBatch *b;
     void *reply = NULL;
-    int status;
+    int status = REDIS_OK;
+    unsigned int handled = 0;
+    long long start = 0;
+
+    ac->budget.deferred = 0;
+    if (ac->budget.max_usec)
+        start = __redisMonotonicUsec();
 
-    while((status = redisGetReply(c,&reply)) == REDIS_OK) {
+    while(!__redisAsyncBudgetSpent(ac,handled++,start) &&
+          (status = redisGetReply(c,&reply)) == REDIS_OK) {
         if (reply == NULL) {
             /* When the connection is being disconnected and there are
              * no more replies, this is the cue to really disconnect. */
@@ -434,9 +612,34 @@ void redisProcessCallbacks(redisAsyncContext *ac) {
             break;
         }
 
+        /* Replies to a batch are collected without running anything until
+         * the last one arrives. */
+        if (ac->replies.head != NULL && (b = ac->replies.head->batch) != NULL) {
+            b->reply->element[b->received++] = reply;
+            if (ac->flow.pending > 0)
+                ac->flow.pending--;
+            if (b->received < b->count)
+                continue;
+
+            __redisShiftCallback(&ac->replies,&cb);
+            __redisRunCallback(ac,&cb,b->reply);
+            __redisFreeBatch(c,b);
+
+            /* Proceed with free'ing when redisAsyncFree() was called. */
+            if (c->flags & REDIS_FREEING) {
+                __redisAsyncFree(ac);
+                return;
+            }
+            continue;
+        }
+
         /* Even if the context is subscribed, pending regular callbacks will
          * get a reply before pub/sub messages arrive. */
-        if (__redisShiftCallback(&ac->replies,&cb) != REDIS_OK) {
+        if (__redisShiftCallback(&ac->replies,&cb) == REDIS_OK) {
+            /* Not the MONITOR callback, which stays for every reply. */
+            if (cb.counted && ac->flow.pending > 0)
+                ac->flow.pending--;
+        } else {
             /*
              * A spontaneous reply in a not-subscribed context can be the error
              * reply that is sent when a new connection exceeds the maximum
@@ -474,6 +677,12 @@ void redisProcessCallbacks(redisAsyncContext *ac) {
                 __redisAsyncFree(ac);
                 return;
             }
+
+            /* A setup command failed, see redisAsyncSetConnectOptions(). */
+            if (c->err) {
+                __redisAsyncDisconnect(ac);
+                return;
+            }
         } else {
             /* No callback for this reply. This can either be a NULL callback,
              * or there were no callbacks to begin with. Either way, don't
@@ -484,8 +693,14 @@ void redisProcessCallbacks(redisAsyncContext *ac) {
     }
 
     /* Disconnect when there was an error reading the reply */
-    if (status != REDIS_OK)
+    if (status != REDIS_OK) {
         __redisAsyncDisconnect(ac);
+        return;
+    }
+
+    __redisAsyncCheckLowWater(ac);
+    if (c->flags & REDIS_FREEING)
+        __redisAsyncFree(ac);
 }
 
 /* Internal helper function to detect socket status the first time a read or
@@ -494,6 +709,18 @@ void redisProcessCallbacks(redisAsyncContext *ac) {
 static int __redisAsyncHandleConnect(redisAsyncContext *ac) {
     redisContext *c = &(ac->c);
 
+    if (c->flags & REDIS_CONNECT_DEFERRED) {
+        /* Connect now, sending along the commands issued so far. Whether
+         * that worked is known on the next write event. */
+        if (redisBufferWrite(c,NULL) == REDIS_ERR) {
+            if (ac->onConnect) ac->onConnect(ac,REDIS_ERR);
+            __redisAsyncDisconnect(ac);
+            return REDIS_ERR;
+        }
+        _EL_ADD_WRITE(ac);
+        return REDIS_OK;
+    }
+
     if (redisCheckSocketError(c) == REDIS_ERR) {
         /* Try again later when connect(2) is still in progress. */
         if (errno == EINPROGRESS)
@@ -504,6 +731,27 @@ static int __redisAsyncHandleConnect(redisAsyncContext *ac) {
         return REDIS_ERR;
     }
 
+    /* The transport finishes setting up the connection first, waiting for
+     * the events it asks for. */
+    if (c->flags & REDIS_HANDSHAKE) {
+        if (c->transport->handshake(c) != REDIS_OK) {
+            if (ac->onConnect) ac->onConnect(ac,REDIS_ERR);
+            __redisAsyncDisconnect(ac);
+            return REDIS_ERR;
+        }
+        if (c->flags & REDIS_HANDSHAKE) {
+            if (c->flags & REDIS_HANDSHAKE_WRITE)
+                _EL_ADD_WRITE(ac);
+            else
+                _EL_DEL_WRITE(ac);
+            _EL_ADD_READ(ac);
+            return REDIS_OK;
+        }
+        /* Commands issued in the meantime go out on the next write event. */
+        if (sdslen(c->obuf) > 0)
+            _EL_ADD_WRITE(ac);
+    }
+
     /* Mark context as connected. */
     c->flags |= REDIS_CONNECTED;
     if (ac->onConnect) ac->onConnect(ac,REDIS_OK);
@@ -515,6 +763,8 @@ static int __redisAsyncHandleConnect(redisAsyncContext *ac) {
  */
 void redisAsyncHandleRead(redisAsyncContext *ac) {
     redisContext *c = &(ac->c);
+    unsigned int reads = 0;
+    size_t before;
 
     if (!(c->flags & REDIS_CONNECTED)) {
         /* Abort connect was not successful. */
@@ -525,13 +775,24 @@ void redisAsyncHandleRead(redisAsyncContext *ac) {
             return;
     }
 
-    if (redisBufferRead(c) == REDIS_ERR) {
-        __redisAsyncDisconnect(ac);
-    } else {
-        /* Always re-schedule reads */
-        _EL_ADD_READ(ac);
-        redisProcessCallbacks(ac);
-    }
+    /* Keep reading while the socket is hot, that is while every read fills
+     * the whole buffer, up to the configured number of reads. */
+    do {
+        before = c->reader->len;
+        if (redisBufferRead(c) == REDIS_ERR) {
+            __redisAsyncDisconnect(ac);
+            return;
+        }
+    } while (++reads < ac->budget.max_reads &&
+             c->reader->len-before == REDIS_IOBUF_LEN);
+
+    /* A short read means the socket was drained. Edge-triggered adapters
+     * use this to know when to wait for the next event. */
+    ac->budget.drained = (c->reader->len-before < REDIS_IOBUF_LEN);
+
+    /* Always re-schedule reads */
+    _EL_ADD_READ(ac);
+    redisProcessCallbacks(ac);
 }
 
 void redisAsyncHandleWrite(redisAsyncContext *ac) {
@@ -558,6 +819,16 @@ void redisAsyncHandleWrite(redisAsyncContext *ac) {
 
         /* Always schedule reads after writes */
         _EL_ADD_READ(ac);
+
+        __redisAsyncCheckLowWater(ac);
+        if (c->flags & REDIS_FREEING) {
+            __redisAsyncFree(ac);
+            return;
+        }
+
+        /* Handle the replies that were left by the previous read event. */
+        if (ac->budget.deferred)
+            redisProcessCallbacks(ac);
     }
 }
 
@@ -577,6 +848,28 @@ static const char *nextArgument(const char *start, const char **str, size_t *len
     return p+2+(*len)+2;
 }
 
+/* Appends commands to the output buffer, or holds them back while the
+ * setup commands of redisAsyncSetConnectOptions() wait for their replies. */
+static void __redisAsyncAppend(redisAsyncContext *ac, const char *cmd, size_t len) {
+    redisContext *c = &(ac->c);
+    sds held;
+
+    if (ac->setup.pending == 0) {
+        __redisAppendCommand(c,cmd,len);
+
+        /* Always schedule a write when the write buffer is non-empty */
+        _EL_ADD_WRITE(ac);
+        return;
+    }
+
+    held = ac->setup.held ? ac->setup.held : sdsempty();
+    if (held == NULL || (held = sdscatlen(held,cmd,len)) == NULL) {
+        __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
+        return;
+    }
+    ac->setup.held = held;
+}
+
 /* Helper function for the redisAsyncCommand* family of functions. Writes a
  * formatted command to the output buffer and registers the provided callback
  * function with the context. */
@@ -587,15 +880,18 @@ static int __redisAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, void
     const char *cstr, *astr;
     size_t clen, alen;
     const char *p;
-    sds sname;
     int ret;
 
-    /* Don't accept new commands when the connection is about to be closed. */
+    /* Don't accept new commands when the connection is about to be closed,
+     * or when it has to drain first. */
     if (c->flags & (REDIS_DISCONNECTING | REDIS_FREEING)) return REDIS_ERR;
+    if (ac->flow.full) return REDIS_ERR;
 
     /* Setup callback */
     cb.fn = fn;
     cb.privdata = privdata;
+    cb.batch = NULL;
+    cb.counted = 0;
 
     /* Find out which command will be appended. */
     p = nextArgument(cmd,&cstr,&clen);
@@ -610,13 +906,12 @@ static int __redisAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, void
 
         /* Add every channel/pattern to the list of subscription callbacks. */
         while ((p = nextArgument(p,&astr,&alen)) != NULL) {
-            sname = sdsnewlen(astr,alen);
             if (pvariant)
-                ret = dictReplace(ac->sub.patterns,sname,&cb);
+                ret = subTableReplace(ac->sub.patterns,astr,alen,&cb);
             else
-                ret = dictReplace(ac->sub.channels,sname,&cb);
+                ret = subTableReplace(ac->sub.channels,astr,alen,&cb);
 
-            if (ret == 0) sdsfree(sname);
+            if (ret == -1) return REDIS_ERR;
         }
     } else if (strncasecmp(cstr,"unsubscribe\r\n",13) == 0) {
         /* It is only useful to call (P)UNSUBSCRIBE when the context is
@@ -631,19 +926,21 @@ static int __redisAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, void
          c->flags |= REDIS_MONITORING;
          __redisPushCallback(&ac->replies,&cb);
     } else {
+        cb.counted = 1;
         if (c->flags & REDIS_SUBSCRIBED)
             /* This will likely result in an error reply, but it needs to be
              * received and passed to the callback. */
             __redisPushCallback(&ac->sub.invalid,&cb);
         else
             __redisPushCallback(&ac->replies,&cb);
+        ac->flow.pending++;
     }
 
-    __redisAppendCommand(c,cmd,len);
-
-    /* Always schedule a write when the write buffer is non-empty */
-    _EL_ADD_WRITE(ac);
+    __redisAsyncAppend(ac,cmd,len);
 
+    __redisAsyncCheckHighWater(ac);
+    if ((c->flags & REDIS_FREEING) && !(c->flags & REDIS_IN_CALLBACK))
+        __redisAsyncFree(ac);
     return REDIS_OK;
 }
 
@@ -686,6 +983,367 @@ int redisAsyncFormattedCommand(redisAsyncContext *ac, redisCallbackFn *fn, void
     return status;
 }
 
+/* Writes the commands held back once the last setup command succeeded. A
+ * failed one sets the error that disconnects the context instead. */
+static void __redisAsyncConnectOptionsCallback(redisAsyncContext *ac, void *reply, void *privdata) {
+    redisContext *c = &(ac->c);
+
+    if (reply == NULL || __redisCheckConnectReply(c,privdata,reply) != REDIS_OK)
+        return;
+    if (--ac->setup.pending > 0 || ac->setup.held == NULL)
+        return;
+    __redisAppendCommand(c,ac->setup.held,sdslen(ac->setup.held));
+    sdsfree(ac->setup.held);
+    ac->setup.held = NULL;
+    _EL_ADD_WRITE(ac);
+}
+
+int redisAsyncSetConnectOptions(redisAsyncContext *ac, const redisConnectOptions *opts) {
+    redisContext *c = &(ac->c);
+    const char *names[REDIS_CONNECT_OPTIONS_MAX];
+    size_t lens[REDIS_CONNECT_OPTIONS_MAX], off = 0;
+    sds cmds;
+    int j, n, status = REDIS_OK;
+
+    /* The setup commands have to go first. */
+    if (ac->replies.head != NULL || sdslen(c->obuf) > 0 || ac->setup.pending > 0) {
+        __redisSetError(c,REDIS_ERR_OTHER,"Connect options need a context without pending replies");
+        __redisAsyncCopyError(ac);
+        return REDIS_ERR;
+    }
+
+    if (__redisSetConnectOptions(c,opts) != REDIS_OK) {
+        __redisAsyncCopyError(ac);
+        return REDIS_ERR;
+    }
+    if ((cmds = __redisFormatConnectOptions(c,names,lens,&n)) == NULL)
+        return REDIS_ERR;
+    for (j = 0; j < n && status == REDIS_OK; j++) {
+        status = __redisAsyncCommand(ac,__redisAsyncConnectOptionsCallback,
+                                     (void*)names[j],cmds+off,lens[j]);
+        off += lens[j];
+    }
+    sdsfree(cmds);
+    if (status == REDIS_OK)
+        ac->setup.pending = n;
+    return status;
+}
+
+redisAsyncBatch *redisAsyncBatchBegin(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata) {
+    redisAsyncBatch *b;
+
+    b = calloc(1,sizeof(*b));
+    if (b == NULL)
+        return NULL;
+
+    b->cmds = sdsempty();
+    if (b->cmds == NULL) {
+        free(b);
+        return NULL;
+    }
+
+    b->ac = ac;
+    b->fn = fn;
+    b->privdata = privdata;
+    return b;
+}
+
+/* Helper function for the redisAsyncBatchAdd* family of functions. Commands
+ * that change how replies are delivered are refused. */
+static int __redisAsyncBatchAdd(redisAsyncBatch *b, const char *cmd, size_t len) {
+    const char *cstr;
+    size_t clen;
+    sds newbuf;
+
+    if (nextArgument(cmd,&cstr,&clen) == NULL)
+        return REDIS_ERR;
+    if (tolower(cstr[0]) == 'p') {
+        cstr++;
+        clen--;
+    }
+    if ((clen == 9 && strncasecmp(cstr,"subscribe",9) == 0) ||
+        (clen == 11 && strncasecmp(cstr,"unsubscribe",11) == 0) ||
+        (clen == 7 && strncasecmp(cstr,"monitor",7) == 0))
+        return REDIS_ERR;
+
+    newbuf = sdscatlen(b->cmds,cmd,len);
+    if (newbuf == NULL)
+        return REDIS_ERR;
+
+    b->cmds = newbuf;
+    b->count++;
+    return REDIS_OK;
+}
+
+int redisvAsyncBatchAdd(redisAsyncBatch *b, const char *format, va_list ap) {
+    char *cmd;
+    int len;
+    int status;
+    len = redisvFormatCommand(&cmd,format,ap);
+
+    /* We don't want to pass -1 or -2 to future functions as a length. */
+    if (len < 0)
+        return REDIS_ERR;
+
+    status = __redisAsyncBatchAdd(b,cmd,len);
+    free(cmd);
+    return status;
+}
+
+int redisAsyncBatchAdd(redisAsyncBatch *b, const char *format, ...) {
+    va_list ap;
+    int status;
+    va_start(ap,format);
+    status = redisvAsyncBatchAdd(b,format,ap);
+    va_end(ap);
+    return status;
+}
+
+int redisAsyncBatchAddArgv(redisAsyncBatch *b, int argc, const char **argv, const size_t *argvlen) {
+    sds cmd;
+    int len;
+    int status;
+    len = redisFormatSdsCommandArgv(&cmd,argc,argv,argvlen);
+    if (len < 0)
+        return REDIS_ERR;
+    status = __redisAsyncBatchAdd(b,cmd,len);
+    sdsfree(cmd);
+    return status;
+}
+
+/* Append all commands of the batch to the output buffer at once and register
+ * a single callback entry for them. The batch is free'd in any case. */
+int redisAsyncBatchCommit(redisAsyncBatch *b) {
+    redisAsyncContext *ac = b->ac;
+    redisContext *c = &(ac->c);
+    redisCallback cb;
+
+    /* Don't accept new commands when the connection is about to be closed,
+     * and subscribed contexts only expect pub/sub traffic. */
+    if (b->count == 0 || ac->flow.full ||
+        (c->flags & (REDIS_DISCONNECTING | REDIS_FREEING |
+                     REDIS_SUBSCRIBED | REDIS_MONITORING)))
+        goto error;
+
+    b->reply = calloc(1,sizeof(*b->reply));
+    if (b->reply == NULL)
+        goto error;
+    b->reply->type = REDIS_REPLY_ARRAY;
+    b->reply->elements = b->count;
+    b->reply->element = calloc(b->count,sizeof(redisReply*));
+    if (b->reply->element == NULL)
+        goto error;
+
+    cb.fn = b->fn;
+    cb.privdata = b->privdata;
+    cb.batch = b;
+    cb.counted = 0; /* the replies are counted one by one */
+    if (__redisPushCallback(&ac->replies,&cb) != REDIS_OK)
+        goto error;
+
+    __redisAsyncAppend(ac,b->cmds,sdslen(b->cmds));
+    sdsfree(b->cmds);
+    b->cmds = NULL;
+    ac->flow.pending += b->count;
+
+    __redisAsyncCheckHighWater(ac);
+    if ((c->flags & REDIS_FREEING) && !(c->flags & REDIS_IN_CALLBACK))
+        __redisAsyncFree(ac);
+    return REDIS_OK;
+
+error:
+    __redisFreeBatch(c,b);
+    return REDIS_ERR;
+}
+
+void redisAsyncBatchDiscard(redisAsyncBatch *b) {
+    __redisFreeBatch(&b->ac->c,b);
+}
+
+redisAsyncQueue *redisAsyncQueueCreate(redisAsyncContext *ac) {
+    redisAsyncQueue *q;
+    int fds[2];
+
+    /* A context has a single queue, every thread can push on it. */
+    if (ac->queue != NULL)
+        return NULL;
+
+    q = calloc(1,sizeof(*q));
+    if (q == NULL)
+        return NULL;
+
+#ifdef __linux__
+    fds[0] = fds[1] = eventfd(0,EFD_NONBLOCK|EFD_CLOEXEC);
+    if (fds[0] == -1) {
+        free(q);
+        return NULL;
+    }
+#else
+    if (pipe(fds) == -1) {
+        free(q);
+        return NULL;
+    }
+    fcntl(fds[0],F_SETFL,fcntl(fds[0],F_GETFL) | O_NONBLOCK);
+    fcntl(fds[1],F_SETFL,fcntl(fds[1],F_GETFL) | O_NONBLOCK);
+    fcntl(fds[0],F_SETFD,FD_CLOEXEC);
+    fcntl(fds[1],F_SETFD,FD_CLOEXEC);
+#endif
+
+    q->ac = ac;
+    q->head = q->tail = &q->stub;
+    q->rfd = fds[0];
+    q->wfd = fds[1];
+    ac->queue = q;
+    return q;
+}
+
+int redisAsyncQueueFd(redisAsyncQueue *q) {
+    return q->rfd;
+}
+
+static void __redisQueueLink(redisAsyncQueue *q, redisQueuedCommand *qc) {
+    redisQueuedCommand *prev;
+
+    __atomic_store_n(&qc->next,NULL,__ATOMIC_RELAXED);
+    prev = __atomic_exchange_n(&q->head,qc,__ATOMIC_ACQ_REL);
+    /* Until the next pointer is set, the consumer can't see past prev. */
+    __atomic_store_n(&prev->next,qc,__ATOMIC_SEQ_CST);
+}
+
+/* Only called from the event loop thread. Returns NULL when the queue is
+ * empty, or when a producer is in the middle of linking its node: that
+ * producer signals the queue afterwards. */
+static redisQueuedCommand *__redisQueuePop(redisAsyncQueue *q) {
+    redisQueuedCommand *tail = q->tail;
+    redisQueuedCommand *next = __atomic_load_n(&tail->next,__ATOMIC_SEQ_CST);
+
+    if (tail == &q->stub) {
+        if (next == NULL)
+            return NULL;
+        q->tail = tail = next;
+        next = __atomic_load_n(&tail->next,__ATOMIC_SEQ_CST);
+    }
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
+    }
+
+    /* The tail is the last node: put the stub back behind it before it is
+     * handed out, so the queue is never empty. */
+    if (tail != __atomic_load_n(&q->head,__ATOMIC_SEQ_CST))
+        return NULL;
+    __redisQueueLink(q,&q->stub);
+    next = __atomic_load_n(&tail->next,__ATOMIC_SEQ_CST);
+    if (next != NULL) {
+        q->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+/* Takes ownership of cmd. */
+static int __redisAsyncQueuePush(redisAsyncQueue *q, redisCallbackFn *fn, void *privdata, char *cmd, int len) {
+    redisQueuedCommand *qc;
+    uint64_t one = 1;
+
+    /* We don't want to pass -1 or -2 to future functions as a length. */
+    if (len < 0)
+        return REDIS_ERR;
+
+    qc = malloc(sizeof(*qc));
+    if (qc == NULL) {
+        free(cmd);
+        return REDIS_ERR;
+    }
+    qc->fn = fn;
+    qc->privdata = privdata;
+    qc->cmd = cmd;
+    qc->len = len;
+    __redisQueueLink(q,qc);
+
+    /* Only wake up the event loop once per drain. A failed write means the
+     * descriptor is readable already. */
+    if (__atomic_exchange_n(&q->signaled,1,__ATOMIC_SEQ_CST) == 0) {
+#ifdef __linux__
+        if (write(q->wfd,&one,sizeof(one)) == -1) { /* Nothing to do */ }
+#else
+        if (write(q->wfd,&one,1) == -1) { /* Nothing to do */ }
+#endif
+    }
+    return REDIS_OK;
+}
+
+int redisvAsyncQueueCommand(redisAsyncQueue *q, redisCallbackFn *fn, void *privdata, const char *format, va_list ap) {
+    char *cmd;
+    int len;
+    len = redisvFormatCommand(&cmd,format,ap);
+    return __redisAsyncQueuePush(q,fn,privdata,cmd,len);
+}
+
+int redisAsyncQueueCommand(redisAsyncQueue *q, redisCallbackFn *fn, void *privdata, const char *format, ...) {
+    va_list ap;
+    int status;
+    va_start(ap,format);
+    status = redisvAsyncQueueCommand(q,fn,privdata,format,ap);
+    va_end(ap);
+    return status;
+}
+
+int redisAsyncQueueCommandArgv(redisAsyncQueue *q, redisCallbackFn *fn, void *privdata, int argc, const char **argv, const size_t *argvlen) {
+    char *cmd;
+    int len;
+    len = redisFormatCommandArgv(&cmd,argc,argv,argvlen);
+    return __redisAsyncQueuePush(q,fn,privdata,cmd,len);
+}
+
+/* Append everything that was queued to the context. Call this from the event
+ * loop thread when the queue descriptor is readable. */
+void redisAsyncQueueDrain(redisAsyncQueue *q) {
+    redisAsyncContext *ac;
+    redisContext *c;
+    redisQueuedCommand *qc;
+    redisCallback cb;
+    char buf[64];
+    int nested;
+
+    /* Reset the signal before popping: a push that isn't seen by this drain
+     * makes the descriptor readable again. */
+    while (read(q->rfd,buf,sizeof(buf)) > 0 && q->rfd != q->wfd);
+    __atomic_store_n(&q->signaled,0,__ATOMIC_SEQ_CST);
+
+    while ((qc = __redisQueuePop(q)) != NULL) {
+        /* The context can be free'd while draining. */
+        ac = q->ac;
+        if (ac == NULL) {
+            if (qc->fn != NULL)
+                qc->fn(NULL,NULL,qc->privdata);
+        } else if (__redisAsyncCommand(ac,qc->fn,qc->privdata,qc->cmd,qc->len) != REDIS_OK) {
+            c = &(ac->c);
+            nested = c->flags & REDIS_IN_CALLBACK;
+            cb.fn = qc->fn;
+            cb.privdata = qc->privdata;
+            cb.batch = NULL;
+            __redisRunCallback(ac,&cb,NULL);
+            c->flags |= nested;
+            if ((c->flags & REDIS_FREEING) && !nested)
+                __redisAsyncFree(ac);
+        }
+        free(qc->cmd);
+        free(qc);
+    }
+}
+
+void redisAsyncQueueFree(redisAsyncQueue *q) {
+    /* Commands that weren't drained yet are handled like any other. */
+    redisAsyncQueueDrain(q);
+    if (q->ac != NULL)
+        q->ac->queue = NULL;
+    close(q->rfd);
+    if (q->wfd != q->rfd)
+        close(q->wfd);
+    free(q);
+}
+
 redisAsyncContext *redisAsyncUpgradeContext(redisContext *c) {
     if (redisUpgradeToNonBlocking(c))
       return NULL;
@@ -38,7 +38,9 @@ extern "C" {
 #endif
 
 struct redisAsyncContext; /* need forward declaration of redisAsyncContext */
-struct dict; /* dictionary header is included in async.c */
+struct subTable; /* subscription table header is included in async.c */
+struct redisAsyncBatch; /* batch internals are private to async.c */
+struct redisAsyncQueue; /* submission queue internals are private to async.c */
 
 /* Reply callback prototype and container */
 typedef void (redisCallbackFn)(struct redisAsyncContext*, void*, void*);
@@ -46,8 +48,13 @@ typedef struct redisCallback {
     struct redisCallback *next; /* simple singly linked list */
     redisCallbackFn *fn;
     void *privdata;
+    struct redisAsyncBatch *batch; /* set when this callback covers a batch */
+    int counted; /* counted in flow.pending until its reply arrives */
 } redisCallback;
 
+typedef struct redisAsyncBatch redisAsyncBatch;
+typedef struct redisAsyncQueue redisAsyncQueue;
+
 /* List of callbacks for either regular replies or pub/sub */
 typedef struct redisCallbackList {
     redisCallback *head, *tail;
@@ -57,6 +64,10 @@ typedef struct redisCallbackList {
 typedef void (redisDisconnectCallback)(const struct redisAsyncContext*, int status);
 typedef void (redisConnectCallback)(const struct redisAsyncContext*, int status);
 
+/* Flow control callback prototype. "full" is set when a high water mark was
+ * reached and reset when the context drained below the low water marks. */
+typedef void (redisFlowCallback)(struct redisAsyncContext*, int full, void *privdata);
+
 /* Context for an async connection to Redis */
 typedef struct redisAsyncContext {
     /* Hold the regular context, so it can be realloc'ed. */
@@ -95,25 +106,80 @@ typedef struct redisAsyncContext {
     /* Subscription callbacks */
     struct {
         redisCallbackList invalid;
-        struct dict *channels;
-        struct dict *patterns;
+        struct subTable *channels;
+        struct subTable *patterns;
     } sub;
+
+    /* Limits on the output buffer and on the number of commands that wait
+     * for a reply. A limit of 0 means no limit. */
+    struct {
+        size_t high_bytes, low_bytes;
+        unsigned int high_cmds, low_cmds;
+        unsigned int pending; /* commands waiting for a reply */
+        int full; /* new commands are refused while set */
+        redisFlowCallback *fn;
+        void *privdata;
+    } flow;
+
+    /* Limits on the work done for a single read event. 0 means no limit. */
+    struct {
+        unsigned int max_replies;
+        long max_usec;
+        unsigned int max_reads;
+        int deferred; /* set when replies were left for the next loop tick */
+        int drained; /* set when the last read didn't fill the buffer */
+    } budget;
+
+    /* Commands issued while the setup commands of redisAsyncSetConnectOptions()
+     * wait for their replies, written once every one of them succeeded. */
+    struct {
+        unsigned int pending; /* setup replies still to come */
+        char *held; /* sds of the commands held back, or NULL */
+    } setup;
+
+    /* Queue for commands submitted by other threads, see redisAsyncQueueCreate() */
+    struct redisAsyncQueue *queue;
 } redisAsyncContext;
 
 /* Used by sentinel to convert a blocking redisContext to an Async one */
 redisAsyncContext *redisAsyncUpgradeContext(redisContext *c);
 
 /* Functions that proxy to hiredis */
+/* Name lookups block: unless the resolver cache holds the host, e.g. after
+ * redisResolvePrefetch() completed, redisAsyncConnect() and its variants wait
+ * for getaddrinfo() before they return. */
 redisAsyncContext *redisAsyncConnect(const char *ip, int port);
 redisAsyncContext *redisAsyncConnectBind(const char *ip, int port, const char *source_addr);
 redisAsyncContext *redisAsyncConnectBindWithReuse(const char *ip, int port,
                                                   const char *source_addr);
 redisAsyncContext *redisAsyncConnectUnix(const char *path);
+
+/* Defers connecting to the first event, so that commands issued before go
+ * along with the handshake using TCP Fast Open, see redisConnectFastOpen(). */
+redisAsyncContext *redisAsyncConnectFastOpen(const char *ip, int port);
+
 int redisAsyncSetConnectCallback(redisAsyncContext *ac, redisConnectCallback *fn);
 int redisAsyncSetDisconnectCallback(redisAsyncContext *ac, redisDisconnectCallback *fn);
+
+/* Apply backpressure: once the output buffer holds high_bytes or high_cmds
+ * commands wait for a reply, fn is called with full=1 and new commands are
+ * refused with REDIS_ERR until both drop to their low water mark, when fn is
+ * called again with full=0. */
+int redisAsyncSetFlowControl(redisAsyncContext *ac, size_t high_bytes, size_t low_bytes,
+                             unsigned int high_cmds, unsigned int low_cmds,
+                             redisFlowCallback *fn, void *privdata);
 void redisAsyncDisconnect(redisAsyncContext *ac);
 void redisAsyncFree(redisAsyncContext *ac);
 
+/* Bound the work done by redisAsyncHandleRead(). Callbacks are run for at
+ * most max_replies replies or max_usec microseconds, after which the remaining
+ * replies are handled on the next loop tick: a write event is scheduled for
+ * this purpose, since a socket with a drained receive buffer won't fire
+ * another read event. When max_reads is larger than 1, the socket is read up
+ * to max_reads times per read event as long as every read fills the buffer. */
+void redisAsyncSetReadBudget(redisAsyncContext *ac, unsigned int max_replies,
+                             long max_usec, unsigned int max_reads);
+
 /* Handle read/write events */
 void redisAsyncHandleRead(redisAsyncContext *ac);
 void redisAsyncHandleWrite(redisAsyncContext *ac);
@@ -125,6 +191,51 @@ int redisAsyncCommand(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata
 int redisAsyncCommandArgv(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, int argc, const char **argv, const size_t *argvlen);
 int redisAsyncFormattedCommand(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata, const char *cmd, size_t len);
 
+/* Queues the setup commands of redisSetConnectOptions(), so it has to be
+ * called before any other command. Commands issued afterwards are held back
+ * until every setup command succeeded. When one fails, the context
+ * disconnects with an error such as "AUTH failed: WRONGPASS ..." and the
+ * callbacks of the held commands get a NULL reply, so none of them ever
+ * reaches the server. Unlike for blocking contexts, the options are stored
+ * before their replies arrive. */
+int redisAsyncSetConnectOptions(redisAsyncContext *ac, const redisConnectOptions *opts);
+
+/* Batches append many commands with a single callback. The callback is called
+ * once, when the reply to the last command arrives, with a REDIS_REPLY_ARRAY
+ * holding the reply to every command in order (or NULL when the context is
+ * free'd first). Commands are only written on commit; a batch is free'd by
+ * redisAsyncBatchCommit() and redisAsyncBatchDiscard(). Pub/sub and MONITOR
+ * can't be part of a batch. */
+redisAsyncBatch *redisAsyncBatchBegin(redisAsyncContext *ac, redisCallbackFn *fn, void *privdata);
+int redisvAsyncBatchAdd(redisAsyncBatch *b, const char *format, va_list ap);
+int redisAsyncBatchAdd(redisAsyncBatch *b, const char *format, ...);
+int redisAsyncBatchAddArgv(redisAsyncBatch *b, int argc, const char **argv, const size_t *argvlen);
+int redisAsyncBatchCommit(redisAsyncBatch *b);
+void redisAsyncBatchDiscard(redisAsyncBatch *b);
+
+/* Submission queues let other threads issue commands on a context. Commands
+ * are formatted by the calling thread and pushed on a lock-free queue; the
+ * first push after a drain makes the file descriptor returned by
+ * redisAsyncQueueFd() readable. The thread that runs the event loop watches
+ * this descriptor and calls redisAsyncQueueDrain(), which appends every queued
+ * command to the context at once. Commands pushed by the same thread are
+ * written in the order they were pushed.
+ *
+ * Callbacks always run on the event loop thread. When a queued command can't
+ * be appended (e.g. the context is disconnecting or full), its callback is
+ * called with a NULL reply. Commands that are still queued when the context
+ * is free'd never reach it: their callbacks are called with a NULL context and
+ * reply, either by redisAsyncFree() or by the next redisAsyncQueueDrain().
+ * redisAsyncQueueCreate() and redisAsyncQueueFree() must be called from the
+ * event loop thread, the latter only after all producers stopped. */
+redisAsyncQueue *redisAsyncQueueCreate(redisAsyncContext *ac);
+int redisAsyncQueueFd(redisAsyncQueue *q);
+int redisvAsyncQueueCommand(redisAsyncQueue *q, redisCallbackFn *fn, void *privdata, const char *format, va_list ap);
+int redisAsyncQueueCommand(redisAsyncQueue *q, redisCallbackFn *fn, void *privdata, const char *format, ...);
+int redisAsyncQueueCommandArgv(redisAsyncQueue *q, redisCallbackFn *fn, void *privdata, int argc, const char **argv, const size_t *argvlen);
+void redisAsyncQueueDrain(redisAsyncQueue *q);
+void redisAsyncQueueFree(redisAsyncQueue *q);
+
 #ifdef __cplusplus
 }
 #endif
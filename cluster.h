@@ -0,0 +1,126 @@
+#ifndef __HIREDIS_CLUSTER_H
+#define __HIREDIS_CLUSTER_H
+
+#include <stdint.h>
+#include <sys/time.h>
+
+#include "hiredis.h"
+#include "async.h"
+
+#define REDIS_CLUSTER_SLOTS 16384
+
+/* Redirections followed for a single command before its MOVED or ASK error
+ * is returned as the reply. */
+#define REDIS_CLUSTER_MAX_REDIRECTS 5
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct redisClusterContext;
+
+/* Attaches an async context created by the cluster context to an event
+ * library, e.g. a function calling redisLibeventAttach(ac,base). */
+typedef int (redisClusterAttachFn)(redisAsyncContext *ac, void *privdata);
+
+/* A master of the cluster. Connections are only set up when a command is
+ * routed to it, in the mode that command was issued in. */
+typedef struct redisClusterNode {
+    char *host;
+    int port;
+    int slots; /* number of slots it owns */
+    redisContext *c;
+    redisAsyncContext *ac;
+    struct redisClusterContext *cc;
+} redisClusterNode;
+
+/* Context for a Redis Cluster */
+typedef struct redisClusterContext {
+    int err; /* Error flags, 0 when there is no error */
+    char errstr[128]; /* String representation of error when applicable */
+
+    redisClusterNode **nodes; /* the first ones are the seeds */
+    int len;
+
+    /* Owner of every hash slot, NULL while unknown. Commands for a slot
+     * without owner go to the first node, which redirects them. */
+    redisClusterNode *slots[REDIS_CLUSTER_SLOTS];
+
+    struct timeval *timeout; /* for blocking connections, NULL blocks */
+    int max_redirects;
+
+    /* Set by MOVED and connection errors: the slot map is fetched again
+     * before the next command (blocking) or right away (async). */
+    int refresh_needed;
+    redisAsyncContext *refresh; /* async CLUSTER SLOTS in flight */
+
+    redisClusterAttachFn *attach;
+    void *attach_privdata;
+} redisClusterContext;
+
+/* CRC16 of the key, or of the part between the first '{' and the next '}'
+ * when that is not empty, modulo the number of slots. */
+uint16_t redisClusterKeySlot(const char *key, size_t len);
+void redisClusterKeySlots(const char **keys, const size_t *lens, size_t n, uint16_t *slots);
+
+/* Commands for a single node, formatted back to back so they can be written
+ * as one pipeline, e.g. with redisAppendFormattedCommand(). The j-th reply
+ * read from the node belongs to command index[j] of the input. */
+typedef struct redisClusterPipeline {
+    redisClusterNode *node;
+    sds cmds;
+    size_t *index;
+    size_t len; /* number of commands */
+} redisClusterPipeline;
+
+typedef struct redisClusterPartition {
+    redisClusterPipeline *pipelines;
+    int len;
+} redisClusterPartition;
+
+/* Creates a context for the cluster that the given seed nodes belong to,
+ * without connecting. redisClusterConnect() also fetches the slot map; its
+ * result has err set when no seed node could tell. */
+redisClusterContext *redisClusterInit(const char **hostnames, const int *ports, int len);
+redisClusterContext *redisClusterConnect(const char **hostnames, const int *ports, int len);
+redisClusterContext *redisClusterConnectWithTimeout(const char **hostnames, const int *ports, int len, const struct timeval tv);
+void redisClusterSetMaxRedirects(redisClusterContext *cc, int max_redirects);
+void redisClusterFree(redisClusterContext *cc);
+
+/* Fetches the slot map with CLUSTER SLOTS from the first node that answers. */
+int redisClusterUpdateSlots(redisClusterContext *cc);
+
+/* Blocking commands, routed by their first argument after the command name.
+ * Commands without arguments go to the first node. MOVED updates the slot
+ * map and ASK sends the command once more, preceded by ASKING, without
+ * touching it. Returns NULL and sets err on I/O errors, like redisCommand(). */
+void *redisvClusterCommand(redisClusterContext *cc, const char *format, va_list ap);
+void *redisClusterCommand(redisClusterContext *cc, const char *format, ...);
+void *redisClusterCommandArgv(redisClusterContext *cc, int argc, const char **argv, const size_t *argvlen);
+
+/* Async commands need an attach function for the connections that are set up
+ * on demand. Redirections are followed like for blocking commands; the
+ * callback only gets the final reply, with the context it came from, or a
+ * NULL reply when the connection was lost or the cluster context is free'd.
+ * A MOVED error also fetches the slot map again in the background. */
+void redisClusterSetAttach(redisClusterContext *cc, redisClusterAttachFn *fn, void *privdata);
+int redisClusterAsyncUpdateSlots(redisClusterContext *cc);
+int redisvClusterAsyncCommand(redisClusterContext *cc, redisCallbackFn *fn, void *privdata, const char *format, va_list ap);
+int redisClusterAsyncCommand(redisClusterContext *cc, redisCallbackFn *fn, void *privdata, const char *format, ...);
+int redisClusterAsyncCommandArgv(redisClusterContext *cc, redisCallbackFn *fn, void *privdata, int argc, const char **argv, const size_t *argvlen);
+
+/* Splits ncmds commands, given like for redisCommandArgv() (argvlen or any of
+ * its entries can be NULL), by the node owning the slot of their first key in
+ * the current slot map. Commands keep their relative order on every node.
+ * Returns NULL when out of memory or when a command can't be formatted. */
+redisClusterPartition *redisClusterPartitionArgv(redisClusterContext *cc, size_t ncmds, const int *argc, const char ***argv, const size_t **argvlen);
+void redisClusterFreePartition(redisClusterPartition *part);
+
+/* Gracefully closes the async connections, see redisAsyncDisconnect(). */
+void redisClusterAsyncDisconnect(redisClusterContext *cc);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,58 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+
+#include <hiredis.h>
+#include <async.h>
+#include <adapters/libevent.h>
+#include <adapters/coroutine.h>
+
+static void connectCallback(const redisAsyncContext *c, int status) {
+    if (status != REDIS_OK) {
+        printf("Error: %s\n", c->errstr);
+        return;
+    }
+    printf("Connected...\n");
+}
+
+static void disconnectCallback(const redisAsyncContext *c, int status) {
+    if (status != REDIS_OK) {
+        printf("Error: %s\n", c->errstr);
+        return;
+    }
+    printf("Disconnected...\n");
+}
+
+static RedisTask run(RedisCoroutineContext redis, const char *value) {
+    redisReply *reply;
+
+    reply = co_await redis.command("SET key %b", value, strlen(value));
+    if (reply == NULL) co_return;
+
+    reply = co_await redis.command("GET key");
+    if (reply == NULL) co_return;
+    printf("argv[end-1]: %s\n", reply->str);
+
+    /* Disconnect after receiving the reply to GET */
+    redisAsyncDisconnect(redis.context());
+}
+
+int main (int argc, char **argv) {
+    signal(SIGPIPE, SIG_IGN);
+    struct event_base *base = event_base_new();
+
+    redisAsyncContext *c = redisAsyncConnect("127.0.0.1", 6379);
+    if (c->err) {
+        /* Let *c leak for now... */
+        printf("Error: %s\n", c->errstr);
+        return 1;
+    }
+
+    redisLibeventAttach(c,base);
+    redisAsyncSetConnectCallback(c,connectCallback);
+    redisAsyncSetDisconnectCallback(c,disconnectCallback);
+    run(c, argv[argc-1]);
+    event_base_dispatch(base);
+    return 0;
+}
@@ -43,7 +43,7 @@
 #include "net.h"
 #include "sds.h"
 
-static redisReply *createReplyObject(int type);
+static redisReply *createReplyObject(const redisReadTask *task, int type);
 static void *createStringObject(const redisReadTask *task, char *str, size_t len);
 static void *createArrayObject(const redisReadTask *task, int elements);
 static void *createIntegerObject(const redisReadTask *task, long long value);
@@ -59,14 +59,25 @@ static redisReplyObjectFunctions defaultFunctions = {
     freeReplyObject
 };
 
+/* Accounts an allocation of a reply object, see redisEnableStats(). */
+static void countReplyAlloc(const redisReadTask *task, size_t size) {
+    if (task->stats) {
+        task->stats->reply_allocs++;
+        task->stats->reply_bytes += size;
+    }
+}
+
 /* Create a reply object */
-static redisReply *createReplyObject(int type) {
+static redisReply *createReplyObject(const redisReadTask *task, int type) {
     redisReply *r = calloc(1,sizeof(*r));
 
     if (r == NULL)
         return NULL;
 
     r->type = type;
+    if (task->stats)
+        task->stats->reply_objects++;
+    countReplyAlloc(task,sizeof(*r));
     return r;
 }
 
@@ -103,7 +114,7 @@ static void *createStringObject(const redisReadTask *task, char *str, size_t len
     redisReply *r, *parent;
     char *buf;
 
-    r = createReplyObject(task->type);
+    r = createReplyObject(task,task->type);
     if (r == NULL)
         return NULL;
 
@@ -112,6 +123,7 @@ static void *createStringObject(const redisReadTask *task, char *str, size_t len
         freeReplyObject(r);
         return NULL;
     }
+    countReplyAlloc(task,len+1);
 
     assert(task->type == REDIS_REPLY_ERROR  ||
            task->type == REDIS_REPLY_STATUS ||
@@ -134,7 +146,7 @@ static void *createStringObject(const redisReadTask *task, char *str, size_t len
 static void *createArrayObject(const redisReadTask *task, int elements) {
     redisReply *r, *parent;
 
-    r = createReplyObject(REDIS_REPLY_ARRAY);
+    r = createReplyObject(task,REDIS_REPLY_ARRAY);
     if (r == NULL)
         return NULL;
 
@@ -144,6 +156,7 @@ static void *createArrayObject(const redisReadTask *task, int elements) {
             freeReplyObject(r);
             return NULL;
         }
+        countReplyAlloc(task,elements*sizeof(redisReply*));
     }
 
     r->elements = elements;
@@ -159,7 +172,7 @@ static void *createArrayObject(const redisReadTask *task, int elements) {
 static void *createIntegerObject(const redisReadTask *task, long long value) {
     redisReply *r, *parent;
 
-    r = createReplyObject(REDIS_REPLY_INTEGER);
+    r = createReplyObject(task,REDIS_REPLY_INTEGER);
     if (r == NULL)
         return NULL;
 
@@ -176,7 +189,7 @@ static void *createIntegerObject(const redisReadTask *task, long long value) {
 static void *createNilObject(const redisReadTask *task) {
     redisReply *r, *parent;
 
-    r = createReplyObject(REDIS_REPLY_NIL);
+    r = createReplyObject(task,REDIS_REPLY_NIL);
     if (r == NULL)
         return NULL;
 
@@ -613,6 +626,15 @@ static redisContext *redisContextInit(void) {
     return c;
 }
 
+static void __redisFreeConnectOptions(redisConnectOptions *o) {
+    if (o == NULL)
+        return;
+    free((char*)o->username);
+    free((char*)o->password);
+    free((char*)o->name);
+    free(o);
+}
+
 void redisFree(redisContext *c) {
     if (c == NULL)
         return;
@@ -630,9 +652,49 @@ void redisFree(redisContext *c) {
         free(c->unix_sock.path);
     if (c->timeout)
         free(c->timeout);
+    free(c->saddr);
+    __redisFreeConnectOptions(c->options);
+    free(c->sockstate);
+    if (c->transport && c->transport->free)
+        c->transport->free(c->transport_privdata);
+    free(c->stats);
     free(c);
 }
 
+int redisSetTransport(redisContext *c, const redisTransport *t, void *privdata) {
+    if (t != NULL && (c->flags & REDIS_CONNECT_DEFERRED)) {
+        __redisSetError(c,REDIS_ERR_OTHER,"Transport needs a connected socket");
+        return REDIS_ERR;
+    }
+    if (c->transport && c->transport->free)
+        c->transport->free(c->transport_privdata);
+    c->transport = t;
+    c->transport_privdata = t ? privdata : NULL;
+    c->flags &= ~REDIS_HANDSHAKE;
+    return REDIS_OK;
+}
+
+int redisEnableStats(redisContext *c) {
+    if (c->stats == NULL && (c->stats = calloc(1,sizeof(*c->stats))) == NULL) {
+        __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    }
+    c->reader->stats = c->stats;
+    return REDIS_OK;
+}
+
+void redisGetStats(const redisContext *c, redisStats *stats) {
+    if (c->stats != NULL)
+        *stats = *c->stats;
+    else
+        memset(stats,0,sizeof(*stats));
+}
+
+void redisResetStats(redisContext *c) {
+    if (c->stats != NULL)
+        memset(c->stats,0,sizeof(*c->stats));
+}
+
 int redisFreeKeepFd(redisContext *c) {
     int fd = c->fd;
     c->fd = -1;
@@ -640,6 +702,190 @@ int redisFreeKeepFd(redisContext *c) {
     return fd;
 }
 
+static char *__redisStrdupNull(const char *s, int *oom) {
+    char *copy;
+
+    if (s == NULL)
+        return NULL;
+    if ((copy = strdup(s)) == NULL)
+        *oom = 1;
+    return copy;
+}
+
+/* Stores a copy of the options in the context, replacing the previous ones.
+ * NULL clears them. */
+int __redisSetConnectOptions(redisContext *c, const redisConnectOptions *opts) {
+    redisConnectOptions *o = NULL;
+    int oom = 0;
+
+    if (opts != NULL) {
+        if (opts->protocol != 0 && opts->protocol != 2) {
+            __redisSetError(c,REDIS_ERR_OTHER,"Unsupported protocol version");
+            return REDIS_ERR;
+        }
+        if (opts->username != NULL && opts->password == NULL) {
+            __redisSetError(c,REDIS_ERR_OTHER,"Username given without password");
+            return REDIS_ERR;
+        }
+        if ((o = calloc(1,sizeof(*o))) == NULL) {
+            __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
+            return REDIS_ERR;
+        }
+        o->username = __redisStrdupNull(opts->username,&oom);
+        o->password = __redisStrdupNull(opts->password,&oom);
+        o->name = __redisStrdupNull(opts->name,&oom);
+        o->db = opts->db;
+        o->protocol = opts->protocol;
+        if (oom) {
+            __redisFreeConnectOptions(o);
+            __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
+            return REDIS_ERR;
+        }
+    }
+    __redisFreeConnectOptions(c->options);
+    c->options = o;
+    return REDIS_OK;
+}
+
+/* Formats the commands for the options of the context as one pipeline. The
+ * name and length of every command go to names and lens, which have room for
+ * REDIS_CONNECT_OPTIONS_MAX of them, and their number to n. */
+sds __redisFormatConnectOptions(redisContext *c, const char **names, size_t *lens, int *n) {
+    const redisConnectOptions *o = c->options;
+    const char *argv[7];
+    char proto[16], db[16];
+    sds cmds = sdsempty(), cmd;
+    int argc, j;
+
+    *n = 0;
+    for (j = 0; cmds != NULL && o != NULL && j < REDIS_CONNECT_OPTIONS_MAX; j++) {
+        argc = 0;
+        if (j == 0 && o->protocol) {
+            /* HELLO does AUTH and CLIENT SETNAME on its own. */
+            snprintf(proto,sizeof(proto),"%d",o->protocol);
+            argv[argc++] = "HELLO";
+            argv[argc++] = proto;
+            if (o->password) {
+                argv[argc++] = "AUTH";
+                argv[argc++] = o->username ? o->username : "default";
+                argv[argc++] = o->password;
+            }
+            if (o->name) {
+                argv[argc++] = "SETNAME";
+                argv[argc++] = o->name;
+            }
+            names[*n] = "HELLO";
+        } else if (j == 0 && o->password) {
+            argv[argc++] = "AUTH";
+            if (o->username)
+                argv[argc++] = o->username;
+            argv[argc++] = o->password;
+            names[*n] = "AUTH";
+        } else if (j == 1 && o->name && !o->protocol) {
+            argv[argc++] = "CLIENT";
+            argv[argc++] = "SETNAME";
+            argv[argc++] = o->name;
+            names[*n] = "CLIENT SETNAME";
+        } else if (j == 2 && o->db) {
+            snprintf(db,sizeof(db),"%d",o->db);
+            argv[argc++] = "SELECT";
+            argv[argc++] = db;
+            names[*n] = "SELECT";
+        } else {
+            continue;
+        }
+
+        if (redisFormatSdsCommandArgv(&cmd,argc,argv,NULL) == -1) {
+            sdsfree(cmds);
+            return NULL;
+        }
+        lens[*n] = sdslen(cmd);
+        cmds = sdscatsds(cmds,cmd);
+        sdsfree(cmd);
+        (*n)++;
+    }
+    return cmds;
+}
+
+/* Sets an error on the context when the reply to the setup command name
+ * shows that it failed. */
+int __redisCheckConnectReply(redisContext *c, const char *name, redisReply *reply) {
+    char buf[128];
+
+    if (reply->type == REDIS_REPLY_ERROR) {
+        snprintf(buf,sizeof(buf),"%s failed: %s",name,reply->str);
+        __redisSetError(c,REDIS_ERR_OTHER,buf);
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+/* Sends the setup commands of a blocking context in front of anything that
+ * was appended already and checks their replies. */
+static int redisApplyConnectOptions(redisContext *c) {
+    const char *names[REDIS_CONNECT_OPTIONS_MAX];
+    size_t lens[REDIS_CONNECT_OPTIONS_MAX];
+    redisReply *reply;
+    sds cmds;
+    int j, n;
+
+    if ((cmds = __redisFormatConnectOptions(c,names,lens,&n)) == NULL) {
+        __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    }
+    if (n == 0) {
+        sdsfree(cmds);
+        return REDIS_OK;
+    }
+    if ((cmds = sdscatsds(cmds,c->obuf)) == NULL) {
+        __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    }
+    sdsfree(c->obuf);
+    c->obuf = cmds;
+
+    for (j = 0; j < n; j++) {
+        if (redisGetReply(c,(void**)&reply) != REDIS_OK)
+            return REDIS_ERR;
+        if (__redisCheckConnectReply(c,names[j],reply) != REDIS_OK) {
+            freeReplyObject(reply);
+            return REDIS_ERR;
+        }
+        freeReplyObject(reply);
+    }
+    return REDIS_OK;
+}
+
+int redisSetConnectOptions(redisContext *c, const redisConnectOptions *opts) {
+    redisConnectOptions *prev;
+
+    if (!(c->flags & REDIS_BLOCK)) {
+        __redisSetError(c,REDIS_ERR_OTHER,"Connect options need a blocking context");
+        return REDIS_ERR;
+    }
+    if (c->err || c->fd < 0)
+        return REDIS_ERR;
+
+    /* The replies to the setup commands have to be the next ones. */
+    if (sdslen(c->obuf) > 0 || c->reader->pos < c->reader->len) {
+        __redisSetError(c,REDIS_ERR_OTHER,"Connect options need a context without pending replies");
+        return REDIS_ERR;
+    }
+
+    /* The previous options are kept for reconnects unless these work. */
+    prev = c->options;
+    c->options = NULL;
+    if (__redisSetConnectOptions(c,opts) != REDIS_OK ||
+        redisApplyConnectOptions(c) != REDIS_OK)
+    {
+        __redisFreeConnectOptions(c->options);
+        c->options = prev;
+        return REDIS_ERR;
+    }
+    __redisFreeConnectOptions(prev);
+    return REDIS_OK;
+}
+
 int redisReconnect(redisContext *c) {
     c->err = 0;
     memset(c->errstr, '\0', strlen(c->errstr));
@@ -653,19 +899,33 @@ int redisReconnect(redisContext *c) {
 
     c->obuf = sdsempty();
     c->reader = redisReaderCreate();
+    if (c->reader != NULL)
+        c->reader->stats = c->stats;
+    c->flags &= ~REDIS_HANDSHAKE;
 
     if (c->connection_type == REDIS_CONN_TCP) {
-        return redisContextConnectBindTcp(c, c->tcp.host, c->tcp.port,
-                c->timeout, c->tcp.source_addr);
+        if (redisContextConnectBindTcp(c, c->tcp.host, c->tcp.port,
+                c->timeout, c->tcp.source_addr) != REDIS_OK)
+            return REDIS_ERR;
     } else if (c->connection_type == REDIS_CONN_UNIX) {
-        return redisContextConnectUnix(c, c->unix_sock.path, c->timeout);
+        if (redisContextConnectUnix(c, c->unix_sock.path, c->timeout) != REDIS_OK)
+            return REDIS_ERR;
     } else {
         /* Something bad happened here and shouldn't have. There isn't
            enough information in the context to reconnect. */
         __redisSetError(c,REDIS_ERR_OTHER,"Not enough information to reconnect");
+        return REDIS_ERR;
     }
 
-    return REDIS_ERR;
+    /* The setup commands already go through the transport. */
+    if (c->transport && c->transport->connect &&
+        c->transport->connect(c) != REDIS_OK)
+        return REDIS_ERR;
+
+    /* Async contexts send the setup commands themselves. */
+    if (c->options && (c->flags & REDIS_BLOCK))
+        return redisApplyConnectOptions(c);
+    return REDIS_OK;
 }
 
 /* Connect to a Redis instance. On error the field error in the returned
@@ -724,6 +984,55 @@ redisContext *redisConnectBindNonBlockWithReuse(const char *ip, int port,
     return c;
 }
 
+/* Like redisConnect(), except that connecting waits for the first write, so
+ * that the first commands go along with the handshake using TCP Fast Open.
+ * Connect errors are only reported by that write. */
+redisContext *redisConnectFastOpen(const char *ip, int port) {
+    redisContext *c;
+
+    c = redisContextInit();
+    if (c == NULL)
+        return NULL;
+
+    c->flags |= REDIS_BLOCK | REDIS_FASTOPEN;
+    redisContextConnectTcp(c,ip,port,NULL);
+    return c;
+}
+
+redisContext *redisConnectFastOpenWithTimeout(const char *ip, int port, const struct timeval tv) {
+    redisContext *c;
+
+    c = redisContextInit();
+    if (c == NULL)
+        return NULL;
+
+    c->flags |= REDIS_BLOCK | REDIS_FASTOPEN;
+    redisContextConnectTcp(c,ip,port,&tv);
+    return c;
+}
+
+redisContext *redisConnectNonBlockFastOpen(const char *ip, int port) {
+    redisContext *c;
+
+    c = redisContextInit();
+    if (c == NULL)
+        return NULL;
+
+    c->flags &= ~REDIS_BLOCK;
+    c->flags |= REDIS_FASTOPEN;
+    redisContextConnectTcp(c,ip,port,NULL);
+    return c;
+}
+
+int redisConnectMany(const char **ips, const int *ports, int n,
+                     const struct timeval *tv, redisContext **cs) {
+    int j;
+
+    for (j = 0; j < n; j++)
+        cs[j] = redisContextInit();
+    return redisContextConnectMany(cs,ips,ports,n,tv);
+}
+
 redisContext *redisConnectUnix(const char *path) {
     redisContext *c;
 
@@ -792,16 +1101,29 @@ int redisEnableKeepAlive(redisContext *c) {
  * After this function is called, you may use redisContextReadReply to
  * see if there is a reply available. */
 int redisBufferRead(redisContext *c) {
-    char buf[1024*16];
+    char buf[REDIS_IOBUF_LEN];
     int nread;
 
     /* Return early when the context has seen an error. */
     if (c->err)
         return REDIS_ERR;
 
-    nread = read(c->fd,buf,sizeof(buf));
+    if (c->transport)
+        nread = c->transport->read(c,buf,sizeof(buf));
+    else
+        nread = read(c->fd,buf,sizeof(buf));
+    if (c->stats) {
+        c->stats->read_calls++;
+        if (nread > 0)
+            c->stats->bytes_read += nread;
+        else if (nread == -1 && errno == EAGAIN)
+            c->stats->would_block++;
+    }
     if (nread == -1) {
-        if ((errno == EAGAIN && !(c->flags & REDIS_BLOCK)) || (errno == EINTR)) {
+        if (c->err) {
+            /* Set by the transport */
+            return REDIS_ERR;
+        } else if ((errno == EAGAIN && !(c->flags & REDIS_BLOCK)) || (errno == EINTR)) {
             /* Try again later */
         } else {
             __redisSetError(c,REDIS_ERR_IO,NULL);
@@ -811,6 +1133,8 @@ int redisBufferRead(redisContext *c) {
         __redisSetError(c,REDIS_ERR_EOF,"Server closed the connection");
         return REDIS_ERR;
     } else {
+        if (c->sockstate)
+            redisSocketAccount(c,1,nread,0);
         if (redisReaderFeed(c->reader,buf,nread) != REDIS_OK) {
             __redisSetError(c,c->reader->err,c->reader->errstr);
             return REDIS_ERR;
@@ -835,22 +1159,48 @@ int redisBufferWrite(redisContext *c, int *done) {
     if (c->err)
         return REDIS_ERR;
 
-    if (sdslen(c->obuf) > 0) {
-        nwritten = write(c->fd,c->obuf,sdslen(c->obuf));
+    if (c->flags & REDIS_CONNECT_DEFERRED) {
+        /* The first write connects, see REDIS_FASTOPEN. */
+        nwritten = redisContextConnectDeferred(c,c->obuf,sdslen(c->obuf));
+        if (nwritten == -1)
+            return REDIS_ERR;
+    } else if (sdslen(c->obuf) > 0) {
+        if (c->transport)
+            nwritten = c->transport->write(c,c->obuf,sdslen(c->obuf));
+        else
+            nwritten = write(c->fd,c->obuf,sdslen(c->obuf));
+        if (c->sockstate)
+            redisSocketAccount(c,0,nwritten > 0 ? nwritten : 0,
+                               nwritten < (signed)sdslen(c->obuf));
         if (nwritten == -1) {
-            if ((errno == EAGAIN && !(c->flags & REDIS_BLOCK)) || (errno == EINTR)) {
+            if (c->err) {
+                /* Set by the transport */
+                return REDIS_ERR;
+            } else if ((errno == EAGAIN && !(c->flags & REDIS_BLOCK)) || (errno == EINTR)) {
                 /* Try again later */
             } else {
                 __redisSetError(c,REDIS_ERR_IO,NULL);
                 return REDIS_ERR;
             }
-        } else if (nwritten > 0) {
-            if (nwritten == (signed)sdslen(c->obuf)) {
-                sdsfree(c->obuf);
-                c->obuf = sdsempty();
-            } else {
-                sdsrange(c->obuf,nwritten,-1);
-            }
+        }
+    } else {
+        nwritten = 0;
+    }
+    if (c->stats && sdslen(c->obuf) > 0) {
+        c->stats->write_calls++;
+        if (nwritten > 0)
+            c->stats->bytes_written += nwritten;
+        if (nwritten >= 0 && nwritten < (signed)sdslen(c->obuf))
+            c->stats->short_writes++;
+        else if (nwritten == -1 && errno == EAGAIN)
+            c->stats->would_block++;
+    }
+    if (nwritten > 0) {
+        if (nwritten == (signed)sdslen(c->obuf)) {
+            sdsfree(c->obuf);
+            c->obuf = sdsempty();
+        } else {
+            sdsrange(c->obuf,nwritten,-1);
         }
     }
     if (done != NULL) *done = (sdslen(c->obuf) == 0);
@@ -42,7 +42,7 @@
 #define HIREDIS_MAJOR 0
 #define HIREDIS_MINOR 13
 #define HIREDIS_PATCH 3
-#define HIREDIS_SONAME 0.13
+#define HIREDIS_SONAME 0.14
 
 /* Connection type can be blocking or non-blocking and is set in the
  * least significant bit of the flags field in redisContext. */
@@ -74,12 +74,33 @@
 /* Flag that is set when we should set SO_REUSEADDR before calling bind() */
 #define REDIS_REUSEADDR 0x80
 
+/* Flag that is set when connects are deferred to the first write, which sends
+ * the output buffer along with the SYN using TCP Fast Open. */
+#define REDIS_FASTOPEN 0x100
+
+/* Flag that is set while the socket waits for that first write. */
+#define REDIS_CONNECT_DEFERRED 0x200
+
+/* Flags that are set while the transport of a non-blocking context waits
+ * for the socket to become readable or writable to finish setting up the
+ * connection, e.g. during a TLS handshake. */
+#define REDIS_HANDSHAKE_READ 0x400
+#define REDIS_HANDSHAKE_WRITE 0x800
+#define REDIS_HANDSHAKE (REDIS_HANDSHAKE_READ|REDIS_HANDSHAKE_WRITE)
+
 #define REDIS_KEEPALIVE_INTERVAL 15 /* seconds */
 
+/* Maximum number of bytes redisBufferRead() reads with a single call. */
+#define REDIS_IOBUF_LEN (1024*16)
+
 /* number of times we retry to connect in the case of EADDRNOTAVAIL and
  * SO_REUSEADDR is being used. */
 #define REDIS_CONNECT_RETRIES  10
 
+/* msec a blocking connect waits for an address before it also tries the next
+ * one, the Connection Attempt Delay of RFC 8305. */
+#define REDIS_CONNECT_ATTEMPT_DELAY 250
+
 /* strerror_r has two completely different prototypes and behaviors
  * depending on system issues, so we need to operate on the error buffer
  * differently depending on which strerror_r we're using. */
@@ -136,6 +157,58 @@ enum redisConnectionType {
     REDIS_CONN_UNIX
 };
 
+/* Setup commands sent as one pipeline right after every connect and
+ * reconnect, ahead of any other command. NULL and 0 fields are skipped. */
+typedef struct redisConnectOptions {
+    const char *username; /* ACL user for AUTH, needs a password */
+    const char *password; /* AUTH */
+    const char *name; /* CLIENT SETNAME */
+    int db; /* SELECT */
+    int protocol; /* HELLO, which then also does AUTH and SETNAME. The
+                   * reader only understands protocol 2. */
+} redisConnectOptions;
+
+/* Maximum number of setup commands sent for the options */
+#define REDIS_CONNECT_OPTIONS_MAX 3
+
+/* Socket options applied by every connect and reconnect of a context, see
+ * redisSetSocketProfile(). 0 keeps the system default. */
+typedef struct redisSocketProfile {
+    int sndbuf; /* SO_SNDBUF, bytes */
+    int rcvbuf; /* SO_RCVBUF, bytes */
+    int notsent_lowat; /* TCP_NOTSENT_LOWAT, bytes */
+    int quickack; /* TCP_QUICKACK, set again after every read */
+    int busy_poll; /* SO_BUSY_POLL, usec */
+    int user_timeout; /* TCP_USER_TIMEOUT, msec */
+    int max_buf; /* Buffers that held back the throughput of the last 100
+                  * msec grow, up to this size and the limit of the kernel,
+                  * e.g. net.core.wmem_max without CAP_NET_ADMIN. */
+} redisSocketProfile;
+
+/* Presets for redisSocketProfileInit(). Latency keeps queues short and acks
+ * quick, bulk grows the buffers to the bandwidth-delay product. */
+#define REDIS_SOCKET_PROFILE_LATENCY 1
+#define REDIS_SOCKET_PROFILE_BULK 2
+
+struct redisContext;
+
+/* Transport layered over the socket of a context, e.g. TLS, see
+ * redisSetTransport(). read and write are used by redisBufferRead() and
+ * redisBufferWrite() in place of read(2) and write(2) and behave like them,
+ * returning -1 with errno set to EAGAIN when they would block, 0 on EOF.
+ * They may set the error of the context themselves before returning -1.
+ * connect, when set, runs after every reconnect before anything else is
+ * sent. On non-blocking contexts it may return with REDIS_HANDSHAKE_* set,
+ * and handshake is called to go on once the socket is ready, until the
+ * flags are cleared. free releases the privdata of the context. */
+typedef struct redisTransport {
+    int (*read)(struct redisContext *c, char *buf, size_t len);
+    int (*write)(struct redisContext *c, const char *buf, size_t len);
+    int (*connect)(struct redisContext *c);
+    int (*handshake)(struct redisContext *c);
+    void (*free)(void *privdata);
+} redisTransport;
+
 /* Context for a connection to Redis */
 typedef struct redisContext {
     int err; /* Error flags, 0 when there is no error */
@@ -158,6 +231,18 @@ typedef struct redisContext {
         char *path;
     } unix_sock;
 
+    /* Address to connect to on the first write, see REDIS_FASTOPEN */
+    struct sockaddr *saddr;
+    size_t addrlen;
+
+    redisConnectOptions *options; /* see redisSetConnectOptions() */
+    struct redisSocketState *sockstate; /* see redisSetSocketProfile() */
+
+    const redisTransport *transport; /* NULL for plain sockets */
+    void *transport_privdata;
+
+    redisStats *stats; /* see redisEnableStats() */
+
 } redisContext;
 
 redisContext *redisConnect(const char *ip, int port);
@@ -167,6 +252,22 @@ redisContext *redisConnectBindNonBlock(const char *ip, int port,
                                        const char *source_addr);
 redisContext *redisConnectBindNonBlockWithReuse(const char *ip, int port,
                                                 const char *source_addr);
+redisContext *redisConnectFastOpen(const char *ip, int port);
+redisContext *redisConnectFastOpenWithTimeout(const char *ip, int port, const struct timeval tv);
+redisContext *redisConnectNonBlockFastOpen(const char *ip, int port);
+
+/* Connects n blocking contexts at once: the connects are all started before
+ * waiting for them together, at most tv in total including the name lookups
+ * (NULL waits as long as it takes). A lookup that is already running isn't
+ * cut short, but the ones after it are skipped once tv passed, and their
+ * contexts fail with a timeout. cs[j] is the context for ips[j]:ports[j],
+ * with err set when it couldn't connect, or NULL when out of memory. Returns
+ * the number of connected contexts. Unlike redisConnectWithTimeout(), which
+ * races all addresses of a host, only the first address that doesn't fail
+ * right away is tried; use addresses rather than names for hosts with several
+ * of them, or reconnect the contexts that failed. */
+int redisConnectMany(const char **ips, const int *ports, int n,
+                     const struct timeval *tv, redisContext **cs);
 redisContext *redisConnectUnix(const char *path);
 redisContext *redisConnectUnixWithTimeout(const char *path, const struct timeval tv);
 redisContext *redisConnectUnixNonBlock(const char *path);
@@ -183,8 +284,44 @@ redisContext *redisConnectFd(int fd);
  */
 int redisReconnect(redisContext *c);
 
+/* Sets the setup commands of a blocking context and sends them right away.
+ * redisReconnect() sends them again, and the first error reply fails it with
+ * an error such as "AUTH failed: WRONGPASS ...". NULL clears them. The options
+ * are only kept when all setup commands succeeded, and the context must not
+ * have commands appended or replies left unread. For async contexts, see
+ * redisAsyncSetConnectOptions(). */
+int redisSetConnectOptions(redisContext *c, const redisConnectOptions *opts);
+
+/* Process-wide cache of resolved addresses for TCP connects, disabled by
+ * default. With a TTL set, connects and reconnects to a host only wait for
+ * getaddrinfo() on the first connect. Once the TTL passes, the cached
+ * addresses are used for one more TTL while a resolver thread looks the host
+ * up again. redisResolvePrefetch() queues such a lookup ahead of a connect,
+ * e.g. before redisAsyncConnect(), and calls fn, when not NULL, from the
+ * resolver thread once done. It fails when the cache is disabled. */
+typedef void (redisResolveCallback)(const char *host, int port, int status, void *privdata);
+void redisSetResolveCacheTtl(long long ttl_msec);
+void redisResolveCacheFlush(void);
+int redisResolvePrefetch(const char *host, int port, redisResolveCallback *fn, void *privdata);
+
 int redisSetTimeout(redisContext *c, const struct timeval tv);
 int redisEnableKeepAlive(redisContext *c);
+
+/* Options the platform lacks or the kernel refuses are skipped. The profile
+ * is copied; NULL removes it, leaving the current socket as it is. */
+void redisSocketProfileInit(redisSocketProfile *p, int kind);
+int redisSetSocketProfile(redisContext *c, const redisSocketProfile *p);
+
+/* Replaces the transport of a connected context, freeing the previous one.
+ * NULL goes back to the plain socket. */
+int redisSetTransport(redisContext *c, const redisTransport *t, void *privdata);
+
+/* Starts counting the I/O of the context and the replies read for it, see
+ * redisStats. Counting stays on across reconnects. redisGetStats() copies
+ * the counters, all 0 while disabled; redisResetStats() sets them to 0. */
+int redisEnableStats(redisContext *c);
+void redisGetStats(const redisContext *c, redisStats *stats);
+void redisResetStats(redisContext *c);
 void redisFree(redisContext *c);
 int redisFreeKeepFd(redisContext *c);
 int redisBufferRead(redisContext *c);
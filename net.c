@@ -50,10 +50,15 @@
 #include <poll.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "net.h"
 #include "sds.h"
 
+/* Upper bound on the hosts kept by the resolver cache */
+#define REDIS_RESOLVE_CACHE_MAX 1024
+
 /* Defined in hiredis.c */
 void __redisSetError(redisContext *c, int type, const char *str);
 
@@ -268,12 +273,718 @@ int redisContextSetTimeout(redisContext *c, const struct timeval tv) {
     return REDIS_OK;
 }
 
+/* Process-wide cache of resolved addresses, shared by every TCP connect and
+ * reconnect. An expired entry is still used for one more TTL while the
+ * resolver thread looks the name up again, so that only the first connect to
+ * a host (unless prefetched) waits for the resolver. */
+typedef struct redisResolved {
+    char *host;
+    int port;
+    struct addrinfo *servinfo;
+    long long expires; /* usec, stale afterwards */
+    int refs; /* connects using servinfo, plus one while cached */
+    int refreshing; /* queued or being looked up by the resolver thread */
+    struct redisResolved *next;
+} redisResolved;
+
+typedef struct redisResolveJob {
+    char *host;
+    int port;
+    redisResolveCallback *fn;
+    void *privdata;
+    struct redisResolveJob *next;
+} redisResolveJob;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    long long ttl; /* usec, 0 disables the cache */
+    redisResolved *entries;
+    int len;
+    redisResolveJob *jobs, *jobs_tail;
+    int thread; /* set once the resolver thread runs */
+} resolver = {
+    PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, NULL, 0, NULL, NULL, 0
+};
+
+static long long redisResolveUsec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (long long)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+/* Both address families are looked up: connects order them with
+ * redisOrderAddrs() and race them with redisContextConnectRace(). */
+static int redisResolve(const char *host, int port, struct addrinfo **servinfo) {
+    char _port[6];  /* strlen("65535"); */
+    struct addrinfo hints;
+
+    snprintf(_port, 6, "%d", port);
+    memset(&hints,0,sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    return getaddrinfo(host,_port,&hints,servinfo);
+}
+
+/* Called with the lock held. */
+static void redisResolvedRelease(redisResolved *e) {
+    if (--e->refs > 0)
+        return;
+    freeaddrinfo(e->servinfo);
+    free(e->host);
+    free(e);
+}
+
+/* Called with the lock held. */
+static void redisResolvedUnlink(redisResolved *e) {
+    redisResolved **pe = &resolver.entries;
+
+    while (*pe != e)
+        pe = &(*pe)->next;
+    *pe = e->next;
+    resolver.len--;
+    redisResolvedRelease(e);
+}
+
+/* Caches a fresh lookup in place of the old one, which connects still using
+ * it keep until they are done. Returns NULL, leaving servinfo to the caller,
+ * when out of memory. Called with the lock held. */
+static redisResolved *redisResolvedStore(const char *host, int port, struct addrinfo *servinfo) {
+    redisResolved *e, *next, *oldest = NULL;
+    long long now = redisResolveUsec();
+
+    for (e = resolver.entries; e != NULL; e = next) {
+        next = e->next;
+        if (e->port == port && strcmp(e->host,host) == 0)
+            redisResolvedUnlink(e);
+        else if (e->expires+resolver.ttl <= now)
+            redisResolvedUnlink(e);
+        else if (oldest == NULL || e->expires < oldest->expires)
+            oldest = e;
+    }
+    if (resolver.len >= REDIS_RESOLVE_CACHE_MAX)
+        redisResolvedUnlink(oldest);
+
+    if ((e = calloc(1,sizeof(*e))) == NULL || (e->host = strdup(host)) == NULL) {
+        free(e);
+        return NULL;
+    }
+    e->port = port;
+    e->servinfo = servinfo;
+    e->expires = now+resolver.ttl;
+    e->refs = 1;
+    e->next = resolver.entries;
+    resolver.entries = e;
+    resolver.len++;
+    return e;
+}
+
+static void *redisResolverMain(void *arg) {
+    redisResolveJob *job;
+    redisResolved *e;
+    struct addrinfo *servinfo;
+    int rv;
+    (void)arg;
+
+    pthread_mutex_lock(&resolver.lock);
+    while (1) {
+        while (resolver.jobs == NULL)
+            pthread_cond_wait(&resolver.cond,&resolver.lock);
+        job = resolver.jobs;
+        resolver.jobs = job->next;
+        if (resolver.jobs == NULL)
+            resolver.jobs_tail = NULL;
+        pthread_mutex_unlock(&resolver.lock);
+
+        servinfo = NULL;
+        rv = redisResolve(job->host,job->port,&servinfo);
+
+        pthread_mutex_lock(&resolver.lock);
+        if (rv == 0 && resolver.ttl &&
+            redisResolvedStore(job->host,job->port,servinfo) != NULL) {
+            servinfo = NULL;
+        } else {
+            /* Failed refreshes keep the stale entry and may be retried. */
+            for (e = resolver.entries; e != NULL; e = e->next)
+                if (e->port == job->port && strcmp(e->host,job->host) == 0)
+                    e->refreshing = 0;
+        }
+        pthread_mutex_unlock(&resolver.lock);
+        if (servinfo) freeaddrinfo(servinfo);
+
+        if (job->fn) job->fn(job->host,job->port,rv == 0 ? REDIS_OK : REDIS_ERR,job->privdata);
+        free(job->host);
+        free(job);
+        pthread_mutex_lock(&resolver.lock);
+    }
+    return NULL;
+}
+
+/* Queues a lookup for the resolver thread, starting it when needed. Called
+ * with the lock held. */
+static int redisResolveQueue(const char *host, int port, redisResolveCallback *fn, void *privdata) {
+    redisResolveJob *job;
+    pthread_attr_t attr;
+    pthread_t tid;
+    int rv;
+
+    if (!resolver.thread) {
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr,PTHREAD_CREATE_DETACHED);
+        rv = pthread_create(&tid,&attr,redisResolverMain,NULL);
+        pthread_attr_destroy(&attr);
+        if (rv != 0)
+            return REDIS_ERR;
+        resolver.thread = 1;
+    }
+
+    if ((job = malloc(sizeof(*job))) == NULL)
+        return REDIS_ERR;
+    if ((job->host = strdup(host)) == NULL) {
+        free(job);
+        return REDIS_ERR;
+    }
+    job->port = port;
+    job->fn = fn;
+    job->privdata = privdata;
+    job->next = NULL;
+    if (resolver.jobs_tail)
+        resolver.jobs_tail->next = job;
+    else
+        resolver.jobs = job;
+    resolver.jobs_tail = job;
+    pthread_cond_signal(&resolver.cond);
+    return REDIS_OK;
+}
+
+void redisSetResolveCacheTtl(long long ttl_msec) {
+    pthread_mutex_lock(&resolver.lock);
+    resolver.ttl = ttl_msec > 0 ? ttl_msec*1000 : 0;
+    if (resolver.ttl == 0) {
+        while (resolver.entries)
+            redisResolvedUnlink(resolver.entries);
+    }
+    pthread_mutex_unlock(&resolver.lock);
+}
+
+void redisResolveCacheFlush(void) {
+    pthread_mutex_lock(&resolver.lock);
+    while (resolver.entries)
+        redisResolvedUnlink(resolver.entries);
+    pthread_mutex_unlock(&resolver.lock);
+}
+
+int redisResolvePrefetch(const char *host, int port, redisResolveCallback *fn, void *privdata) {
+    int rv;
+
+    pthread_mutex_lock(&resolver.lock);
+    rv = resolver.ttl ? redisResolveQueue(host,port,fn,privdata) : REDIS_ERR;
+    pthread_mutex_unlock(&resolver.lock);
+    return rv;
+}
+
+/* Returns the cached entry for host:port, queueing a refresh when it is
+ * stale, or NULL on a miss. Release it with redisResolvedDone(). */
+static redisResolved *redisResolvedGet(const char *host, int port) {
+    redisResolved *e, *next;
+    long long now;
+
+    pthread_mutex_lock(&resolver.lock);
+    if (resolver.ttl == 0) {
+        pthread_mutex_unlock(&resolver.lock);
+        return NULL;
+    }
+    now = redisResolveUsec();
+    for (e = resolver.entries; e != NULL; e = next) {
+        next = e->next;
+        if (e->port != port || strcmp(e->host,host) != 0)
+            continue;
+        if (e->expires+resolver.ttl <= now) {
+            redisResolvedUnlink(e);
+            e = NULL;
+        } else {
+            if (e->expires <= now && !e->refreshing &&
+                redisResolveQueue(host,port,NULL,NULL) == REDIS_OK)
+                e->refreshing = 1;
+            e->refs++;
+        }
+        break;
+    }
+    pthread_mutex_unlock(&resolver.lock);
+    return e;
+}
+
+/* Caches the lookup done by a connect on a miss. Returns the entry, to be
+ * released with redisResolvedDone(), or NULL when servinfo wasn't cached. */
+static redisResolved *redisResolvedPut(const char *host, int port, struct addrinfo *servinfo) {
+    redisResolved *e = NULL;
+
+    pthread_mutex_lock(&resolver.lock);
+    if (resolver.ttl && (e = redisResolvedStore(host,port,servinfo)) != NULL)
+        e->refs++;
+    pthread_mutex_unlock(&resolver.lock);
+    return e;
+}
+
+/* Caches servinfo for host:port as if a connect had looked it up, taking it
+ * over on success. Fails when the cache is disabled. */
+int redisResolvedAdd(const char *host, int port, struct addrinfo *servinfo) {
+    int rv = REDIS_ERR;
+
+    pthread_mutex_lock(&resolver.lock);
+    if (resolver.ttl && redisResolvedStore(host,port,servinfo) != NULL)
+        rv = REDIS_OK;
+    pthread_mutex_unlock(&resolver.lock);
+    return rv;
+}
+
+static void redisResolvedDone(redisResolved *e) {
+    pthread_mutex_lock(&resolver.lock);
+    redisResolvedRelease(e);
+    pthread_mutex_unlock(&resolver.lock);
+}
+
+/* Length of the windows over which a socket profile measures throughput */
+#define REDIS_SOCKET_WINDOW 100000 /* usec */
+
+/* State of the socket profile of a context */
+struct redisSocketState {
+    redisSocketProfile profile;
+    long long window; /* start of the current window, usec */
+    size_t wbytes, rbytes; /* moved during the window */
+    int wfull; /* set when the send buffer was full during the window */
+    int wcapped, rcapped; /* set once the buffer can't grow any further */
+    long long wmax, rmax; /* see redisSocketBufLimit() */
+    int force; /* cleared once SO_SNDBUFFORCE or SO_RCVBUFFORCE failed */
+};
+
+/* Best effort: a profile is tuning, not a requirement, so options the
+ * kernel refuses are skipped. */
+static void redisSetSockOpt(int fd, int level, int opt, int val) {
+    if (val)
+        (void)setsockopt(fd,level,opt,&val,sizeof(val));
+}
+
+void redisSocketProfileInit(redisSocketProfile *p, int kind) {
+    memset(p,0,sizeof(*p));
+    if (kind == REDIS_SOCKET_PROFILE_LATENCY) {
+        /* Keep little unsent data in the kernel, so replies and commands
+         * written after a burst don't queue behind it. */
+        p->notsent_lowat = 16*1024;
+        p->quickack = 1;
+        p->busy_poll = 50;
+    } else if (kind == REDIS_SOCKET_PROFILE_BULK) {
+        /* Let the kernel size the buffers until they hold back the
+         * throughput, then keep growing them. */
+        p->max_buf = 16*1024*1024;
+    }
+}
+
+/* Largest size setsockopt() grants for opt without CAP_NET_ADMIN, 0 when
+ * unknown. Linux clamps to net.core.wmem_max or rmem_max, then doubles it. */
+static long long redisSocketBufLimit(int opt) {
+    long long max = 0;
+#ifdef __linux__
+    FILE *fp = fopen(opt == SO_SNDBUF ? "/proc/sys/net/core/wmem_max" :
+                                        "/proc/sys/net/core/rmem_max","r");
+
+    if (fp != NULL) {
+        if (fscanf(fp,"%lld",&max) != 1)
+            max = 0;
+        fclose(fp);
+    }
+#else
+    ((void)opt);
+#endif
+    return max;
+}
+
+/* Applies the socket profile of the context, if any, to a new socket. */
+static void redisApplySocketProfile(redisContext *c) {
+    struct redisSocketState *s = c->sockstate;
+    int tcp = (c->connection_type == REDIS_CONN_TCP);
+
+    if (s == NULL || c->fd < 0)
+        return;
+
+    redisSetSockOpt(c->fd,SOL_SOCKET,SO_SNDBUF,s->profile.sndbuf);
+    redisSetSockOpt(c->fd,SOL_SOCKET,SO_RCVBUF,s->profile.rcvbuf);
+#ifdef SO_BUSY_POLL
+    redisSetSockOpt(c->fd,SOL_SOCKET,SO_BUSY_POLL,s->profile.busy_poll);
+#endif
+    if (tcp) {
+#ifdef TCP_NOTSENT_LOWAT
+        redisSetSockOpt(c->fd,IPPROTO_TCP,TCP_NOTSENT_LOWAT,s->profile.notsent_lowat);
+#endif
+#ifdef TCP_QUICKACK
+        redisSetSockOpt(c->fd,IPPROTO_TCP,TCP_QUICKACK,s->profile.quickack);
+#endif
+#ifdef TCP_USER_TIMEOUT
+        redisSetSockOpt(c->fd,IPPROTO_TCP,TCP_USER_TIMEOUT,s->profile.user_timeout);
+#endif
+    }
+
+    s->window = redisResolveUsec();
+    s->wbytes = s->rbytes = 0;
+    s->wfull = 0;
+    s->wcapped = s->rcapped = 0;
+
+    /* Looked up once here rather than on every window that grows. */
+    if (s->profile.max_buf) {
+        s->wmax = redisSocketBufLimit(SO_SNDBUF);
+        s->rmax = redisSocketBufLimit(SO_RCVBUF);
+        s->force = 1;
+    }
+}
+
+int redisSetSocketProfile(redisContext *c, const redisSocketProfile *p) {
+    struct redisSocketState *s = NULL;
+
+    if (p != NULL) {
+        if ((s = calloc(1,sizeof(*s))) == NULL) {
+            __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
+            return REDIS_ERR;
+        }
+        s->profile = *p;
+    }
+    free(c->sockstate);
+    c->sockstate = s;
+    redisApplySocketProfile(c);
+    return REDIS_OK;
+}
+
+/* Grows the buffer opt when it held back the throughput of the last window:
+ * when the bandwidth-delay product reached half of it, or, without an RTT
+ * estimate, when a full buffer was turned over. Setting a size ends the
+ * autotuning of the kernel for the buffer, so a size the kernel would clamp
+ * below the current one is never set. Returns 1 once the buffer can't grow
+ * any further. */
+static int redisSocketGrow(redisContext *c, int opt, size_t bytes, int full, long long usec) {
+    struct redisSocketState *s = c->sockstate;
+    long long rtt = 0, bdp, want, max;
+    int cur = 0, val, forced = 0;
+    socklen_t len = sizeof(cur);
+
+    if (getsockopt(c->fd,SOL_SOCKET,opt,&cur,&len) == -1 || cur <= 0)
+        return 0;
+#ifdef __linux__
+    {
+        struct tcp_info ti;
+        len = sizeof(ti);
+        if (c->connection_type == REDIS_CONN_TCP &&
+            getsockopt(c->fd,IPPROTO_TCP,TCP_INFO,&ti,&len) == 0)
+            rtt = ti.tcpi_rtt;
+    }
+#endif
+
+    bdp = rtt ? (long long)bytes*rtt/usec : 0;
+    if (rtt ? bdp*2 < cur : !(full && bytes >= (size_t)cur))
+        return 0;
+
+    want = bdp*2 > (long long)cur*2 ? bdp*2 : (long long)cur*2;
+    if (want > s->profile.max_buf)
+        want = s->profile.max_buf;
+    if (want <= cur)
+        return 1;
+
+    val = (int)want;
+#if defined(SO_SNDBUFFORCE) && defined(SO_RCVBUFFORCE)
+    /* Without CAP_NET_ADMIN this fails every time, so it's only tried once. */
+    if (s->force) {
+        forced = setsockopt(c->fd,SOL_SOCKET,opt == SO_SNDBUF ? SO_SNDBUFFORCE :
+                            SO_RCVBUFFORCE,&val,sizeof(val)) == 0;
+        s->force = forced;
+    }
+#endif
+    if (!forced) {
+        if ((max = opt == SO_SNDBUF ? s->wmax : s->rmax) > 0) {
+            if (max*2 <= cur)
+                return 1;
+            if (want > max)
+                val = (int)max;
+        }
+        if (setsockopt(c->fd,SOL_SOCKET,opt,&val,sizeof(val)) == -1)
+            return 1;
+    }
+
+    /* The kernel may still have granted less than asked for. */
+    len = sizeof(cur);
+    return getsockopt(c->fd,SOL_SOCKET,opt,&cur,&len) == -1 || cur < val;
+}
+
+/* Called by redisBufferRead() and redisBufferWrite() with the bytes moved by
+ * a read or write, and whether the kernel buffer limited a write. */
+void redisSocketAccount(redisContext *c, int reading, size_t bytes, int full) {
+    struct redisSocketState *s = c->sockstate;
+    long long now, usec;
+
+    if (reading) {
+#ifdef TCP_QUICKACK
+        /* The kernel leaves quick ack mode on its own. */
+        if (s->profile.quickack && c->connection_type == REDIS_CONN_TCP)
+            redisSetSockOpt(c->fd,IPPROTO_TCP,TCP_QUICKACK,1);
+#endif
+        s->rbytes += bytes;
+    } else {
+        s->wbytes += bytes;
+        s->wfull |= full;
+    }
+    if (!s->profile.max_buf)
+        return;
+
+    now = redisResolveUsec();
+    if ((usec = now-s->window) < REDIS_SOCKET_WINDOW)
+        return;
+    if (!s->wcapped)
+        s->wcapped = redisSocketGrow(c,SO_SNDBUF,s->wbytes,s->wfull,usec);
+    if (!s->rcapped)
+        s->rcapped = redisSocketGrow(c,SO_RCVBUF,s->rbytes,0,usec);
+    s->window = now;
+    s->wbytes = s->rbytes = 0;
+    s->wfull = 0;
+}
+
+/* Returns the resolved addresses as an array of n entries, IPv4 first and
+ * then alternating between the families as RFC 8305 suggests, or NULL when
+ * out of memory. IPv4 goes first since in a Redis client you can't afford to
+ * test if you have IPv6 connectivity as this would add latency to every
+ * connect. With one_family set, only addresses of the first family are kept,
+ * e.g. to bind them all to the same source address. */
+struct addrinfo **redisOrderAddrs(struct addrinfo *servinfo, int one_family, int *n) {
+    struct addrinfo **addrs, *v4 = servinfo, *v6 = servinfo, *p;
+    int len = 0, first = AF_UNSPEC;
+
+    for (p = servinfo; p != NULL; p = p->ai_next) {
+        if (p->ai_family == AF_INET) first = AF_INET;
+        else if (first == AF_UNSPEC) first = p->ai_family;
+        len++;
+    }
+    if ((addrs = malloc(sizeof(*addrs)*(len ? len : 1))) == NULL)
+        return NULL;
+
+    /* Walk the IPv4 and the other addresses in turn. */
+    *n = 0;
+    while (1) {
+        while (v4 && v4->ai_family != AF_INET) v4 = v4->ai_next;
+        while (v6 && v6->ai_family == AF_INET) v6 = v6->ai_next;
+        if (one_family && first == AF_INET) v6 = NULL;
+        if (one_family && first != AF_INET) v4 = NULL;
+        if (v4 == NULL && v6 == NULL) break;
+
+        if (v4) {
+            addrs[(*n)++] = v4;
+            v4 = v4->ai_next;
+        }
+        if (v6) {
+            addrs[(*n)++] = v6;
+            v6 = v6->ai_next;
+        }
+    }
+    return addrs;
+}
+
+static long long redisMsec(void) {
+    return redisResolveUsec()/1000;
+}
+
+/* Connects to the first of the addresses to accept, starting the attempts
+ * REDIS_CONNECT_ATTEMPT_DELAY msec apart, or right away when the previous
+ * one failed, so an unreachable address doesn't use up the whole timeout.
+ * The connected socket is left in c->fd, non-blocking. When none connects,
+ * the error is the one of the first attempt to fail. */
+int redisContextConnectRace(redisContext *c, struct addrinfo **addrs, int n,
+                            long timeout_msec) {
+    struct pollfd *pfd;
+    struct addrinfo *p;
+    long long now, deadline, next_start;
+    int started = 0, pending = 0, sockets = 0, err = 0, soerr, wait, res, i, s;
+    socklen_t errlen;
+
+    if ((pfd = malloc(sizeof(*pfd)*n)) == NULL) {
+        __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    }
+
+    now = redisMsec();
+    deadline = timeout_msec >= 0 ? now+timeout_msec : -1;
+    next_start = now;
+    c->fd = -1;
+    while (c->fd == -1) {
+        now = redisMsec();
+        if (started < n && now >= next_start) {
+            p = addrs[started++];
+            if ((s = socket(p->ai_family,p->ai_socktype,p->ai_protocol)) == -1) {
+                if (!err) err = errno;
+                continue;
+            }
+            sockets++;
+            c->fd = s;
+            if (redisSetBlocking(c,0) != REDIS_OK)
+                goto error;
+            c->fd = -1;
+            if (connect(s,p->ai_addr,p->ai_addrlen) == 0) {
+                c->fd = s;
+                break;
+            }
+            if (errno != EINPROGRESS) {
+                if (!err) err = errno;
+                close(s);
+                continue;
+            }
+            pfd[pending].fd = s;
+            pfd[pending].events = POLLOUT;
+            pending++;
+            next_start = now+REDIS_CONNECT_ATTEMPT_DELAY;
+            continue;
+        }
+
+        if (pending == 0) {
+            if (started < n) {
+                next_start = now;
+                continue;
+            }
+            if (sockets == 0) {
+                char buf[128];
+                snprintf(buf,sizeof(buf),"Can't create socket: %s",strerror(err));
+                __redisSetError(c,REDIS_ERR_OTHER,buf);
+            } else {
+                errno = err;
+                __redisSetErrorFromErrno(c,REDIS_ERR_IO,NULL);
+            }
+            goto error;
+        }
+
+        wait = started < n ? (int)(next_start-now) : -1;
+        if (deadline >= 0) {
+            if (now >= deadline) {
+                errno = ETIMEDOUT;
+                __redisSetErrorFromErrno(c,REDIS_ERR_IO,NULL);
+                goto error;
+            }
+            if (wait < 0 || deadline-now < wait)
+                wait = (int)(deadline-now);
+        }
+        if ((res = poll(pfd,pending,wait)) == -1) {
+            if (errno == EINTR)
+                continue;
+            __redisSetErrorFromErrno(c,REDIS_ERR_IO,"poll(2)");
+            goto error;
+        }
+
+        for (i = 0; res > 0 && i < pending; i++) {
+            if (pfd[i].revents == 0)
+                continue;
+            res--;
+            errlen = sizeof(soerr);
+            if (getsockopt(pfd[i].fd,SOL_SOCKET,SO_ERROR,&soerr,&errlen) == -1)
+                soerr = errno;
+            if (soerr == 0) {
+                c->fd = pfd[i].fd;
+                pfd[i] = pfd[--pending];
+                break;
+            }
+            if (!err) err = soerr;
+            close(pfd[i].fd);
+            pfd[i--] = pfd[--pending];
+            next_start = redisMsec();
+        }
+    }
+
+    for (i = 0; i < pending; i++)
+        close(pfd[i].fd);
+    free(pfd);
+    return REDIS_OK;
+
+error:
+    for (i = 0; i < pending; i++)
+        close(pfd[i].fd);
+    free(pfd);
+    return REDIS_ERR;
+}
+
+/* Creates the socket for p, leaving the connect to the first write with
+ * redisContextConnectDeferred(), see REDIS_FASTOPEN. */
+static int redisContextDeferConnect(redisContext *c, struct addrinfo *p) {
+    int s;
+
+    if ((s = socket(p->ai_family,p->ai_socktype,p->ai_protocol)) == -1) {
+        __redisSetErrorFromErrno(c,REDIS_ERR_IO,"socket(2)");
+        return REDIS_ERR;
+    }
+    c->fd = s;
+    free(c->saddr);
+    if ((c->saddr = malloc(p->ai_addrlen)) == NULL) {
+        __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
+        redisContextCloseFd(c);
+        return REDIS_ERR;
+    }
+    memcpy(c->saddr,p->ai_addr,p->ai_addrlen);
+    c->addrlen = p->ai_addrlen;
+    c->flags |= REDIS_CONNECT_DEFERRED;
+    return REDIS_OK;
+}
+
+/* Connects the socket of a deferred connect, sending buf along with the SYN
+ * with TCP Fast Open when the kernel allows. When it doesn't, or buf is
+ * empty, this is a regular connect and the server never knows. Returns the
+ * number of bytes of buf that were sent, or -1 on errors. Blocking contexts
+ * wait for the handshake like a regular connect would, when it didn't carry
+ * data. */
+int redisContextConnectDeferred(redisContext *c, const char *buf, size_t len) {
+    int blocking = (c->flags & REDIS_BLOCK);
+    int nwritten = -1, inprogress = 0;
+    long timeout_msec = -1;
+
+    c->flags &= ~REDIS_CONNECT_DEFERRED;
+    if (blocking && redisSetBlocking(c,0) != REDIS_OK)
+        return -1;
+
+#ifdef MSG_FASTOPEN
+    if (len > 0)
+        nwritten = sendto(c->fd,buf,len,MSG_FASTOPEN,c->saddr,c->addrlen);
+#else
+    ((void)buf);
+#endif
+    if (nwritten == -1 && len > 0 && (errno == EINPROGRESS || errno == EAGAIN)) {
+        /* The SYN asks for a cookie: buf waits for the handshake. */
+        nwritten = 0;
+        inprogress = 1;
+    } else if (nwritten == -1) {
+        nwritten = 0;
+        if (connect(c->fd,c->saddr,c->addrlen) == -1) {
+            if (errno != EINPROGRESS) {
+                __redisSetErrorFromErrno(c,REDIS_ERR_IO,NULL);
+                redisContextCloseFd(c);
+                return -1;
+            }
+            inprogress = 1;
+        }
+    }
+
+    if (blocking) {
+        if (inprogress) {
+            if (redisContextTimeoutMsec(c,&timeout_msec) != REDIS_OK) {
+                __redisSetError(c,REDIS_ERR_IO,"Invalid timeout specified");
+                return -1;
+            }
+            errno = EINPROGRESS;
+            if (redisContextWaitReady(c,timeout_msec) != REDIS_OK)
+                return -1;
+        }
+        if (redisSetBlocking(c,1) != REDIS_OK)
+            return -1;
+    }
+    return nwritten;
+}
+
 static int _redisContextConnectTcp(redisContext *c, const char *addr, int port,
                                    const struct timeval *timeout,
                                    const char *source_addr) {
     int s, rv, n;
-    char _port[6];  /* strlen("65535"); */
-    struct addrinfo hints, *servinfo, *bservinfo, *p, *b;
+    struct addrinfo hints, *servinfo, *bservinfo, *p, *b, **addrs = NULL;
+    redisResolved *cached = NULL;
+    int i, naddrs;
     int blocking = (c->flags & REDIS_BLOCK);
     int reuseaddr = (c->flags & REDIS_REUSEADDR);
     int reuses = 0;
@@ -281,6 +992,7 @@ static int _redisContextConnectTcp(redisContext *c, const char *addr, int port,
 
     servinfo = NULL;
     c->connection_type = REDIS_CONN_TCP;
+    c->flags &= ~REDIS_CONNECT_DEFERRED;
     c->tcp.port = port;
 
     /* We need to take possession of the passed parameters
@@ -323,24 +1035,40 @@ static int _redisContextConnectTcp(redisContext *c, const char *addr, int port,
         c->tcp.source_addr = strdup(source_addr);
     }
 
-    snprintf(_port, 6, "%d", port);
-    memset(&hints,0,sizeof(hints));
-    hints.ai_family = AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-
-    /* Try with IPv6 if no IPv4 address was found. We do it in this order since
-     * in a Redis client you can't afford to test if you have IPv6 connectivity
-     * as this would add latency to every connect. Otherwise a more sensible
-     * route could be: Use IPv6 if both addresses are available and there is IPv6
-     * connectivity. */
-    if ((rv = getaddrinfo(c->tcp.host,_port,&hints,&servinfo)) != 0) {
-         hints.ai_family = AF_INET6;
-         if ((rv = getaddrinfo(addr,_port,&hints,&servinfo)) != 0) {
+    if ((cached = redisResolvedGet(c->tcp.host,port)) != NULL) {
+        servinfo = cached->servinfo;
+    } else {
+        if ((rv = redisResolve(c->tcp.host,port,&servinfo)) != 0) {
             __redisSetError(c,REDIS_ERR_OTHER,gai_strerror(rv));
             return REDIS_ERR;
         }
+        cached = redisResolvedPut(c->tcp.host,port,servinfo);
     }
-    for (p = servinfo; p != NULL; p = p->ai_next) {
+    if ((addrs = redisOrderAddrs(servinfo,c->tcp.source_addr != NULL,&naddrs)) == NULL) {
+        __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
+        goto error;
+    }
+
+    /* Fast Open sends the first write along with the SYN, which needs an
+     * address to be picked before. */
+    if ((c->flags & REDIS_FASTOPEN) && !c->tcp.source_addr) {
+        if (redisContextDeferConnect(c,addrs[0]) != REDIS_OK)
+            goto error;
+        goto connected;
+    }
+
+    /* Blocking connects race the addresses, non-blocking ones can't wait for
+     * them and go on with the first one that doesn't fail right away. */
+    if (blocking && !c->tcp.source_addr && naddrs > 1) {
+        if (redisContextConnectRace(c,addrs,naddrs,timeout_msec) != REDIS_OK)
+            goto error;
+        goto connected;
+    }
+
+    memset(&hints,0,sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    for (i = 0; i < naddrs; i++) {
+        p = addrs[i];
 addrretry:
         if ((s = socket(p->ai_family,p->ai_socktype,p->ai_protocol)) == -1)
             continue;
@@ -351,6 +1079,7 @@ addrretry:
         if (c->tcp.source_addr) {
             int bound = 0;
             /* Using getaddrinfo saves us from self-determining IPv4 vs IPv6 */
+            hints.ai_family = p->ai_family;
             if ((rv = getaddrinfo(c->tcp.source_addr, NULL, &hints, &bservinfo)) != 0) {
                 char buf[128];
                 snprintf(buf,sizeof(buf),"Can't get addr: %s",gai_strerror(rv));
@@ -398,26 +1127,34 @@ addrretry:
                     goto error;
             }
         }
-        if (blocking && redisSetBlocking(c,1) != REDIS_OK)
-            goto error;
-        if (redisSetTcpNoDelay(c) != REDIS_OK)
-            goto error;
-
-        c->flags |= REDIS_CONNECTED;
-        rv = REDIS_OK;
-        goto end;
+        goto connected;
     }
-    if (p == NULL) {
+    if (i == naddrs) {
         char buf[128];
         snprintf(buf,sizeof(buf),"Can't create socket: %s",strerror(errno));
         __redisSetError(c,REDIS_ERR_OTHER,buf);
         goto error;
     }
 
+connected:
+    if (blocking && redisSetBlocking(c,1) != REDIS_OK)
+        goto error;
+    if (redisSetTcpNoDelay(c) != REDIS_OK)
+        goto error;
+    redisApplySocketProfile(c);
+
+    c->flags |= REDIS_CONNECTED;
+    rv = REDIS_OK;
+    goto end;
+
 error:
     rv = REDIS_ERR;
 end:
-    freeaddrinfo(servinfo);
+    free(addrs);
+    if (cached)
+        redisResolvedDone(cached);
+    else
+        freeaddrinfo(servinfo);
     return rv;  // Need to return REDIS_OK if alright
 }
 
@@ -432,6 +1169,122 @@ int redisContextConnectBindTcp(redisContext *c, const char *addr, int port,
     return _redisContextConnectTcp(c, addr, port, timeout, source_addr);
 }
 
+/* Waits until the deadline (-1 for none) for the connects in progress on the
+ * non-blocking contexts, with a single poll(2) set, and makes them blocking.
+ * Contexts that didn't connect in time are closed with an error. Returns the
+ * number of connected contexts. */
+static int redisContextWaitMany(redisContext **cs, int n, long long deadline) {
+    struct pollfd *pfd;
+    int *idx, pending, connected = 0, res, i, j;
+    long long now;
+
+    pfd = malloc(sizeof(*pfd)*(n ? n : 1));
+    idx = malloc(sizeof(*idx)*(n ? n : 1));
+    if (pfd == NULL || idx == NULL) {
+        free(pfd);
+        free(idx);
+        for (j = 0; j < n; j++) {
+            if (cs[j] == NULL || cs[j]->err)
+                continue;
+            __redisSetError(cs[j],REDIS_ERR_OOM,"Out of memory");
+            redisContextCloseFd(cs[j]);
+        }
+        return 0;
+    }
+
+    while (1) {
+        pending = 0;
+        for (j = 0; j < n; j++) {
+            if (cs[j] == NULL || cs[j]->err || cs[j]->fd < 0 || (cs[j]->flags & REDIS_BLOCK))
+                continue;
+            pfd[pending].fd = cs[j]->fd;
+            pfd[pending].events = POLLOUT;
+            pfd[pending].revents = 0;
+            idx[pending++] = j;
+        }
+        if (pending == 0)
+            break;
+
+        now = redisMsec();
+        if (deadline >= 0 && now >= deadline) {
+            res = 0;
+        } else if ((res = poll(pfd,pending,deadline >= 0 ? (int)(deadline-now) : -1)) == -1) {
+            if (errno == EINTR)
+                continue;
+            for (i = 0; i < pending; i++) {
+                __redisSetErrorFromErrno(cs[idx[i]],REDIS_ERR_IO,"poll(2)");
+                redisContextCloseFd(cs[idx[i]]);
+            }
+            break;
+        }
+
+        /* Nothing left to wait for once the deadline passed. */
+        if (res == 0) {
+            for (i = 0; i < pending; i++) {
+                errno = ETIMEDOUT;
+                __redisSetErrorFromErrno(cs[idx[i]],REDIS_ERR_IO,NULL);
+                redisContextCloseFd(cs[idx[i]]);
+            }
+            break;
+        }
+
+        for (i = 0; i < pending; i++) {
+            redisContext *c = cs[idx[i]];
+
+            if (pfd[i].revents == 0)
+                continue;
+            if (redisCheckSocketError(c) != REDIS_OK) {
+                redisContextCloseFd(c);
+                continue;
+            }
+            if (redisSetBlocking(c,1) != REDIS_OK)
+                continue;
+            c->flags |= REDIS_BLOCK;
+            connected++;
+        }
+    }
+
+    for (j = 0; j < n; j++) {
+        if (cs[j] == NULL)
+            continue;
+        if (cs[j]->err)
+            cs[j]->flags &= ~REDIS_CONNECTED;
+        cs[j]->flags |= REDIS_BLOCK;
+    }
+    free(pfd);
+    free(idx);
+    return connected;
+}
+
+/* Starts a non-blocking connect for every context, then waits for all of
+ * them. The deadline is taken before the host names are resolved, so slow
+ * lookups count against tv as well. */
+int redisContextConnectMany(redisContext **cs, const char **ips, const int *ports, int n,
+                            const struct timeval *tv) {
+    long long deadline = -1;
+    long msec = -1;
+    int j;
+
+    if (tv != NULL)
+        msec = tv->tv_sec*1000 + (tv->tv_usec+999)/1000;
+    if (msec >= 0)
+        deadline = redisMsec()+msec;
+
+    for (j = 0; j < n; j++) {
+        if (cs[j] == NULL)
+            continue;
+        /* The name lookups so far took all the time there was. */
+        if (deadline >= 0 && redisMsec() >= deadline) {
+            errno = ETIMEDOUT;
+            __redisSetErrorFromErrno(cs[j],REDIS_ERR_IO,NULL);
+            continue;
+        }
+        cs[j]->flags &= ~REDIS_BLOCK;
+        redisContextConnectTcp(cs[j],ips[j],ports[j],tv);
+    }
+    return redisContextWaitMany(cs,n,deadline);
+}
+
 int redisContextConnectUnix(redisContext *c, const char *path, const struct timeval *timeout) {
     int blocking = (c->flags & REDIS_BLOCK);
     struct sockaddr_un sa;
@@ -477,6 +1330,7 @@ int redisContextConnectUnix(redisContext *c, const char *path, const struct time
     if (blocking && redisSetBlocking(c,1) != REDIS_OK)
         return REDIS_ERR;
 
+    redisApplySocketProfile(c);
     c->flags |= REDIS_CONNECTED;
     return REDIS_OK;
 }
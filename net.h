@@ -41,6 +41,8 @@
 #define AF_LOCAL AF_UNIX
 #endif
 
+struct addrinfo;
+
 int redisCheckSocketError(redisContext *c);
 int redisContextSetTimeout(redisContext *c, const struct timeval tv);
 int redisContextConnectTcp(redisContext *c, const char *addr, int port, const struct timeval *timeout);
@@ -48,6 +50,14 @@ int redisContextConnectBindTcp(redisContext *c, const char *addr, int port,
                                const struct timeval *timeout,
                                const char *source_addr);
 int redisContextConnectUnix(redisContext *c, const char *path, const struct timeval *timeout);
+int redisContextConnectMany(redisContext **cs, const char **ips, const int *ports, int n,
+                            const struct timeval *tv);
+int redisContextConnectDeferred(redisContext *c, const char *buf, size_t len);
+struct addrinfo **redisOrderAddrs(struct addrinfo *servinfo, int one_family, int *n);
+int redisResolvedAdd(const char *host, int port, struct addrinfo *servinfo);
+int redisContextConnectRace(redisContext *c, struct addrinfo **addrs, int n,
+                            long timeout_msec);
+void redisSocketAccount(redisContext *c, int reading, size_t bytes, int full);
 int redisKeepAlive(redisContext *c, int interval);
 int redisUpgradeToNonBlocking(redisContext *c);
 
@@ -351,6 +351,7 @@ static int processMultiBulkItem(redisReader *r) {
                 r->rstack[r->ridx].obj = NULL;
                 r->rstack[r->ridx].parent = cur;
                 r->rstack[r->ridx].privdata = r->privdata;
+                r->rstack[r->ridx].stats = r->stats;
             } else {
                 moveToNextTask(r);
             }
@@ -469,6 +470,8 @@ int redisReaderFeed(redisReader *r, const char *buf, size_t len) {
 
         r->buf = newbuf;
         r->len = sdslen(r->buf);
+        if (r->stats && r->len > r->stats->reader_buf_peak)
+            r->stats->reader_buf_peak = r->len;
     }
 
     return REDIS_OK;
@@ -495,6 +498,7 @@ int redisReaderGetReply(redisReader *r, void **reply) {
         r->rstack[0].obj = NULL;
         r->rstack[0].parent = NULL;
         r->rstack[0].privdata = r->privdata;
+        r->rstack[0].stats = r->stats;
         r->ridx = 0;
     }
 
@@ -517,6 +521,8 @@ int redisReaderGetReply(redisReader *r, void **reply) {
 
     /* Emit a reply when there is one. */
     if (r->ridx == -1) {
+        if (r->stats)
+            r->stats->replies++;
         if (reply != NULL)
             *reply = r->reply;
         r->reply = NULL;
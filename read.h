@@ -60,6 +60,22 @@
 extern "C" {
 #endif
 
+/* Counters of a context, see redisEnableStats(). The reader and the default
+ * reply functions update the reply and reader fields. */
+typedef struct redisStats {
+    unsigned long long read_calls; /* reads of the socket or transport */
+    unsigned long long write_calls; /* writes, including Fast Open connects */
+    unsigned long long bytes_read;
+    unsigned long long bytes_written;
+    unsigned long long short_writes; /* writes that left data behind */
+    unsigned long long would_block; /* reads and writes that got EAGAIN */
+    unsigned long long replies; /* complete replies parsed */
+    unsigned long long reply_objects; /* objects built for them */
+    unsigned long long reply_allocs; /* allocations made for the objects */
+    unsigned long long reply_bytes; /* bytes allocated for the objects */
+    size_t reader_buf_peak; /* largest reader buffer, bytes */
+} redisStats;
+
 typedef struct redisReadTask {
     int type;
     int elements; /* number of elements in multibulk container */
@@ -67,6 +83,7 @@ typedef struct redisReadTask {
     void *obj; /* holds user-generated value for a read task */
     struct redisReadTask *parent; /* parent task */
     void *privdata; /* user-settable arbitrary field */
+    redisStats *stats; /* stats of the reader, or NULL */
 } redisReadTask;
 
 typedef struct redisReplyObjectFunctions {
@@ -92,6 +109,7 @@ typedef struct redisReader {
 
     redisReplyObjectFunctions *fn;
     void *privdata;
+    redisStats *stats; /* owned by the context, NULL when disabled */
 } redisReader;
 
 /* Public API for the protocol parser. */
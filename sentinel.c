@@ -1,59 +1,140 @@
+#include "fmacros.h"
+#include <time.h>
 #include "sentinel.h"
 
-/* Sentinel linked list helpers */
-static void _free_sentinel_list(redisSentinelList **head)
+#define SENTINEL_BACKOFF_MIN 100000 /* usec */
+#define SENTINEL_BACKOFF_MAX 10000000
+
+static long long _sentinel_usec(void)
 {
-    redisSentinelList *iter, *next;
-    iter = *head;
+    struct timespec ts;
 
-    while (iter)
-    {
-        next = iter->next;
-        free(iter);
-        iter = next;
-    }
-    *head = NULL;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
 }
 
-static void _push_sentinel(redisSentinelList **head, const char *hostname, int port)
+/* Sentinel health helpers */
+/* A sentinel answered, sample is the round trip time or -1 if unknown */
+static void _sentinel_ok(redisSentinel *s, long long sample)
 {
-    redisSentinelList *item, *iter;
+    if (sample >= 0)
+        s->rtt = s->rtt ? (7 * s->rtt + sample) / 8 : sample;
+    s->failures = 0;
+    s->retry_after = 0;
+}
 
-    item = (redisSentinelList *)malloc(sizeof(redisSentinelList));
-    strncpy(item->hostname, hostname, MAX_HOSTNAME_LEN);
-    item->port = port;
-    item->next = NULL;
+static void _sentinel_failed(redisSentinel *s)
+{
+    long long backoff = SENTINEL_BACKOFF_MIN;
+    int i;
 
-    if (*head == NULL)
-    {
-        *head = item;
-        return;
-    }
+    for (i = 0; i < s->failures && backoff < SENTINEL_BACKOFF_MAX; i++)
+        backoff *= 2;
+    if (backoff > SENTINEL_BACKOFF_MAX)
+        backoff = SENTINEL_BACKOFF_MAX;
+    s->failures++;
+    s->retry_after = _sentinel_usec() + backoff;
+}
+
+static long long _sentinel_timeout(redisSentinelContext *sc)
+{
+    return (long long)sc->timeout->tv_sec * 1000000 + sc->timeout->tv_usec;
+}
 
-    iter = *head;
+static long long _sentinel_cost(redisSentinelContext *sc, redisSentinel *s)
+{
+    long long rtt = s->rtt;
 
-    while (iter->next)
-        iter = iter->next;
-    iter->next = item;
+    if (rtt == 0)
+        rtt = _sentinel_timeout(sc);
+    return rtt * (1 + s->failures);
 }
 
-static void _promote_sentinel(redisSentinelList **head, redisSentinelList *item)
+/* Returns 1 when a should be tried before b */
+static int _sentinel_before(redisSentinelContext *sc, redisSentinel *a, redisSentinel *b, long long now)
 {
-    redisSentinelList *iter;
+    int a_wait = a->retry_after > now, b_wait = b->retry_after > now;
 
-    if (*head == item)
-        return;
+    if (a_wait != b_wait)
+        return b_wait;
+    if (a_wait)
+        return a->retry_after < b->retry_after;
+    return _sentinel_cost(sc, a) < _sentinel_cost(sc, b);
+}
 
-    iter = *head;
+/* Returns the sentinels in the order they should be tried, to be free'd by
+ * the caller, or NULL when out of memory. Sentinels that are equally good
+ * keep the order they were configured in. */
+static redisSentinel **_sentinel_order(redisSentinelContext *sc)
+{
+    redisSentinel **order, *s;
+    long long now = _sentinel_usec();
+    int i, j;
+
+    order = (redisSentinel **)malloc(sizeof(*order) * (sc->nsentinels ? sc->nsentinels : 1));
+    if (order == NULL)
+        return NULL;
+    for (i = 0; i < sc->nsentinels; i++)
+    {
+        s = &sc->sentinels[i];
+        for (j = i; j > 0 && _sentinel_before(sc, s, order[j - 1], now); j--)
+            order[j] = order[j - 1];
+        order[j] = s;
+    }
+    return order;
+}
+/* End of sentinel health helpers */
 
-    while (iter->next != item)
-        iter = iter->next;
+static int _is_master_role(redisReply *reply)
+{
+    return reply && reply->type == REDIS_REPLY_ARRAY && reply->elements > 0 &&
+           reply->element[0]->type == REDIS_REPLY_STRING &&
+           !strcmp("master", reply->element[0]->str);
+}
 
-    iter->next = iter->next->next;
-    item->next = *head;
-    *head = item;
+static void _cache_master(redisSentinelContext *sc, const char *hostname, int port)
+{
+    snprintf(sc->master_hostname, sizeof(sc->master_hostname), "%s", hostname);
+    sc->master_port = port;
 }
-/* End of sentinel linked list helpers */
+
+/* State of a non-blocking discovery. Every sentinel gets a probe holding its
+ * async connection, every distinct master address gets an answer. */
+typedef struct redisSentinelProbe {
+    struct redisSentinelDiscovery *d;
+    redisSentinel *sentinel;
+    redisAsyncContext *ac; /* NULL once the reply was handled */
+    long long start; /* when the query was sent */
+} redisSentinelProbe;
+
+typedef struct redisSentinelAnswer {
+    char hostname[MAX_HOSTNAME_LEN];
+    int port;
+    int votes;
+} redisSentinelAnswer;
+
+typedef struct redisSentinelDiscovery {
+    redisSentinelContext *sc;
+    redisSentinelProbe *probes;
+    redisSentinelAnswer *answers;
+    int len; /* number of probes, and room for as many answers */
+    int pending; /* probes still waiting for a reply */
+    int connected; /* probes that got a reply */
+    int nanswers;
+    redisAsyncContext *master; /* set while the role is verified */
+    int cached; /* verifying the cached master, the sentinels weren't asked */
+    long long deadline; /* the current step fails after this (monotonic usec) */
+} redisSentinelDiscovery;
+
+/* A command held in the failover buffer, formatted when it was issued */
+typedef struct redisSentinelBuffered {
+    redisCallbackFn *fn;
+    void *privdata;
+    char *cmd;
+    size_t len;
+    long long queued; /* when it was buffered */
+    struct redisSentinelBuffered *next;
+} redisSentinelBuffered;
 
 
 static redisSentinelContext *_redisSentinelContextInit(void) {
@@ -66,7 +147,18 @@ static redisSentinelContext *_redisSentinelContextInit(void) {
     sc->err = 0;
     sc->errstr[0] = '\0';
     sc->timeout = NULL;
-    sc->list = NULL;
+    sc->sentinels = NULL;
+    sc->nsentinels = 0;
+    sc->attach = NULL;
+    sc->attach_privdata = NULL;
+    sc->quorum = 0;
+    sc->discovery = NULL;
+    sc->fn = NULL;
+    sc->watch = NULL;
+    sc->watch_sentinel = NULL;
+    sc->master_down = 0;
+    sc->watch_retry = 0;
+    sc->watch_lost = 0;
 
     return sc;
 }
@@ -81,8 +173,18 @@ redisSentinelContext *redisSentinelInit(const char *cluster, const char **hostna
     if (sc == NULL)
         return NULL;
 
+    sc->sentinels = (redisSentinel *)calloc(len ? len : 1, sizeof(redisSentinel));
+    if (sc->sentinels == NULL)
+    {
+        free(sc);
+        return NULL;
+    }
     for (i=0; i < len; i++)
-        _push_sentinel(&(sc->list), hostnames[i], ports[i]);
+    {
+        snprintf(sc->sentinels[i].hostname, MAX_HOSTNAME_LEN, "%s", hostnames[i]);
+        sc->sentinels[i].port = ports[i];
+    }
+    sc->nsentinels = len;
 
     if (sc->timeout == NULL)
         sc->timeout = (struct timeval *)malloc(sizeof(struct timeval));
@@ -90,15 +192,44 @@ redisSentinelContext *redisSentinelInit(const char *cluster, const char **hostna
 
     strncpy(sc->cluster, cluster, sizeof(sc->cluster));
 
+    if (redisSentinelAddGroup(sc, cluster) != 0)
+    {
+        redisSentinelFree(sc);
+        return NULL;
+    }
     return sc;
 }
 
+static void _discovery_abort(redisSentinelDiscovery *d);
+static void _buffer_expire(redisSentinelContext *sc, int all);
+
 void redisSentinelFree(redisSentinelContext *sc)
 {
+    redisAsyncContext *watch, *ac;
+
     if (sc == NULL)
         return;
-    if (sc->list)
-        _free_sentinel_list(&sc->list);
+    if (sc->discovery)
+        _discovery_abort(sc->discovery);
+    if (sc->watch)
+    {
+        /* Callbacks run by redisAsyncFree() ignore contexts that aren't watched */
+        watch = sc->watch;
+        sc->watch = NULL;
+        redisAsyncFree(watch);
+    }
+    if (sc->resolve)
+    {
+        ac = sc->resolve;
+        sc->resolve = NULL;
+        redisAsyncFree(ac);
+    }
+    if (sc->ac && sc->ac->data == sc)
+        sc->ac->data = NULL;
+    _buffer_expire(sc, 1);
+    free(sc->groups);
+    free(sc->resolve_order);
+    free(sc->sentinels);
     if (sc->timeout)
         free(sc->timeout);
     free(sc);
@@ -106,24 +237,33 @@ void redisSentinelFree(redisSentinelContext *sc)
 
 redisContext *redisSentinelConnect(redisSentinelContext *sc)
 {
-    redisReply *reply = NULL;
-    redisSentinelList dummy;
-    redisSentinelList *iter = &dummy;
-    int sentinel_connects = 0;
+    redisReply *reply = NULL, *role;
+    redisSentinel **order, *iter;
+    long long start;
+    int i, sentinel_connects = 0;
 
-    iter->next = sc->list;
-
-    while ((iter = iter->next))
+    order = _sentinel_order(sc);
+    for (i = 0; order && i < sc->nsentinels; i++)
     {
+        iter = order[i];
+        start = _sentinel_usec();
         sc->c = redisConnectWithTimeout(iter->hostname, iter->port, *sc->timeout);
         if (sc->c == NULL || sc->c->err)
         {
             redisFree(sc->c);
+            _sentinel_failed(iter);
             continue;
         }
 
         sentinel_connects++;
         reply = (redisReply *)redisCommand(sc->c,"SENTINEL get-master-addr-by-name %s", sc->cluster);
+        if (reply == NULL)
+        {
+            redisFree(sc->c);
+            _sentinel_failed(iter);
+            continue;
+        }
+        _sentinel_ok(iter, _sentinel_usec() - start);
 
         if (reply->type == REDIS_REPLY_NIL)
         {
@@ -139,21 +279,26 @@ redisContext *redisSentinelConnect(redisSentinelContext *sc)
             if (sc->c == NULL || sc->c->err)
             {
                 redisFree(sc->c);
+                freeReplyObject(reply);
                 continue;
             }
 
-            freeReplyObject(reply);
-            reply = (redisReply *)redisCommand(sc->c,"ROLE");
-
-            if (reply->type == REDIS_REPLY_ARRAY && !strncmp("master", reply->element[0]->str, 7))
+            role = (redisReply *)redisCommand(sc->c,"ROLE");
+            if (_is_master_role(role))
             {
-                //Success
+                //Success, only a confirmed master is tried first next time
+                _cache_master(sc, reply->element[0]->str, atoi(reply->element[1]->str));
+                freeReplyObject(role);
                 freeReplyObject(reply);
-                _promote_sentinel(&sc->list, iter);
+                free(order);
                 return sc->c;
             }
+            freeReplyObject(role);
+            redisFree(sc->c);
         }
+        freeReplyObject(reply);
     }
+    free(order);
     sc->c = (redisContext *)calloc(1, sizeof(redisContext));
     sc->c->err = REDIS_ERR;
     if (sentinel_connects)
@@ -184,7 +329,1509 @@ redisAsyncContext *redisSentinelAsyncConnect(redisSentinelContext *sc)
 
 redisContext *redisSentinelReconnect(redisSentinelContext *sc)
 {
-    return  redisSentinelConnect(sc);
+    redisReply *reply;
+    redisContext *c;
+
+    /* Most reconnects follow a transient error on an unchanged master */
+    if (sc->master_port)
+    {
+        c = redisConnectWithTimeout(sc->master_hostname, sc->master_port, *sc->timeout);
+        if (c && !c->err)
+        {
+            reply = (redisReply *)redisCommand(c, "ROLE");
+            if (_is_master_role(reply))
+            {
+                freeReplyObject(reply);
+                sc->c = c;
+                return sc->c;
+            }
+            if (reply)
+                freeReplyObject(reply);
+        }
+        redisFree(c);
+    }
+    return redisSentinelConnect(sc);
+}
+
+void redisSentinelSetAttach(redisSentinelContext *sc, redisSentinelAttachFn *fn, void *privdata)
+{
+    sc->attach = fn;
+    sc->attach_privdata = privdata;
+}
+
+void redisSentinelSetQuorum(redisSentinelContext *sc, int quorum)
+{
+    sc->quorum = quorum;
+}
+
+/* Connect and attach, returns NULL when either fails. */
+static redisAsyncContext *_sentinel_async_connect(redisSentinelContext *sc, const char *hostname, int port)
+{
+    redisAsyncContext *ac;
+
+    ac = redisAsyncConnect(hostname, port);
+    if (ac == NULL)
+        return NULL;
+    if (ac->err || sc->attach(ac, sc->attach_privdata) != REDIS_OK)
+    {
+        redisAsyncFree(ac);
+        return NULL;
+    }
+    return ac;
+}
+
+/* Free the probe connections that are still waiting for a reply. Their
+ * callbacks run right away with a NULL reply and are ignored. */
+static void _discovery_free_probes(redisSentinelDiscovery *d)
+{
+    redisAsyncContext *ac;
+    int i;
+
+    for (i = 0; i < d->len; i++)
+    {
+        ac = d->probes[i].ac;
+        d->probes[i].ac = NULL;
+        if (ac)
+            redisAsyncFree(ac);
+    }
+}
+
+/* Failover buffer helpers */
+static redisSentinelBuffered *_buffer_pop(redisSentinelContext *sc)
+{
+    redisSentinelBuffered *b = sc->buffer;
+
+    if (b == NULL)
+        return NULL;
+    sc->buffer = b->next;
+    if (sc->buffer == NULL)
+        sc->buffer_tail = NULL;
+    sc->buffer_len--;
+    sc->buffer_bytes -= b->len;
+    return b;
+}
+
+static void _buffer_fail(redisSentinelBuffered *b)
+{
+    if (b->fn)
+        b->fn(NULL, NULL, b->privdata);
+    redisFreeCommand(b->cmd);
+    free(b);
+}
+
+/* Fail the commands that were buffered for too long, or all of them. */
+static void _buffer_expire(redisSentinelContext *sc, int all)
+{
+    long long now = _sentinel_usec();
+
+    /* Commands are buffered in order, the oldest one is at the head */
+    while (sc->buffer && (all || (sc->buffer_max_age &&
+           now - sc->buffer->queued > sc->buffer_max_age)))
+        _buffer_fail(_buffer_pop(sc));
+}
+
+static int _master_usable(redisSentinelContext *sc)
+{
+    return sc->ac != NULL && !sc->master_down &&
+           !(sc->ac->c.flags & (REDIS_DISCONNECTING | REDIS_FREEING));
+}
+
+/* Write the buffered commands to the master. They are only appended to its
+ * output buffer here, so they go out together on the next write event. */
+static void _buffer_flush(redisSentinelContext *sc)
+{
+    redisSentinelBuffered *b;
+
+    _buffer_expire(sc, 0);
+    while (_master_usable(sc) && (b = _buffer_pop(sc)) != NULL)
+    {
+        if (redisAsyncFormattedCommand(sc->ac, b->fn, b->privdata, b->cmd, b->len) != REDIS_OK)
+        {
+            _buffer_fail(b);
+            continue;
+        }
+        redisFreeCommand(b->cmd);
+        free(b);
+    }
+}
+
+/* Takes ownership of cmd. Returns REDIS_ERR when the buffer is full. */
+static int _buffer_push(redisSentinelContext *sc, redisCallbackFn *fn, void *privdata, char *cmd, size_t len)
+{
+    redisSentinelBuffered *b;
+
+    _buffer_expire(sc, 0);
+    if (sc->buffer_len >= sc->buffer_max_len ||
+        (sc->buffer_max_bytes && sc->buffer_bytes + len > sc->buffer_max_bytes))
+    {
+        redisFreeCommand(cmd);
+        return REDIS_ERR;
+    }
+
+    b = (redisSentinelBuffered *)malloc(sizeof(*b));
+    if (b == NULL)
+    {
+        redisFreeCommand(cmd);
+        return REDIS_ERR;
+    }
+    b->fn = fn;
+    b->privdata = privdata;
+    b->cmd = cmd;
+    b->len = len;
+    b->queued = _sentinel_usec();
+    b->next = NULL;
+    if (sc->buffer_tail)
+        sc->buffer_tail->next = b;
+    else
+        sc->buffer = b;
+    sc->buffer_tail = b;
+    sc->buffer_len++;
+    sc->buffer_bytes += len;
+    return REDIS_OK;
+}
+/* End of failover buffer helpers */
+
+static void _master_disconnect(const redisAsyncContext *ac, int status)
+{
+    redisSentinelContext *sc = (redisSentinelContext *)ac->data;
+
+    /* Replaced by a newer master, or the sentinel context was free'd */
+    if (sc == NULL || sc->ac != ac)
+        return;
+
+    sc->ac = NULL;
+    if (status == REDIS_OK)
+        return;
+    sc->err = REDIS_ERR_EOF;
+    snprintf(sc->errstr, sizeof(sc->errstr), "Connection to the master was lost");
+    if (sc->fn)
+        sc->fn(sc, NULL, REDIS_ERR);
+}
+
+/* Make ac the master connection. The previous one still gets the replies to
+ * the commands it sent before it is closed. */
+static void _adopt_master(redisSentinelContext *sc, redisAsyncContext *ac)
+{
+    redisAsyncContext *old = sc->ac;
+
+    ac->data = sc;
+    redisAsyncSetDisconnectCallback(ac, _master_disconnect);
+    sc->ac = ac;
+    sc->master_down = 0;
+    if (old && old->data == sc)
+    {
+        old->data = NULL;
+        redisAsyncDisconnect(old);
+    }
+    _buffer_flush(sc);
+}
+
+static void _discovery_finish(redisSentinelDiscovery *d, redisAsyncContext *ac)
+{
+    redisSentinelContext *sc = d->sc;
+
+    _discovery_free_probes(d);
+    sc->discovery = NULL;
+    free(d->probes);
+    free(d->answers);
+    free(d);
+
+    if (ac)
+    {
+        sc->err = 0;
+        sc->errstr[0] = '\0';
+        _cache_master(sc, ac->c.tcp.host, ac->c.tcp.port);
+        _adopt_master(sc, ac);
+    }
+    else
+    {
+        sc->err = REDIS_ERR_OTHER;
+    }
+    if (sc->fn)
+        sc->fn(sc, ac, ac ? REDIS_OK : REDIS_ERR);
+}
+
+static void _discovery_fail(redisSentinelDiscovery *d)
+{
+    if (d->connected)
+        snprintf(d->sc->errstr, sizeof(d->sc->errstr), "Failed to connect to a master. %d sentinel(s) connected", d->connected);
+    else
+        snprintf(d->sc->errstr, sizeof(d->sc->errstr), "Failed to connect to any sentinels");
+    _discovery_finish(d, NULL);
+}
+
+static void _discovery_abort(redisSentinelDiscovery *d)
+{
+    redisAsyncContext *master = d->master;
+
+    /* The ROLE callback runs from redisAsyncFree() and needs d to tell that
+     * it has to be ignored. */
+    _discovery_free_probes(d);
+    d->master = NULL;
+    if (master)
+        redisAsyncFree(master);
+    d->sc->discovery = NULL;
+    free(d->probes);
+    free(d->answers);
+    free(d);
+}
+
+static void _discovery_master_failed(redisSentinelDiscovery *d);
+
+static void _discovery_role_reply(redisAsyncContext *ac, void *r, void *privdata)
+{
+    redisSentinelDiscovery *d = (redisSentinelDiscovery *)privdata;
+    redisReply *reply = (redisReply *)r;
+
+    /* Aborted, the context is being free'd */
+    if (d->master != ac)
+        return;
+    d->master = NULL;
+
+    if (_is_master_role(reply))
+    {
+        _discovery_finish(d, ac);
+        return;
+    }
+
+    if (reply)
+        redisAsyncDisconnect(ac);
+    snprintf(d->sc->errstr, sizeof(d->sc->errstr), "The address given by the sentinels is not a master");
+    _discovery_master_failed(d);
+}
+
+/* Enough sentinels agree on the master: drop the other probes, connect to it
+ * and verify its role. The callback only runs once ROLE said master. */
+static void _discovery_connect_master(redisSentinelDiscovery *d, redisSentinelAnswer *a)
+{
+    redisSentinelContext *sc = d->sc;
+    redisAsyncContext *ac;
+
+    _discovery_free_probes(d);
+    ac = _sentinel_async_connect(sc, a->hostname, a->port);
+    if (ac == NULL)
+    {
+        snprintf(sc->errstr, sizeof(sc->errstr), "Failed to connect to master %.80s:%d", a->hostname, a->port);
+        _discovery_master_failed(d);
+        return;
+    }
+
+    d->master = ac;
+    d->deadline = _sentinel_usec() + _sentinel_timeout(sc);
+    if (redisAsyncCommand(ac, _discovery_role_reply, d, "ROLE") != REDIS_OK)
+    {
+        d->master = NULL;
+        redisAsyncFree(ac);
+        snprintf(sc->errstr, sizeof(sc->errstr), "Failed to connect to master %.80s:%d", a->hostname, a->port);
+        _discovery_master_failed(d);
+    }
+}
+
+static void _discovery_sentinel_reply(redisAsyncContext *ac, void *r, void *privdata)
+{
+    redisSentinelProbe *p = (redisSentinelProbe *)privdata;
+    redisSentinelDiscovery *d = p->d;
+    redisReply *reply = (redisReply *)r;
+    redisSentinelAnswer *a = NULL;
+    int i, port, needed;
+
+    /* The probe was free'd after the discovery made up its mind */
+    if (p->ac == NULL)
+        return;
+    p->ac = NULL;
+    d->pending--;
+
+    if (reply)
+    {
+        d->connected++;
+        _sentinel_ok(p->sentinel, _sentinel_usec() - p->start);
+        redisAsyncDisconnect(ac);
+    }
+    else
+    {
+        _sentinel_failed(p->sentinel);
+    }
+
+    if (reply && reply->type == REDIS_REPLY_ARRAY && reply->elements == 2 &&
+        reply->element[0]->type == REDIS_REPLY_STRING &&
+        reply->element[1]->type == REDIS_REPLY_STRING)
+    {
+        port = atoi(reply->element[1]->str);
+        for (i = 0; i < d->nanswers; i++)
+        {
+            if (d->answers[i].port == port && !strcmp(d->answers[i].hostname, reply->element[0]->str))
+            {
+                a = &d->answers[i];
+                break;
+            }
+        }
+        if (a == NULL)
+        {
+            a = &d->answers[d->nanswers++];
+            snprintf(a->hostname, sizeof(a->hostname), "%s", reply->element[0]->str);
+            a->port = port;
+            a->votes = 0;
+        }
+        a->votes++;
+
+        needed = d->sc->quorum > 0 ? d->sc->quorum : 1;
+        if (a->votes >= needed)
+        {
+            _discovery_connect_master(d, a);
+            return;
+        }
+    }
+
+    if (d->pending == 0)
+        _discovery_fail(d);
+}
+
+static redisSentinelDiscovery *_discovery_create(redisSentinelContext *sc, int len)
+{
+    redisSentinelDiscovery *d;
+
+    d = (redisSentinelDiscovery *)calloc(1, sizeof(*d));
+    if (d == NULL)
+        return NULL;
+    d->probes = (redisSentinelProbe *)calloc(len ? len : 1, sizeof(redisSentinelProbe));
+    d->answers = (redisSentinelAnswer *)calloc(len ? len : 1, sizeof(redisSentinelAnswer));
+    if (d->probes == NULL || d->answers == NULL)
+    {
+        free(d->probes);
+        free(d->answers);
+        free(d);
+        return NULL;
+    }
+    d->sc = sc;
+    sc->discovery = d;
+    return d;
+}
+
+/* Query every sentinel at the same time. Returns REDIS_ERR when no query
+ * could be sent. */
+static int _discovery_query_sentinels(redisSentinelDiscovery *d)
+{
+    redisSentinelContext *sc = d->sc;
+    redisSentinelProbe *p;
+    redisSentinel **order;
+    redisAsyncContext *ac;
+    int i;
+
+    /* All sentinels are asked anyway, but the ones expected to answer first
+     * get their query out first. */
+    order = _sentinel_order(sc);
+    if (order == NULL)
+    {
+        snprintf(sc->errstr, sizeof(sc->errstr), "Out of memory");
+        return REDIS_ERR;
+    }
+
+    /* Probes are only counted once their command was issued, so a reply can't
+     * end the discovery while the others are still being set up. */
+    d->deadline = _sentinel_usec() + _sentinel_timeout(sc);
+    for (i = 0; i < sc->nsentinels; i++)
+    {
+        p = &d->probes[d->len++];
+        p->d = d;
+        p->sentinel = order[i];
+        p->start = _sentinel_usec();
+        ac = _sentinel_async_connect(sc, p->sentinel->hostname, p->sentinel->port);
+        if (ac == NULL)
+        {
+            _sentinel_failed(p->sentinel);
+            continue;
+        }
+        p->ac = ac;
+        if (redisAsyncCommand(ac, _discovery_sentinel_reply, p, "SENTINEL get-master-addr-by-name %s", sc->cluster) != REDIS_OK)
+        {
+            p->ac = NULL;
+            redisAsyncFree(ac);
+            continue;
+        }
+        d->pending++;
+    }
+    free(order);
+
+    if (d->pending == 0)
+    {
+        snprintf(sc->errstr, sizeof(sc->errstr), "Failed to connect to any sentinels");
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+/* Connecting to the master or verifying its role failed. When that was the
+ * cached master, fall back to asking the sentinels. */
+static void _discovery_master_failed(redisSentinelDiscovery *d)
+{
+    if (!d->cached)
+    {
+        _discovery_finish(d, NULL);
+        return;
+    }
+
+    d->cached = 0;
+    d->nanswers = 0;
+    if (_discovery_query_sentinels(d) != REDIS_OK)
+        _discovery_finish(d, NULL);
+}
+
+int redisSentinelAsyncDiscover(redisSentinelContext *sc, redisSentinelCallback *fn)
+{
+    redisSentinelDiscovery *d;
+    redisSentinelAnswer *a;
+
+    if (sc->attach == NULL || sc->discovery != NULL)
+        return REDIS_ERR;
+
+    d = _discovery_create(sc, sc->nsentinels);
+    if (d == NULL)
+        return REDIS_ERR;
+    sc->fn = fn;
+
+    if (sc->master_port)
+    {
+        d->cached = 1;
+        a = &d->answers[d->nanswers++];
+        snprintf(a->hostname, sizeof(a->hostname), "%s", sc->master_hostname);
+        a->port = sc->master_port;
+        _discovery_connect_master(d, a);
+        return REDIS_OK;
+    }
+
+    /* Nothing to wait for: report the error without calling fn */
+    if (_discovery_query_sentinels(d) != REDIS_OK)
+    {
+        sc->err = REDIS_ERR_OTHER;
+        _discovery_abort(d);
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+/* Fails the step of the discovery that ran out of time. Sentinels that
+ * didn't answer count as failed. */
+static void _discovery_expire(redisSentinelDiscovery *d)
+{
+    redisSentinelContext *sc = d->sc;
+    redisAsyncContext *master = d->master;
+    int i;
+
+    if (_sentinel_usec() < d->deadline)
+        return;
+
+    if (master)
+    {
+        /* The ROLE callback ignores the context once it isn't d->master */
+        d->master = NULL;
+        snprintf(sc->errstr, sizeof(sc->errstr), "Timed out verifying master %.80s:%d", master->c.tcp.host, master->c.tcp.port);
+        redisAsyncFree(master);
+        _discovery_master_failed(d);
+        return;
+    }
+
+    for (i = 0; i < d->len; i++)
+    {
+        if (d->probes[i].ac)
+            _sentinel_failed(d->probes[i].sentinel);
+    }
+    snprintf(sc->errstr, sizeof(sc->errstr), "Timed out waiting for the sentinels. %d sentinel(s) answered", d->connected);
+    _discovery_finish(d, NULL);
+}
+
+
+/* Split a sentinel event payload on spaces. Returns the number of fields. */
+static int _split_fields(char *buf, char **fields, int max)
+{
+    int n = 0;
+
+    while (n < max && *buf)
+    {
+        while (*buf == ' ')
+            *buf++ = '\0';
+        if (*buf == '\0')
+            break;
+        fields[n++] = buf;
+        while (*buf && *buf != ' ')
+            buf++;
+    }
+    return n;
+}
+
+/* +switch-master <name> <old ip> <old port> <new ip> <new port> */
+static void _watch_switch_master(redisSentinelContext *sc, char **fields, int n)
+{
+    redisSentinelDiscovery *d;
+    redisSentinelAnswer *a;
+    int group;
+
+    if (n != 5)
+        return;
+
+    group = redisSentinelGetGroup(sc, fields[0]);
+    if (group >= 0 && (strcmp(sc->groups[group].hostname, fields[3]) ||
+                       sc->groups[group].port != atoi(fields[4])))
+    {
+        snprintf(sc->groups[group].hostname, sizeof(sc->groups[group].hostname), "%s", fields[3]);
+        sc->groups[group].port = atoi(fields[4]);
+        if (sc->group_fn)
+            sc->group_fn(sc, group);
+    }
+
+    if (strcmp(fields[0], sc->cluster))
+        return;
+    if (sc->ac && sc->ac->c.tcp.host && !strcmp(sc->ac->c.tcp.host, fields[3]) &&
+        sc->ac->c.tcp.port == atoi(fields[4]))
+        return;
+
+    /* This is more recent than whatever a running discovery finds. */
+    if (sc->discovery)
+        _discovery_abort(sc->discovery);
+    d = _discovery_create(sc, 1);
+    if (d == NULL)
+        return;
+    a = &d->answers[d->nanswers++];
+    snprintf(a->hostname, sizeof(a->hostname), "%s", fields[3]);
+    a->port = atoi(fields[4]);
+    _discovery_connect_master(d, a);
+}
+
+/* +sdown or -sdown master <name> <ip> <port> */
+static void _watch_sdown(redisSentinelContext *sc, char **fields, int n, int down)
+{
+    if (n < 4 || strcmp(fields[0], "master") || strcmp(fields[1], sc->cluster))
+        return;
+    if (sc->ac && sc->ac->c.tcp.host && !strcmp(sc->ac->c.tcp.host, fields[2]) &&
+        sc->ac->c.tcp.port == atoi(fields[3]))
+    {
+        sc->master_down = down;
+        if (!down)
+            _buffer_flush(sc);
+    }
+}
+
+static int _watch_connect(redisSentinelContext *sc);
+
+/* Every sentinel failed: subscribe again once the first backoff ended, see
+ * redisSentinelCheckTimeouts(). */
+static void _watch_retry_later(redisSentinelContext *sc)
+{
+    long long retry = -1;
+    int i;
+
+    for (i = 0; i < sc->nsentinels; i++)
+    {
+        if (retry == -1 || sc->sentinels[i].retry_after < retry)
+            retry = sc->sentinels[i].retry_after;
+    }
+    /* A sentinel without a backoff is tried on the next check */
+    sc->watch_retry = retry > 0 ? retry : 1;
+}
+
+static void _watch_message(redisAsyncContext *ac, void *r, void *privdata)
+{
+    redisSentinelContext *sc = (redisSentinelContext *)privdata;
+    redisReply *reply = (redisReply *)r;
+    char buf[1024];
+    char *fields[8];
+    int n;
+
+    if (sc->watch != ac)
+        return;
+
+    /* Lost the sentinel: move on to the next one */
+    if (reply == NULL)
+    {
+        sc->watch = NULL;
+        sc->watch_sentinel->watch_failed = 1;
+        _sentinel_failed(sc->watch_sentinel);
+        if (_watch_connect(sc) == REDIS_OK)
+            return;
+        _watch_retry_later(sc);
+        if (!sc->watch_lost)
+        {
+            sc->watch_lost = 1;
+            if (sc->fn)
+                sc->fn(sc, NULL, REDIS_ERR);
+        }
+        return;
+    }
+
+    if (reply->type != REDIS_REPLY_ARRAY || reply->elements != 3 ||
+        reply->element[0]->type != REDIS_REPLY_STRING ||
+        reply->element[1]->type != REDIS_REPLY_STRING)
+        return;
+
+    if (!strcmp(reply->element[0]->str, "subscribe"))
+    {
+        for (n = 0; n < sc->nsentinels; n++)
+            sc->sentinels[n].watch_failed = 0;
+        sc->watch_lost = 0;
+        _sentinel_ok(sc->watch_sentinel, -1);
+        return;
+    }
+
+    if (strcmp(reply->element[0]->str, "message") ||
+        reply->element[2]->type != REDIS_REPLY_STRING ||
+        reply->element[2]->len >= sizeof(buf))
+        return;
+
+    memcpy(buf, reply->element[2]->str, reply->element[2]->len + 1);
+    n = _split_fields(buf, fields, 8);
+    if (!strcmp(reply->element[1]->str, "+switch-master"))
+        _watch_switch_master(sc, fields, n);
+    else if (!strcmp(reply->element[1]->str, "+sdown"))
+        _watch_sdown(sc, fields, n, 1);
+    else if (!strcmp(reply->element[1]->str, "-sdown"))
+        _watch_sdown(sc, fields, n, 0);
+}
+
+/* Subscribe on the best sentinel that didn't fail since the last successful
+ * subscription. */
+static int _watch_connect(redisSentinelContext *sc)
+{
+    redisSentinel **order, *iter;
+    redisAsyncContext *ac;
+    int i;
+
+    order = _sentinel_order(sc);
+    for (i = 0; order && i < sc->nsentinels; i++)
+    {
+        iter = order[i];
+        if (iter->watch_failed)
+            continue;
+
+        ac = _sentinel_async_connect(sc, iter->hostname, iter->port);
+        if (ac)
+        {
+            sc->watch = ac;
+            sc->watch_sentinel = iter;
+            if (redisAsyncCommand(ac, _watch_message, sc, "SUBSCRIBE +switch-master +sdown -sdown") == REDIS_OK)
+            {
+                free(order);
+                return REDIS_OK;
+            }
+            sc->watch = NULL;
+            redisAsyncFree(ac);
+        }
+        iter->watch_failed = 1;
+        _sentinel_failed(iter);
+    }
+    free(order);
+
+    sc->err = REDIS_ERR_OTHER;
+    snprintf(sc->errstr, sizeof(sc->errstr), "Failed to subscribe to any sentinels");
+    return REDIS_ERR;
+}
+
+int redisSentinelAsyncWatch(redisSentinelContext *sc, redisSentinelCallback *fn)
+{
+    int i;
+
+    if (sc->attach == NULL || sc->watch != NULL)
+        return REDIS_ERR;
+
+    sc->fn = fn;
+    sc->watch_retry = 0;
+    sc->watch_lost = 0;
+    for (i = 0; i < sc->nsentinels; i++)
+        sc->sentinels[i].watch_failed = 0;
+    return _watch_connect(sc);
+}
+
+void redisSentinelCheckTimeouts(redisSentinelContext *sc)
+{
+    int i;
+
+    if (sc->discovery)
+        _discovery_expire(sc->discovery);
+    if (sc->watch == NULL && sc->watch_retry && _sentinel_usec() >= sc->watch_retry)
+    {
+        sc->watch_retry = 0;
+        for (i = 0; i < sc->nsentinels; i++)
+            sc->sentinels[i].watch_failed = 0;
+        if (_watch_connect(sc) != REDIS_OK)
+            _watch_retry_later(sc);
+    }
+    _buffer_expire(sc, 0);
+}
+
+void redisSentinelSetFailoverBuffer(redisSentinelContext *sc, int max_len, size_t max_bytes, long long max_age)
+{
+    sc->buffer_max_len = max_len > 0 ? max_len : 0;
+    sc->buffer_max_bytes = max_bytes;
+    sc->buffer_max_age = max_age;
+    if (sc->buffer_max_len == 0)
+        _buffer_expire(sc, 1);
+}
+
+void redisSentinelExpireBuffer(redisSentinelContext *sc)
+{
+    _buffer_expire(sc, 0);
+}
+
+/* Returns REDIS_OK when the command should be sent right away, and REDIS_ERR
+ * when it is to be buffered. */
+static int _sentinel_send_now(redisSentinelContext *sc)
+{
+    if (sc->buffer_max_len == 0)
+        return REDIS_OK;
+    if (!_master_usable(sc))
+        return REDIS_ERR;
+
+    /* Keep the order of the commands that were buffered before */
+    if (sc->buffer)
+        _buffer_flush(sc);
+    return REDIS_OK;
+}
+
+int redisvSentinelAsyncCommand(redisSentinelContext *sc, redisCallbackFn *fn, void *privdata, const char *format, va_list ap)
+{
+    char *cmd;
+    int len;
+
+    if (_sentinel_send_now(sc) != REDIS_OK)
+    {
+        len = redisvFormatCommand(&cmd, format, ap);
+        if (len < 0)
+            return REDIS_ERR;
+        return _buffer_push(sc, fn, privdata, cmd, len);
+    }
+    if (sc->ac == NULL)
+        return REDIS_ERR;
+    return redisvAsyncCommand(sc->ac, fn, privdata, format, ap);
+}
+
+int redisSentinelAsyncCommand(redisSentinelContext *sc, redisCallbackFn *fn, void *privdata, const char *format, ...)
+{
+    va_list ap;
+    int status;
+    va_start(ap,format);
+    status = redisvSentinelAsyncCommand(sc,fn,privdata,format,ap);
+    va_end(ap);
+    return status;
+}
+
+int redisSentinelAsyncCommandArgv(redisSentinelContext *sc, redisCallbackFn *fn, void *privdata, int argc, const char **argv, const size_t *argvlen)
+{
+    char *cmd;
+    int len;
+
+    if (_sentinel_send_now(sc) != REDIS_OK)
+    {
+        len = redisFormatCommandArgv(&cmd, argc, argv, argvlen);
+        if (len < 0)
+            return REDIS_ERR;
+        return _buffer_push(sc, fn, privdata, cmd, len);
+    }
+    if (sc->ac == NULL)
+        return REDIS_ERR;
+    return redisAsyncCommandArgv(sc->ac, fn, privdata, argc, argv, argvlen);
+}
+
+int redisSentinelAddGroup(redisSentinelContext *sc, const char *name)
+{
+    redisSentinelGroup *groups, *g;
+
+    /* Replies of a running resolve point into the array */
+    if (sc->resolve != NULL || strlen(name) >= sizeof(g->name))
+        return -1;
+    if (redisSentinelGetGroup(sc, name) >= 0)
+        return -1;
+
+    groups = (redisSentinelGroup *)realloc(sc->groups, sizeof(*groups) * (sc->ngroups + 1));
+    if (groups == NULL)
+        return -1;
+    sc->groups = groups;
+    g = &sc->groups[sc->ngroups];
+    memset(g, 0, sizeof(*g));
+    snprintf(g->name, sizeof(g->name), "%s", name);
+    return sc->ngroups++;
+}
+
+int redisSentinelGetGroup(redisSentinelContext *sc, const char *name)
+{
+    int i;
+
+    for (i = 0; i < sc->ngroups; i++)
+    {
+        if (!strcmp(sc->groups[i].name, name))
+            return i;
+    }
+    return -1;
+}
+
+void redisSentinelSetGroupCallback(redisSentinelContext *sc, redisSentinelGroupCallback *fn)
+{
+    sc->group_fn = fn;
+}
+
+/* Store a get-master-addr-by-name reply, returns 1 when it held an address. */
+static int _group_set_address(redisSentinelContext *sc, redisSentinelGroup *g, redisReply *reply)
+{
+    if (reply == NULL || reply->type != REDIS_REPLY_ARRAY || reply->elements != 2 ||
+        reply->element[0]->type != REDIS_REPLY_STRING ||
+        reply->element[1]->type != REDIS_REPLY_STRING)
+        return 0;
+
+    snprintf(g->hostname, sizeof(g->hostname), "%s", reply->element[0]->str);
+    g->port = atoi(reply->element[1]->str);
+    g->resolved = 1;
+
+    /* Lets the first reconnect of the cluster skip the sentinels */
+    if (g == &sc->groups[0])
+        _cache_master(sc, g->hostname, g->port);
+    return 1;
+}
+
+static int _groups_unresolved(redisSentinelContext *sc)
+{
+    int i, n = 0;
+
+    for (i = 0; i < sc->ngroups; i++)
+        n += !sc->groups[i].resolved;
+    return n;
+}
+
+static void _groups_failed(redisSentinelContext *sc)
+{
+    sc->err = REDIS_ERR_OTHER;
+    snprintf(sc->errstr, sizeof(sc->errstr), "Failed to resolve %d master group(s)", _groups_unresolved(sc));
+}
+
+int redisSentinelResolveGroups(redisSentinelContext *sc)
+{
+    redisSentinel **order, *iter;
+    redisReply *reply;
+    redisContext *c;
+    long long start;
+    int i, j;
+
+    for (i = 0; i < sc->ngroups; i++)
+        sc->groups[i].resolved = 0;
+
+    order = _sentinel_order(sc);
+    for (j = 0; order && j < sc->nsentinels && _groups_unresolved(sc); j++)
+    {
+        iter = order[j];
+        start = _sentinel_usec();
+        c = redisConnectWithTimeout(iter->hostname, iter->port, *sc->timeout);
+        if (c == NULL || c->err)
+        {
+            redisFree(c);
+            _sentinel_failed(iter);
+            continue;
+        }
+
+        /* A single round trip for every group this sentinel is asked for */
+        for (i = 0; i < sc->ngroups; i++)
+        {
+            if (!sc->groups[i].resolved)
+                redisAppendCommand(c, "SENTINEL get-master-addr-by-name %s", sc->groups[i].name);
+        }
+        for (i = 0; i < sc->ngroups; i++)
+        {
+            if (sc->groups[i].resolved)
+                continue;
+            if (redisGetReply(c, (void **)&reply) != REDIS_OK)
+                break;
+            /* The first reply tells how fast the sentinel answers */
+            if (start)
+                _sentinel_ok(iter, _sentinel_usec() - start);
+            start = 0;
+            _group_set_address(sc, &sc->groups[i], reply);
+            freeReplyObject(reply);
+        }
+        if (start)
+            _sentinel_failed(iter);
+        redisFree(c);
+    }
+    free(order);
+
+    if (_groups_unresolved(sc))
+    {
+        _groups_failed(sc);
+        return REDIS_ERR;
+    }
+    sc->err = 0;
+    sc->errstr[0] = '\0';
+    return REDIS_OK;
+}
+
+static int _resolve_next(redisSentinelContext *sc);
+
+static void _resolve_reply(redisAsyncContext *ac, void *r, void *privdata)
+{
+    redisSentinelContext *sc = (redisSentinelContext *)ac->data;
+    redisSentinelGroup *g = (redisSentinelGroup *)privdata;
+    redisSentinelResolveCallback *fn;
+
+    if (sc == NULL || sc->resolve != ac)
+        return;
+
+    /* A failed connection sends no other replies either */
+    if (r != NULL)
+    {
+        _sentinel_ok(sc->resolve_order[sc->resolve_pos], -1);
+        _group_set_address(sc, g, (redisReply *)r);
+        if (--sc->resolve_pending > 0)
+            return;
+        ac->data = NULL;
+        redisAsyncDisconnect(ac);
+    }
+    else
+    {
+        _sentinel_failed(sc->resolve_order[sc->resolve_pos]);
+    }
+    sc->resolve = NULL;
+
+    if (_groups_unresolved(sc))
+    {
+        sc->resolve_pos++;
+        if (_resolve_next(sc) == REDIS_OK)
+            return;
+    }
+    else
+    {
+        sc->err = 0;
+        sc->errstr[0] = '\0';
+    }
+
+    free(sc->resolve_order);
+    sc->resolve_order = NULL;
+    fn = sc->resolve_fn;
+    sc->resolve_fn = NULL;
+    fn(sc, sc->err ? REDIS_ERR : REDIS_OK);
+}
+
+/* Ask the sentinel at resolve_pos, or the ones after it, for every unresolved
+ * group. */
+static int _resolve_next(redisSentinelContext *sc)
+{
+    redisSentinel *iter;
+    redisAsyncContext *ac;
+    int i;
+
+    for (; sc->resolve_pos < sc->nsentinels; sc->resolve_pos++)
+    {
+        iter = sc->resolve_order[sc->resolve_pos];
+        ac = _sentinel_async_connect(sc, iter->hostname, iter->port);
+        if (ac == NULL)
+        {
+            _sentinel_failed(iter);
+            continue;
+        }
+
+        ac->data = sc;
+        sc->resolve = ac;
+        sc->resolve_pending = 0;
+        for (i = 0; i < sc->ngroups; i++)
+        {
+            if (sc->groups[i].resolved)
+                continue;
+            if (redisAsyncCommand(ac, _resolve_reply, &sc->groups[i], "SENTINEL get-master-addr-by-name %s", sc->groups[i].name) != REDIS_OK)
+                break;
+            sc->resolve_pending++;
+        }
+        if (i == sc->ngroups)
+            return REDIS_OK;
+
+        /* The replies of what was sent are ignored */
+        sc->resolve = NULL;
+        redisAsyncFree(ac);
+    }
+
+    _groups_failed(sc);
+    return REDIS_ERR;
+}
+
+int redisSentinelAsyncResolveGroups(redisSentinelContext *sc, redisSentinelResolveCallback *fn)
+{
+    int i;
+
+    /* resolve_fn also tells that a resolve is in progress */
+    if (fn == NULL || sc->attach == NULL || sc->resolve != NULL || sc->resolve_fn != NULL)
+        return REDIS_ERR;
+
+    for (i = 0; i < sc->ngroups; i++)
+        sc->groups[i].resolved = 0;
+    sc->resolve_order = _sentinel_order(sc);
+    if (sc->resolve_order == NULL)
+        return REDIS_ERR;
+    sc->resolve_pos = 0;
+    sc->resolve_fn = fn;
+
+    /* Nothing to wait for: report the error without calling fn */
+    if (_resolve_next(sc) != REDIS_OK)
+    {
+        free(sc->resolve_order);
+        sc->resolve_order = NULL;
+        sc->resolve_fn = NULL;
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+redisContext *redisSentinelConnectGroup(redisSentinelContext *sc, int group)
+{
+    redisSentinelGroup *g;
+    redisReply *reply;
+    redisContext *c;
+
+    if (group < 0 || group >= sc->ngroups || sc->groups[group].port == 0)
+        return NULL;
+    g = &sc->groups[group];
+    c = redisConnectWithTimeout(g->hostname, g->port, *sc->timeout);
+    if (c == NULL || c->err)
+        return c;
+
+    reply = (redisReply *)redisCommand(c, "ROLE");
+    if (!_is_master_role(reply) && !c->err)
+    {
+        c->err = REDIS_ERR_OTHER;
+        snprintf(c->errstr, sizeof(c->errstr), "The address of group %.80s is not a master", g->name);
+    }
+    if (reply)
+        freeReplyObject(reply);
+    return c;
+}
+
+redisAsyncContext *redisSentinelAsyncConnectGroup(redisSentinelContext *sc, int group)
+{
+    redisSentinelGroup *g;
+
+    if (group < 0 || group >= sc->ngroups || sc->groups[group].port == 0)
+        return NULL;
+    g = &sc->groups[group];
+    return redisAsyncConnect(g->hostname, g->port);
+}
+
+redisSentinelReadContext *redisSentinelReadInit(redisSentinelContext *sc)
+{
+    redisSentinelReadContext *rc;
+
+    rc = (redisSentinelReadContext *)calloc(1, sizeof(*rc));
+    if (rc == NULL)
+        return NULL;
+    rc->sc = sc;
+    return rc;
+}
+
+void redisSentinelReadSetMaxLag(redisSentinelReadContext *rc, long long max_lag)
+{
+    rc->max_lag = max_lag;
+}
+
+/* Free a connection owned by the read context. Pending callbacks run right
+ * away with a NULL reply; the caller resets its pointer first so they can
+ * tell. */
+static void _read_free_context(redisAsyncContext *ac)
+{
+    if (ac)
+        redisAsyncFree(ac);
+}
+
+static void _read_remove_replica(redisSentinelReplica *r)
+{
+    redisAsyncContext *ac = r->ac;
+
+    r->ac = NULL;
+    _read_free_context(ac);
+    free(r);
+}
+
+/* Returns the value of field in an INFO reply, or -1. */
+static long long _info_field(const char *info, const char *field)
+{
+    const char *p = strstr(info, field);
+
+    if (p == NULL)
+        return -1;
+    return strtoll(p + strlen(field), NULL, 10);
+}
+
+static void _read_replica_probed(redisAsyncContext *ac, void *r, void *privdata)
+{
+    redisSentinelReplica *rep = (redisSentinelReplica *)privdata;
+    redisReply *reply = (redisReply *)r;
+    long long sample, offset;
+
+    if (rep->ac != ac)
+        return;
+
+    if (reply == NULL)
+    {
+        /* The connection is gone, the next probe connects again. */
+        rep->ac = NULL;
+        rep->healthy = 0;
+        rep->probe_start = 0;
+        return;
+    }
+
+    sample = _sentinel_usec() - rep->probe_start;
+    rep->probe_start = 0;
+    rep->rtt = rep->rtt ? (7 * rep->rtt + sample) / 8 : sample;
+
+    if (reply->type != REDIS_REPLY_STRING)
+    {
+        rep->healthy = 0;
+        return;
+    }
+    offset = _info_field(reply->str, "slave_repl_offset:");
+    if (offset < 0)
+        offset = _info_field(reply->str, "master_repl_offset:");
+    if (offset >= 0)
+        rep->offset = offset;
+    rep->healthy = strstr(reply->str, "master_link_status:up") != NULL;
+}
+
+static void _read_master_probed(redisAsyncContext *ac, void *r, void *privdata)
+{
+    redisSentinelReadContext *rc = (redisSentinelReadContext *)privdata;
+    redisReply *reply = (redisReply *)r;
+    long long offset;
+
+    if (rc->master != ac)
+        return;
+
+    rc->master_probe_start = 0;
+    if (reply == NULL)
+    {
+        rc->master = NULL;
+        return;
+    }
+    if (reply->type == REDIS_REPLY_STRING)
+    {
+        offset = _info_field(reply->str, "master_repl_offset:");
+        if (offset >= 0)
+            rc->master_offset = offset;
+    }
+}
+
+/* A failed connect is noticed by the probe that is sent right away, a lost
+ * connection by its disconnect callback. */
+static void _read_replica_disconnect(const redisAsyncContext *ac, int status)
+{
+    redisSentinelReplica *rep = (redisSentinelReplica *)ac->data;
+    (void)status;
+
+    if (rep->ac == ac)
+    {
+        rep->ac = NULL;
+        rep->healthy = 0;
+        rep->probe_start = 0;
+    }
+}
+
+static void _read_master_disconnect(const redisAsyncContext *ac, int status)
+{
+    redisSentinelReadContext *rc = (redisSentinelReadContext *)ac->data;
+    (void)status;
+
+    if (rc->master == ac)
+    {
+        rc->master = NULL;
+        rc->master_probe_start = 0;
+    }
+}
+
+static void _read_probe_replica(redisSentinelReadContext *rc, redisSentinelReplica *rep)
+{
+    redisSentinelContext *sc = rc->sc;
+
+    if (rep->probe_start)
+        return;
+    if (rep->ac == NULL)
+    {
+        rep->ac = _sentinel_async_connect(sc, rep->hostname, rep->port);
+        if (rep->ac == NULL)
+        {
+            rep->healthy = 0;
+            return;
+        }
+        rep->ac->data = rep;
+        redisAsyncSetDisconnectCallback(rep->ac, _read_replica_disconnect);
+    }
+    rep->probe_start = _sentinel_usec();
+    if (redisAsyncCommand(rep->ac, _read_replica_probed, rep, "INFO replication") != REDIS_OK)
+        rep->probe_start = 0;
+}
+
+/* The master is probed over a connection of our own, which follows the
+ * master connection of the sentinel context around. */
+static void _read_probe_master(redisSentinelReadContext *rc)
+{
+    redisSentinelContext *sc = rc->sc;
+    redisAsyncContext *ac;
+
+    if (sc->ac == NULL || sc->ac->c.tcp.host == NULL)
+        return;
+    if (rc->master && (strcmp(rc->master->c.tcp.host, sc->ac->c.tcp.host) ||
+                       rc->master->c.tcp.port != sc->ac->c.tcp.port))
+    {
+        ac = rc->master;
+        rc->master = NULL;
+        rc->master_probe_start = 0;
+        _read_free_context(ac);
+    }
+    if (rc->master_probe_start)
+        return;
+    if (rc->master == NULL)
+    {
+        rc->master = _sentinel_async_connect(sc, sc->ac->c.tcp.host, sc->ac->c.tcp.port);
+        if (rc->master == NULL)
+            return;
+        rc->master->data = rc;
+        redisAsyncSetDisconnectCallback(rc->master, _read_master_disconnect);
+    }
+    rc->master_probe_start = _sentinel_usec();
+    if (redisAsyncCommand(rc->master, _read_master_probed, rc, "INFO replication") != REDIS_OK)
+        rc->master_probe_start = 0;
+}
+
+void redisSentinelReadProbe(redisSentinelReadContext *rc)
+{
+    int i;
+
+    if (rc->sc->attach == NULL)
+        return;
+    _read_probe_master(rc);
+    for (i = 0; i < rc->len; i++)
+        _read_probe_replica(rc, rc->replicas[i]);
+}
+
+/* Find a field in the flat key/value array describing an instance */
+static const char *_instance_field(redisReply *instance, const char *name)
+{
+    size_t i;
+
+    for (i = 0; i + 1 < instance->elements; i += 2)
+    {
+        if (instance->element[i]->type == REDIS_REPLY_STRING &&
+            instance->element[i + 1]->type == REDIS_REPLY_STRING &&
+            !strcmp(instance->element[i]->str, name))
+            return instance->element[i + 1]->str;
+    }
+    return NULL;
+}
+
+/* Sync the replica list with a SENTINEL replicas reply. */
+static void _read_update_replicas(redisSentinelReadContext *rc, redisReply *reply)
+{
+    redisSentinelReplica **replicas, *rep;
+    const char *ip, *port, *flags, *offset;
+    size_t i;
+    int j, len;
+
+    for (j = 0; j < rc->len; j++)
+        rc->replicas[j]->seen = 0;
+
+    replicas = (redisSentinelReplica **)realloc(rc->replicas, sizeof(*replicas) * (rc->len + reply->elements + 1));
+    if (replicas == NULL)
+        return;
+    rc->replicas = replicas;
+
+    for (i = 0; i < reply->elements; i++)
+    {
+        if (reply->element[i]->type != REDIS_REPLY_ARRAY)
+            continue;
+        ip = _instance_field(reply->element[i], "ip");
+        port = _instance_field(reply->element[i], "port");
+        flags = _instance_field(reply->element[i], "flags");
+        offset = _instance_field(reply->element[i], "slave-repl-offset");
+        if (ip == NULL || port == NULL || (flags && (strstr(flags, "_down") || strstr(flags, "disconnected"))))
+            continue;
+
+        rep = NULL;
+        for (j = 0; j < rc->len; j++)
+        {
+            if (rc->replicas[j]->port == atoi(port) && !strcmp(rc->replicas[j]->hostname, ip))
+            {
+                rep = rc->replicas[j];
+                break;
+            }
+        }
+        if (rep == NULL)
+        {
+            rep = (redisSentinelReplica *)calloc(1, sizeof(*rep));
+            if (rep == NULL)
+                continue;
+            snprintf(rep->hostname, sizeof(rep->hostname), "%s", ip);
+            rep->port = atoi(port);
+            if (offset)
+                rep->offset = strtoll(offset, NULL, 10);
+            rc->replicas[rc->len++] = rep;
+        }
+        rep->seen = 1;
+    }
+
+    /* Drop replicas the sentinels no longer know about */
+    for (j = 0, len = 0; j < rc->len; j++)
+    {
+        if (rc->replicas[j]->seen)
+            rc->replicas[len++] = rc->replicas[j];
+        else
+            _read_remove_replica(rc->replicas[j]);
+    }
+    rc->len = len;
+}
+
+static int _read_refresh_next(redisSentinelReadContext *rc);
+
+static void _read_refresh_reply(redisAsyncContext *ac, void *r, void *privdata)
+{
+    redisSentinelReadContext *rc = (redisSentinelReadContext *)privdata;
+    redisReply *reply = (redisReply *)r;
+
+    if (rc->refresh != ac)
+        return;
+    rc->refresh = NULL;
+
+    if (reply)
+    {
+        _sentinel_ok(rc->refresh_order[rc->refresh_pos], -1);
+        redisAsyncDisconnect(ac);
+    }
+    else
+    {
+        _sentinel_failed(rc->refresh_order[rc->refresh_pos]);
+    }
+    if (reply == NULL || reply->type != REDIS_REPLY_ARRAY)
+    {
+        rc->refresh_pos++;
+        _read_refresh_next(rc);
+        return;
+    }
+
+    free(rc->refresh_order);
+    rc->refresh_order = NULL;
+    rc->err = 0;
+    rc->errstr[0] = '\0';
+    _read_update_replicas(rc, reply);
+    redisSentinelReadProbe(rc);
+}
+
+/* Ask the sentinels one after the other, starting at refresh_pos. */
+static int _read_refresh_next(redisSentinelReadContext *rc)
+{
+    redisSentinelContext *sc = rc->sc;
+    redisSentinel *iter;
+    redisAsyncContext *ac;
+
+    for (; rc->refresh_pos < sc->nsentinels; rc->refresh_pos++)
+    {
+        iter = rc->refresh_order[rc->refresh_pos];
+        ac = _sentinel_async_connect(sc, iter->hostname, iter->port);
+        if (ac == NULL)
+        {
+            _sentinel_failed(iter);
+            continue;
+        }
+        rc->refresh = ac;
+        if (redisAsyncCommand(ac, _read_refresh_reply, rc, "SENTINEL replicas %s", sc->cluster) == REDIS_OK)
+            return REDIS_OK;
+        rc->refresh = NULL;
+        redisAsyncFree(ac);
+    }
+
+    free(rc->refresh_order);
+    rc->refresh_order = NULL;
+    rc->err = REDIS_ERR_OTHER;
+    snprintf(rc->errstr, sizeof(rc->errstr), "Failed to get the replicas from any sentinels");
+    return REDIS_ERR;
+}
+
+int redisSentinelReadRefresh(redisSentinelReadContext *rc)
+{
+    if (rc->sc->attach == NULL || rc->refresh != NULL)
+        return REDIS_ERR;
+    rc->refresh_order = _sentinel_order(rc->sc);
+    if (rc->refresh_order == NULL)
+        return REDIS_ERR;
+    rc->refresh_pos = 0;
+    return _read_refresh_next(rc);
+}
+
+redisSentinelReplica *redisSentinelReadPick(redisSentinelReadContext *rc)
+{
+    redisSentinelReplica *rep, *best = NULL;
+    long long score, best_score = 0;
+    int i;
+
+    for (i = 0; i < rc->len; i++)
+    {
+        rep = rc->replicas[i];
+        if (rep->ac == NULL || !rep->healthy)
+            continue;
+        if (rc->max_lag && rc->master_offset && rc->master_offset - rep->offset > rc->max_lag)
+            continue;
+
+        /* Expected latency: every command queued in front adds a round trip */
+        score = (rep->rtt + 1) * (1 + (long long)rep->ac->flow.pending);
+        if (best == NULL || score < best_score)
+        {
+            best = rep;
+            best_score = score;
+        }
+    }
+    return best;
+}
+
+int redisvSentinelReadCommand(redisSentinelReadContext *rc, redisCallbackFn *fn, void *privdata, const char *format, va_list ap)
+{
+    redisSentinelReplica *rep = redisSentinelReadPick(rc);
+    va_list cpy;
+    int status;
+
+    if (rep)
+    {
+        va_copy(cpy, ap);
+        status = redisvAsyncCommand(rep->ac, fn, privdata, format, cpy);
+        va_end(cpy);
+        if (status == REDIS_OK)
+            return REDIS_OK;
+    }
+    return redisvSentinelAsyncCommand(rc->sc, fn, privdata, format, ap);
+}
+
+int redisSentinelReadCommand(redisSentinelReadContext *rc, redisCallbackFn *fn, void *privdata, const char *format, ...)
+{
+    va_list ap;
+    int status;
+    va_start(ap,format);
+    status = redisvSentinelReadCommand(rc,fn,privdata,format,ap);
+    va_end(ap);
+    return status;
+}
+
+int redisSentinelReadCommandArgv(redisSentinelReadContext *rc, redisCallbackFn *fn, void *privdata, int argc, const char **argv, const size_t *argvlen)
+{
+    redisSentinelReplica *rep = redisSentinelReadPick(rc);
+
+    if (rep && redisAsyncCommandArgv(rep->ac, fn, privdata, argc, argv, argvlen) == REDIS_OK)
+        return REDIS_OK;
+    return redisSentinelAsyncCommandArgv(rc->sc, fn, privdata, argc, argv, argvlen);
+}
+
+void redisSentinelReadFree(redisSentinelReadContext *rc)
+{
+    redisAsyncContext *ac;
+    int i;
+
+    if (rc == NULL)
+        return;
+
+    ac = rc->refresh;
+    rc->refresh = NULL;
+    _read_free_context(ac);
+    ac = rc->master;
+    rc->master = NULL;
+    _read_free_context(ac);
+    for (i = 0; i < rc->len; i++)
+        _read_remove_replica(rc->replicas[i]);
+    free(rc->replicas);
+    free(rc->refresh_order);
+    free(rc);
 }
 
 /* Not implemented in hiredis
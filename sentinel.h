@@ -14,11 +14,47 @@
 extern "C" {
 #endif
 
-typedef struct redisSentinelList {
+struct redisSentinelContext;
+struct redisSentinelDiscovery; /* discovery internals are private to sentinel.c */
+struct redisSentinelBuffered; /* buffered commands are private to sentinel.c */
+
+/* Attaches a context created by the sentinel layer to an event library, e.g.
+ * a function calling redisLibeventAttach(ac,base). Returns REDIS_OK or
+ * REDIS_ERR like the adapters do. */
+typedef int (redisSentinelAttachFn)(redisAsyncContext *ac, void *privdata);
+
+/* Called when non-blocking discovery is done. On success ac is connected to
+ * the master and attached; on failure it is NULL and sc->errstr is set. */
+typedef void (redisSentinelCallback)(struct redisSentinelContext *sc, redisAsyncContext *ac, int status);
+
+/* Called when the sentinels told about a new master for a group. */
+typedef void (redisSentinelGroupCallback)(struct redisSentinelContext *sc, int group);
+
+/* Called once all groups were resolved, or when that failed. */
+typedef void (redisSentinelResolveCallback)(struct redisSentinelContext *sc, int status);
+
+/* A master monitored by the sentinels, looked up by name */
+typedef struct redisSentinelGroup {
+    char name[256];
+    char hostname[MAX_HOSTNAME_LEN];
+    int port; /* 0 until resolved */
+    int resolved; /* answered during the current resolve */
+} redisSentinelGroup;
+
+/* A sentinel and how it answered lately. Connection attempts go to the
+ * sentinels with the lowest expected latency first: the smoothed round trip
+ * time, or the connect timeout while unknown, multiplied by the number of
+ * consecutive failures plus one. After a failure a sentinel is backed off for
+ * an exponentially growing period, during which it is only tried after all
+ * other ones. */
+typedef struct redisSentinel {
     char hostname[MAX_HOSTNAME_LEN];
     int port;
-    struct redisSentinelList *next;
-} redisSentinelList;
+    long long rtt; /* smoothed round trip time in usec, 0 until measured */
+    int failures; /* consecutive failures */
+    long long retry_after; /* end of the backoff (monotonic usec), 0 if none */
+    int watch_failed; /* couldn't be subscribed to since the last success */
+} redisSentinel;
 
 /* Context for Redis Sentinels */
 typedef struct redisSentinelContext {
@@ -29,17 +65,184 @@ typedef struct redisSentinelContext {
     redisContext *c;
     redisAsyncContext *ac;
 
-    redisSentinelList *list;
+    redisSentinel *sentinels;
+    int nsentinels;
+
+    /* Last master that was connected to, tried first when reconnecting */
+    char master_hostname[MAX_HOSTNAME_LEN];
+    int master_port; /* 0 when unknown */
 
+    /* Non-blocking discovery */
+    redisSentinelAttachFn *attach;
+    void *attach_privdata;
+    int quorum; /* sentinels that need to agree on the master, 0 takes the first answer */
+    struct redisSentinelDiscovery *discovery; /* set while in progress */
+    redisSentinelCallback *fn; /* called whenever the master connection changes */
+
+    /* Connection subscribed to failover events, see redisSentinelAsyncWatch() */
+    redisAsyncContext *watch;
+    redisSentinel *watch_sentinel;
+    int master_down; /* the watched sentinel reported the master as +sdown */
+    long long watch_retry; /* subscribe again after this (monotonic usec) once
+                            * all sentinels failed, 0 if not */
+    int watch_lost; /* fn was told, until subscribed again */
+
+    /* Commands held while there is no usable master, see
+     * redisSentinelSetFailoverBuffer() */
+    struct redisSentinelBuffered *buffer, *buffer_tail;
+    int buffer_len;
+    size_t buffer_bytes;
+    int buffer_max_len; /* 0 when buffering is disabled */
+    size_t buffer_max_bytes; /* 0 for no limit */
+    long long buffer_max_age; /* usec, 0 for no limit */
+
+    /* Master groups sharing the sentinel connections, group 0 is cluster */
+    redisSentinelGroup *groups;
+    int ngroups;
+    redisSentinelGroupCallback *group_fn;
+    redisAsyncContext *resolve; /* sentinel the groups are resolved through */
+    redisSentinel **resolve_order; /* sentinels left to ask, best first */
+    int resolve_pos;
+    int resolve_pending; /* replies still expected from resolve */
+    redisSentinelResolveCallback *resolve_fn;
 } redisSentinelContext;
 
 
 void redisSentinelFree(redisSentinelContext *sc);
 redisSentinelContext *redisSentinelInit(const char *cluster, const char **hostname, const int *port, int len);
 redisContext *redisSentinelConnect(redisSentinelContext *sc);
+/* Reconnects to the last known master directly when it still has the master
+ * role, and goes through the sentinels otherwise. */
 redisContext *redisSentinelReconnect(redisSentinelContext *sc);
 redisAsyncContext *redisSentinelAsyncConnect(redisSentinelContext *sc);
 
+/* Non-blocking counterpart of redisSentinelAsyncConnect(): every sentinel is
+ * queried at the same time over async connections attached with the attach
+ * function, the master is connected to as soon as the first (or quorum)
+ * sentinels agree on its address and fn is called once its role was verified.
+ * When a master was connected to before, it is tried first and the sentinels
+ * are only queried when it no longer is the master. Host names are still
+ * resolved synchronously when connecting. */
+void redisSentinelSetAttach(redisSentinelContext *sc, redisSentinelAttachFn *fn, void *privdata);
+void redisSentinelSetQuorum(redisSentinelContext *sc, int quorum);
+int redisSentinelAsyncDiscover(redisSentinelContext *sc, redisSentinelCallback *fn);
+
+/* Asking the sentinels and verifying the master each have the timeout of the
+ * context to complete, sentinels that didn't answer by then count as failed.
+ * The sentinel layer has no timers of its own: deadlines are checked, and
+ * buffered commands expired like redisSentinelExpireBuffer() does, when this
+ * is called, e.g. from a timer of the event library every 100 msec. A
+ * discovery that ran out of time calls fn with REDIS_ERR. A failover
+ * subscription that was lost is set up again from here as well. */
+void redisSentinelCheckTimeouts(redisSentinelContext *sc);
+
+/* Subscribe to +switch-master and +/-sdown on one of the sentinels, moving to
+ * the next sentinel when that connection is lost. On +switch-master for this
+ * master, a connection to the new master is set up and verified like during
+ * discovery, the previous one is disconnected cleanly and fn is called with
+ * the new context. fn is also called with a NULL context when the connection
+ * to the master is lost; calling redisSentinelAsyncDiscover() from there
+ * looks the master up again. When no sentinel can be subscribed to any more,
+ * fn is called once with a NULL context and sc->errstr set, and
+ * redisSentinelCheckTimeouts() subscribes again as soon as the backoff of a
+ * sentinel ended.
+ *
+ * Master contexts created by the sentinel layer use their data field and
+ * disconnect callback; use fn instead. */
+int redisSentinelAsyncWatch(redisSentinelContext *sc, redisSentinelCallback *fn);
+
+/* A sentinel context can resolve many master groups over the same sentinel
+ * connections: every group is asked for with pipelined get-master-addr-by-name
+ * requests on the first sentinel that answers, and the next sentinels are only
+ * asked for groups that are still unresolved. The failover subscription of
+ * redisSentinelAsyncWatch() also follows +switch-master for every group and
+ * calls the group callback with its index. Group 0 is the cluster the context
+ * was created for. Returns the index of the new group or -1 on error. The
+ * callback of redisSentinelAsyncResolveGroups() can't be NULL. */
+int redisSentinelAddGroup(redisSentinelContext *sc, const char *name);
+int redisSentinelGetGroup(redisSentinelContext *sc, const char *name);
+void redisSentinelSetGroupCallback(redisSentinelContext *sc, redisSentinelGroupCallback *fn);
+int redisSentinelResolveGroups(redisSentinelContext *sc);
+int redisSentinelAsyncResolveGroups(redisSentinelContext *sc, redisSentinelResolveCallback *fn);
+
+/* Connect to the resolved master of a group. The async variant still needs to
+ * be attached to an event library, like redisAsyncConnect(). */
+redisContext *redisSentinelConnectGroup(redisSentinelContext *sc, int group);
+redisAsyncContext *redisSentinelAsyncConnectGroup(redisSentinelContext *sc, int group);
+
+/* Issue a command on the current master connection. Returns REDIS_ERR when
+ * there is none, unless the failover buffer is enabled. */
+int redisvSentinelAsyncCommand(redisSentinelContext *sc, redisCallbackFn *fn, void *privdata, const char *format, va_list ap);
+int redisSentinelAsyncCommand(redisSentinelContext *sc, redisCallbackFn *fn, void *privdata, const char *format, ...);
+int redisSentinelAsyncCommandArgv(redisSentinelContext *sc, redisCallbackFn *fn, void *privdata, int argc, const char **argv, const size_t *argvlen);
+
+/* While the master connection is lost, or the watched sentinel reported the
+ * master as down, the commands above are held in a buffer instead of failing
+ * or being sent to a master that won't answer. Once a master connection is
+ * set up again (or the master is no longer reported down) they are written
+ * as one pipeline, in the order they were issued. When max_len commands or
+ * max_bytes of formatted commands are buffered, new commands fail right away.
+ * Commands buffered longer than max_age usec fail with a NULL reply and a
+ * NULL context, like the ones still buffered when the sentinel context is
+ * free'd. Ages are only checked when commands are buffered or flushed, and by
+ * redisSentinelExpireBuffer(), which can be called from a timer. A max_len of
+ * 0 disables buffering; zero max_bytes or max_age are no limit. */
+void redisSentinelSetFailoverBuffer(redisSentinelContext *sc, int max_len, size_t max_bytes, long long max_age);
+void redisSentinelExpireBuffer(redisSentinelContext *sc);
+
+/* A replica of the master, as reported by the sentinels */
+typedef struct redisSentinelReplica {
+    char hostname[MAX_HOSTNAME_LEN];
+    int port;
+    redisAsyncContext *ac;
+    int healthy; /* the last probe succeeded and the link to the master is up */
+    int seen; /* listed by the last refresh */
+    long long offset; /* replication offset */
+    long long rtt; /* smoothed round trip time of probes in usec */
+    long long probe_start; /* when the outstanding probe was sent, 0 if none */
+} redisSentinelReplica;
+
+/* Routes read-only commands to the replica that is expected to answer first,
+ * falling back to the master connection of the sentinel context. */
+typedef struct redisSentinelReadContext {
+    int err; /* Error flags, 0 when there is no error */
+    char errstr[128]; /* String representation of error when applicable */
+    redisSentinelContext *sc;
+
+    redisSentinelReplica **replicas;
+    int len;
+
+    long long max_lag; /* skip replicas this many bytes behind, 0 for no limit */
+
+    redisAsyncContext *refresh; /* sentinel queried for the replicas */
+    redisSentinel **refresh_order; /* sentinels left to ask, best first */
+    int refresh_pos;
+
+    redisAsyncContext *master; /* used to probe the master offset */
+    long long master_offset;
+    long long master_probe_start;
+} redisSentinelReadContext;
+
+/* The read context creates its connections with the attach function of the
+ * sentinel context. redisSentinelReadRefresh() asks the sentinels for the
+ * replicas of the master and connects to new ones; redisSentinelReadProbe()
+ * sends INFO replication to every replica and the master, measuring the round
+ * trip time and the replication lag. Call both periodically, e.g. from a
+ * timer of the event library: a refresh probes right away.
+ *
+ * Commands go to the healthy replica with the lowest round trip time,
+ * weighted by the number of commands waiting for a reply on it, that is at
+ * most max_lag bytes behind the master. Without one they go to the master. */
+redisSentinelReadContext *redisSentinelReadInit(redisSentinelContext *sc);
+void redisSentinelReadSetMaxLag(redisSentinelReadContext *rc, long long max_lag);
+int redisSentinelReadRefresh(redisSentinelReadContext *rc);
+void redisSentinelReadProbe(redisSentinelReadContext *rc);
+redisSentinelReplica *redisSentinelReadPick(redisSentinelReadContext *rc);
+int redisvSentinelReadCommand(redisSentinelReadContext *rc, redisCallbackFn *fn, void *privdata, const char *format, va_list ap);
+int redisSentinelReadCommand(redisSentinelReadContext *rc, redisCallbackFn *fn, void *privdata, const char *format, ...);
+int redisSentinelReadCommandArgv(redisSentinelReadContext *rc, redisCallbackFn *fn, void *privdata, int argc, const char **argv, const size_t *argvlen);
+void redisSentinelReadFree(redisSentinelReadContext *rc);
+
 #ifdef __cplusplus
 }
 #endif
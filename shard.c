@@ -0,0 +1,637 @@
+#include "fmacros.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "shard.h"
+
+/* Commands that take multiple keys and are split across nodes. "step" is the
+ * number of arguments that belong to every key. */
+#define SHARD_MERGE_ARRAY 1   /* MGET: elements in original key order */
+#define SHARD_MERGE_INTEGER 2 /* DEL and friends: sum of all integers */
+#define SHARD_MERGE_STATUS 3  /* MSET: a single status reply */
+
+typedef struct redisShardCommand {
+    const char *name;
+    int step;
+    int merge;
+} redisShardCommand;
+
+static const redisShardCommand shardCommands[] = {
+    { "mget",   1, SHARD_MERGE_ARRAY },
+    { "del",    1, SHARD_MERGE_INTEGER },
+    { "unlink", 1, SHARD_MERGE_INTEGER },
+    { "exists", 1, SHARD_MERGE_INTEGER },
+    { "touch",  1, SHARD_MERGE_INTEGER },
+    { "mset",   2, SHARD_MERGE_STATUS },
+    { NULL,     0, 0 }
+};
+
+struct redisShardRequest;
+
+/* Part of a split command sent to a single node. The keys of this part are
+ * index[offset..offset+count) in the original command. */
+typedef struct redisShardPart {
+    struct redisShardRequest *req;
+    int offset;
+    int count;
+} redisShardPart;
+
+typedef struct redisShardRequest {
+    redisCallbackFn *fn;
+    void *privdata;
+    int merge;
+    int pending; /* parts that still need a reply */
+    int failed; /* set when a part got a NULL reply */
+    redisReply *reply; /* merged reply */
+    redisReply *error; /* first error reply */
+    redisShardPart *parts;
+    int *index;
+} redisShardRequest;
+
+/* FNV-1a with the murmur3 finalizer, so that similar labels like
+ * "host:port-1" and "host:port-2" end up far apart on the ring. */
+uint32_t redisShardDefaultHash(const char *key, size_t len) {
+    uint32_t h = 2166136261U;
+    size_t j;
+
+    for (j = 0; j < len; j++) {
+        h ^= (unsigned char)key[j];
+        h *= 16777619U;
+    }
+    h ^= h >> 16;
+    h *= 0x85ebca6bU;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35U;
+    h ^= h >> 16;
+    return h;
+}
+
+static int _shardPointCompare(const void *a, const void *b) {
+    const redisShardPoint *pa = a, *pb = b;
+    if (pa->hash != pb->hash)
+        return pa->hash < pb->hash ? -1 : 1;
+    return pa->node - pb->node;
+}
+
+static int _shardBuildRing(redisShardContext *sc) {
+    redisShardPoint *ring;
+    char label[512];
+    int i, j, n, len;
+
+    ring = malloc(sizeof(*ring)*sc->len*REDIS_SHARD_POINTS_PER_NODE);
+    if (ring == NULL)
+        return REDIS_ERR;
+
+    n = 0;
+    for (i = 0; i < sc->len; i++) {
+        for (j = 0; j < REDIS_SHARD_POINTS_PER_NODE; j++) {
+            len = snprintf(label,sizeof(label),"%s:%d-%d",
+                           sc->nodes[i].host,sc->nodes[i].port,j);
+            if (len >= (int)sizeof(label)) len = sizeof(label)-1;
+            ring[n].hash = sc->hash(label,len);
+            ring[n].node = i;
+            n++;
+        }
+    }
+    qsort(ring,n,sizeof(*ring),_shardPointCompare);
+
+    free(sc->ring);
+    sc->ring = ring;
+    sc->points = n;
+    return REDIS_OK;
+}
+
+static void _shardSetError(redisShardContext *sc, int type, const char *str) {
+    sc->err = type;
+    snprintf(sc->errstr,sizeof(sc->errstr),"%s",str);
+}
+
+/* The shard context owns its async contexts: they free themselves on errors,
+ * so forget about them as soon as that happens. */
+static void _shardForgetContext(const redisAsyncContext *ac) {
+    redisShardNode *node = ac->data;
+    if (node != NULL && node->ac == ac)
+        node->ac = NULL;
+}
+
+static void _shardConnectCallback(const redisAsyncContext *ac, int status) {
+    if (status != REDIS_OK)
+        _shardForgetContext(ac);
+}
+
+static void _shardDisconnectCallback(const redisAsyncContext *ac, int status) {
+    ((void)status);
+    _shardForgetContext(ac);
+}
+
+/* Returns REDIS_ERR only when out of memory: a connection that failed right
+ * away is set as error of the shard context and forgotten. */
+static int _shardConnectNode(redisShardContext *sc, int node) {
+    redisAsyncContext *ac;
+
+    ac = redisAsyncConnect(sc->nodes[node].host,sc->nodes[node].port);
+    if (ac == NULL)
+        return REDIS_ERR;
+
+    if (ac->err) {
+        _shardSetError(sc,ac->err,ac->errstr);
+        redisAsyncFree(ac);
+        return REDIS_OK;
+    }
+    ac->data = &sc->nodes[node];
+    ac->onConnect = _shardConnectCallback;
+    ac->onDisconnect = _shardDisconnectCallback;
+    sc->nodes[node].ac = ac;
+    return REDIS_OK;
+}
+
+redisShardContext *redisShardInit(const char **hostnames, const int *ports, int len) {
+    redisShardContext *sc;
+    int i;
+
+    if (len <= 0)
+        return NULL;
+
+    sc = calloc(1,sizeof(*sc));
+    if (sc == NULL)
+        return NULL;
+
+    sc->hash = redisShardDefaultHash;
+    sc->hashtags = 1;
+    sc->nodes = calloc(len,sizeof(*sc->nodes));
+    if (sc->nodes == NULL)
+        goto oom;
+
+    for (i = 0; i < len; i++) {
+        sc->nodes[i].host = strdup(hostnames[i]);
+        sc->nodes[i].port = ports[i];
+        sc->len++;
+        if (sc->nodes[i].host == NULL)
+            goto oom;
+    }
+
+    if (_shardBuildRing(sc) != REDIS_OK)
+        goto oom;
+
+    for (i = 0; i < len; i++) {
+        if (_shardConnectNode(sc,i) != REDIS_OK)
+            goto oom;
+    }
+    return sc;
+
+oom:
+    redisShardFree(sc);
+    return NULL;
+}
+
+int redisShardSetHashFunction(redisShardContext *sc, redisShardHashFn *fn) {
+    sc->hash = fn ? fn : redisShardDefaultHash;
+    if (_shardBuildRing(sc) != REDIS_OK) {
+        _shardSetError(sc,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+}
+
+void redisShardSetHashTags(redisShardContext *sc, int enabled) {
+    sc->hashtags = enabled;
+}
+
+int redisShardReconnect(redisShardContext *sc, int node) {
+    if (node < 0 || node >= sc->len || sc->nodes[node].ac != NULL)
+        return REDIS_ERR;
+
+    sc->err = 0;
+    sc->errstr[0] = '\0';
+    if (_shardConnectNode(sc,node) != REDIS_OK) {
+        _shardSetError(sc,REDIS_ERR_OOM,"Out of memory");
+        return REDIS_ERR;
+    }
+    return sc->err ? REDIS_ERR : REDIS_OK;
+}
+
+void redisShardDisconnect(redisShardContext *sc) {
+    int i;
+
+    for (i = 0; i < sc->len; i++) {
+        if (sc->nodes[i].ac != NULL)
+            redisAsyncDisconnect(sc->nodes[i].ac);
+    }
+}
+
+void redisShardFree(redisShardContext *sc) {
+    redisAsyncContext *ac;
+    int i;
+
+    if (sc == NULL)
+        return;
+
+    for (i = 0; i < sc->len; i++) {
+        ac = sc->nodes[i].ac;
+        sc->nodes[i].ac = NULL;
+        if (ac != NULL) {
+            ac->data = NULL;
+            redisAsyncFree(ac);
+        }
+        free(sc->nodes[i].host);
+    }
+    free(sc->nodes);
+    free(sc->ring);
+    free(sc);
+}
+
+int redisShardGetNode(redisShardContext *sc, const char *key, size_t len) {
+    const char *s, *e;
+    uint32_t h;
+    int lo, hi, mid;
+
+    /* Only hash what is between the first '{' and the next '}' when that is
+     * not empty, so related keys can be forced to the same node. */
+    if (sc->hashtags && (s = memchr(key,'{',len)) != NULL) {
+        e = memchr(s+1,'}',len-(s+1-key));
+        if (e != NULL && e != s+1) {
+            key = s+1;
+            len = e-key;
+        }
+    }
+
+    h = sc->hash(key,len);
+    lo = 0;
+    hi = sc->points;
+    while (lo < hi) {
+        mid = lo+(hi-lo)/2;
+        if (sc->ring[mid].hash < h)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    if (lo == sc->points)
+        lo = 0;
+    return sc->ring[lo].node;
+}
+
+redisAsyncContext *redisShardGetContext(redisShardContext *sc, const char *key, size_t len) {
+    return sc->nodes[redisShardGetNode(sc,key,len)].ac;
+}
+
+static const redisShardCommand *_shardLookupCommand(const char *name, size_t len) {
+    const redisShardCommand *cmd;
+
+    for (cmd = shardCommands; cmd->name != NULL; cmd++) {
+        if (strlen(cmd->name) == len && strncasecmp(cmd->name,name,len) == 0)
+            return cmd;
+    }
+    return NULL;
+}
+
+static redisReply *_shardCreateReply(int type) {
+    redisReply *r = calloc(1,sizeof(*r));
+    if (r != NULL)
+        r->type = type;
+    return r;
+}
+
+static redisReply *_shardCreateError(const char *str, size_t len) {
+    redisReply *r = calloc(1,sizeof(*r));
+    if (r == NULL)
+        return NULL;
+
+    r->type = REDIS_REPLY_ERROR;
+    r->str = malloc(len+1);
+    if (r->str == NULL) {
+        free(r);
+        return NULL;
+    }
+    memcpy(r->str,str,len);
+    r->str[len] = '\0';
+    r->len = len;
+    return r;
+}
+
+static void _shardFreeRequest(redisShardRequest *req) {
+    freeReplyObject(req->reply);
+    freeReplyObject(req->error);
+    free(req);
+}
+
+/* Replies that can't be merged are an error, as the merged reply would miss
+ * the part of this node. */
+static int _shardPartMatches(redisShardPart *part, redisReply *r) {
+    switch(part->req->merge) {
+    case SHARD_MERGE_ARRAY:
+        return r->type == REDIS_REPLY_ARRAY && (int)r->elements == part->count;
+    case SHARD_MERGE_INTEGER:
+        return r->type == REDIS_REPLY_INTEGER;
+    default:
+        return r->type == REDIS_REPLY_STATUS;
+    }
+}
+
+static void _shardMergeReply(redisShardPart *part, redisReply *r) {
+    static const char unexpected[] = "ERR unexpected reply from shard";
+    redisShardRequest *req = part->req;
+    redisReply *dst = req->reply;
+    int j;
+
+    if (r == NULL) {
+        req->failed = 1;
+        return;
+    }
+
+    if (r->type == REDIS_REPLY_ERROR || !_shardPartMatches(part,r)) {
+        if (req->error != NULL)
+            return;
+        if (r->type == REDIS_REPLY_ERROR)
+            req->error = _shardCreateError(r->str,r->len);
+        else
+            req->error = _shardCreateError(unexpected,sizeof(unexpected)-1);
+        if (req->error == NULL)
+            req->failed = 1;
+        return;
+    }
+
+    switch(req->merge) {
+    case SHARD_MERGE_ARRAY:
+        /* Steal the elements so they don't need to be copied. The emptied
+         * array is free'd by the async context after this callback. */
+        for (j = 0; j < part->count; j++) {
+            dst->element[req->index[part->offset+j]] = r->element[j];
+            r->element[j] = NULL;
+        }
+        break;
+    case SHARD_MERGE_INTEGER:
+        dst->integer += r->integer;
+        break;
+    case SHARD_MERGE_STATUS:
+        if (dst->str == NULL) {
+            dst->str = malloc(r->len+1);
+            if (dst->str != NULL) {
+                memcpy(dst->str,r->str,r->len+1);
+                dst->len = r->len;
+            }
+        }
+        break;
+    }
+}
+
+static void _shardPartCallback(redisAsyncContext *ac, void *r, void *privdata) {
+    redisShardPart *part = privdata;
+    redisShardRequest *req = part->req;
+    redisReply *reply;
+
+    _shardMergeReply(part,r);
+    if (--req->pending > 0)
+        return;
+
+    if (req->failed)
+        reply = NULL;
+    else if (req->error != NULL)
+        reply = req->error;
+    else
+        reply = req->reply;
+
+    if (req->fn != NULL)
+        req->fn(ac,reply,req->privdata);
+    _shardFreeRequest(req);
+}
+
+static int _shardRouteArgv(redisShardContext *sc, redisCallbackFn *fn, void *privdata,
+                           int argc, const char **argv, const size_t *argvlen) {
+    redisAsyncContext *ac;
+    int node = 0;
+
+    if (argc > 1)
+        node = redisShardGetNode(sc,argv[1],argvlen[1]);
+    ac = sc->nodes[node].ac;
+    if (ac == NULL)
+        return REDIS_ERR;
+    return redisAsyncCommandArgv(ac,fn,privdata,argc,argv,argvlen);
+}
+
+/* Split a multi-key command in one command per node. The keys for every node
+ * keep their relative order, and index[] remembers where they came from. */
+static int _shardFanout(redisShardContext *sc, const redisShardCommand *cmd,
+                        redisCallbackFn *fn, void *privdata,
+                        int argc, const char **argv, const size_t *argvlen) {
+    redisShardRequest *req;
+    const char **subargv = NULL;
+    size_t *subargvlen = NULL;
+    int *keynode = NULL;
+    int nkeys, i, j, k, n, sent, first;
+
+    nkeys = (argc-1)/cmd->step;
+    if (nkeys == 0 || (argc-1) % cmd->step != 0)
+        return _shardRouteArgv(sc,fn,privdata,argc,argv,argvlen);
+
+    keynode = malloc(sizeof(int)*nkeys);
+    if (keynode == NULL)
+        return REDIS_ERR;
+
+    first = -1;
+    for (i = 0; i < nkeys; i++) {
+        keynode[i] = redisShardGetNode(sc,argv[1+i*cmd->step],argvlen[1+i*cmd->step]);
+        if (first == -1)
+            first = keynode[i];
+        else if (first != keynode[i])
+            first = -2;
+    }
+
+    /* All keys live on the same node: no need to split anything. */
+    if (first >= 0) {
+        free(keynode);
+        return _shardRouteArgv(sc,fn,privdata,argc,argv,argvlen);
+    }
+
+    /* Request, per-node parts and the index live in a single allocation. */
+    req = calloc(1,sizeof(*req)+sizeof(redisShardPart)*sc->len+sizeof(int)*nkeys);
+    subargv = malloc(sizeof(char*)*argc);
+    subargvlen = malloc(sizeof(size_t)*argc);
+    if (req == NULL || subargv == NULL || subargvlen == NULL)
+        goto oom;
+
+    req->fn = fn;
+    req->privdata = privdata;
+    req->merge = cmd->merge;
+    req->parts = (redisShardPart*)(req+1);
+    req->index = (int*)(req->parts+sc->len);
+    if (cmd->merge == SHARD_MERGE_ARRAY)
+        req->reply = _shardCreateReply(REDIS_REPLY_ARRAY);
+    else if (cmd->merge == SHARD_MERGE_INTEGER)
+        req->reply = _shardCreateReply(REDIS_REPLY_INTEGER);
+    else
+        req->reply = _shardCreateReply(REDIS_REPLY_STATUS);
+    if (req->reply == NULL)
+        goto oom;
+
+    if (cmd->merge == SHARD_MERGE_ARRAY) {
+        req->reply->element = calloc(nkeys,sizeof(redisReply*));
+        if (req->reply->element == NULL)
+            goto oom;
+        req->reply->elements = nkeys;
+    }
+
+    for (i = 0; i < nkeys; i++)
+        req->parts[keynode[i]].count++;
+    for (n = 0, k = 0; n < sc->len; n++) {
+        req->parts[n].req = req;
+        req->parts[n].offset = k;
+        k += req->parts[n].count;
+        if (req->parts[n].count > 0)
+            req->pending++;
+        req->parts[n].count = 0;
+    }
+    for (i = 0; i < nkeys; i++) {
+        redisShardPart *part = &req->parts[keynode[i]];
+        req->index[part->offset+part->count++] = i;
+    }
+
+    /* Every node gets its own part appended to its output buffer, so the
+     * parts go out as one pipeline per node on the next write event. */
+    subargv[0] = argv[0];
+    subargvlen[0] = argvlen[0];
+    sent = 0;
+    for (n = 0; n < sc->len; n++) {
+        redisShardPart *part = &req->parts[n];
+        if (part->count == 0)
+            continue;
+
+        k = 1;
+        for (i = 0; i < part->count; i++) {
+            int arg = 1+req->index[part->offset+i]*cmd->step;
+            for (j = 0; j < cmd->step; j++) {
+                subargv[k] = argv[arg+j];
+                subargvlen[k] = argvlen[arg+j];
+                k++;
+            }
+        }
+
+        if (sc->nodes[n].ac == NULL ||
+            redisAsyncCommandArgv(sc->nodes[n].ac,_shardPartCallback,part,
+                                  k,subargv,subargvlen) != REDIS_OK)
+        {
+            req->failed = 1;
+            req->pending--;
+        } else {
+            sent++;
+        }
+    }
+
+    free(keynode);
+    free(subargv);
+    free(subargvlen);
+
+    /* Nothing was sent, so the callback will never be called. */
+    if (sent == 0) {
+        _shardFreeRequest(req);
+        return REDIS_ERR;
+    }
+    return REDIS_OK;
+
+oom:
+    if (req != NULL)
+        _shardFreeRequest(req);
+    free(keynode);
+    free(subargv);
+    free(subargvlen);
+    return REDIS_ERR;
+}
+
+int redisShardAsyncCommandArgv(redisShardContext *sc, redisCallbackFn *fn, void *privdata, int argc, const char **argv, const size_t *argvlen) {
+    const redisShardCommand *cmd;
+    size_t *lens = NULL;
+    int i, status;
+
+    if (argc <= 0)
+        return REDIS_ERR;
+
+    if (argvlen == NULL) {
+        lens = malloc(sizeof(size_t)*argc);
+        if (lens == NULL)
+            return REDIS_ERR;
+        for (i = 0; i < argc; i++)
+            lens[i] = strlen(argv[i]);
+        argvlen = lens;
+    }
+
+    cmd = _shardLookupCommand(argv[0],argvlen[0]);
+    if (cmd != NULL)
+        status = _shardFanout(sc,cmd,fn,privdata,argc,argv,argvlen);
+    else
+        status = _shardRouteArgv(sc,fn,privdata,argc,argv,argvlen);
+
+    free(lens);
+    return status;
+}
+
+/* Sets a pointer to the argument at p and its length. Returns a pointer to
+ * the next argument in the formatted command, or NULL at the end. */
+static const char *_shardNextArgument(const char *p, const char *end, const char **str, size_t *len) {
+    if (p >= end || p[0] != '$')
+        return NULL;
+
+    *len = strtoul(p+1,NULL,10);
+    p = strchr(p,'\r');
+    if (p == NULL)
+        return NULL;
+    *str = p+2;
+    return p+2+(*len)+2;
+}
+
+int redisvShardAsyncCommand(redisShardContext *sc, redisCallbackFn *fn, void *privdata, const char *format, va_list ap) {
+    redisAsyncContext *ac;
+    const redisShardCommand *cmd;
+    const char **argv = NULL;
+    size_t *argvlen = NULL;
+    const char *p, *end;
+    char *buf;
+    int len, argc, i, status = REDIS_ERR;
+
+    len = redisvFormatCommand(&buf,format,ap);
+    if (len < 0)
+        return REDIS_ERR;
+
+    /* The formatted command always is a multi bulk of bulk strings. */
+    end = buf+len;
+    argc = strtol(buf+1,NULL,10);
+    p = strchr(buf,'\n')+1;
+    if (argc <= 0)
+        goto done;
+
+    argv = malloc(sizeof(char*)*argc);
+    argvlen = malloc(sizeof(size_t)*argc);
+    if (argv == NULL || argvlen == NULL)
+        goto done;
+
+    for (i = 0; i < argc && i < 2; i++)
+        p = _shardNextArgument(p,end,&argv[i],&argvlen[i]);
+
+    /* Commands that are not split are sent verbatim. */
+    cmd = _shardLookupCommand(argv[0],argvlen[0]);
+    if (cmd == NULL) {
+        ac = sc->nodes[argc > 1 ? redisShardGetNode(sc,argv[1],argvlen[1]) : 0].ac;
+        if (ac != NULL)
+            status = redisAsyncFormattedCommand(ac,fn,privdata,buf,len);
+        goto done;
+    }
+
+    for (; i < argc; i++)
+        p = _shardNextArgument(p,end,&argv[i],&argvlen[i]);
+    status = _shardFanout(sc,cmd,fn,privdata,argc,argv,argvlen);
+
+done:
+    free(argv);
+    free(argvlen);
+    free(buf);
+    return status;
+}
+
+int redisShardAsyncCommand(redisShardContext *sc, redisCallbackFn *fn, void *privdata, const char *format, ...) {
+    va_list ap;
+    int status;
+    va_start(ap,format);
+    status = redisvShardAsyncCommand(sc,fn,privdata,format,ap);
+    va_end(ap);
+    return status;
+}
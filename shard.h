@@ -0,0 +1,87 @@
+#ifndef __HIREDIS_SHARD_H
+#define __HIREDIS_SHARD_H
+
+#include <stdint.h>
+
+#include "hiredis.h"
+#include "async.h"
+
+/* Number of points every node gets on the consistent hashing ring. */
+#define REDIS_SHARD_POINTS_PER_NODE 160
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Hash function used to place nodes and keys on the ring. */
+typedef uint32_t (redisShardHashFn)(const char *key, size_t len);
+
+typedef struct redisShardNode {
+    char *host;
+    int port;
+    redisAsyncContext *ac;
+} redisShardNode;
+
+typedef struct redisShardPoint {
+    uint32_t hash;
+    int node; /* index in the nodes array */
+} redisShardPoint;
+
+/* Context for a set of standalone Redis instances sharded by key */
+typedef struct redisShardContext {
+    int err; /* Error flags, 0 when there is no error */
+    char errstr[128]; /* String representation of error when applicable */
+
+    redisShardNode *nodes;
+    int len;
+
+    redisShardPoint *ring;
+    int points;
+
+    redisShardHashFn *hash;
+    int hashtags; /* Only hash the part between '{' and '}' when set */
+} redisShardContext;
+
+uint32_t redisShardDefaultHash(const char *key, size_t len);
+
+/* Creates an async context for every node and builds the ring. The contexts
+ * still need to be attached to an event library, e.g.:
+ *
+ *   for (j = 0; j < sc->len; j++)
+ *       if (sc->nodes[j].ac != NULL)
+ *           redisLibeventAttach(sc->nodes[j].ac,base);
+ *
+ * The shard context owns these contexts and uses their data, onConnect and
+ * onDisconnect fields, which must be left alone. A context that fails to
+ * connect or disconnects is free'd as usual and its node is left with a NULL
+ * context: commands routed to it fail until redisShardReconnect(). */
+redisShardContext *redisShardInit(const char **hostnames, const int *ports, int len);
+int redisShardSetHashFunction(redisShardContext *sc, redisShardHashFn *fn);
+void redisShardSetHashTags(redisShardContext *sc, int enabled);
+
+/* Creates a new context for a node that lost its context, to be attached like
+ * the ones created by redisShardInit(). Returns REDIS_ERR when the node still
+ * has a context, and with sc->errstr set when connecting failed right away. */
+int redisShardReconnect(redisShardContext *sc, int node);
+void redisShardDisconnect(redisShardContext *sc);
+void redisShardFree(redisShardContext *sc);
+
+/* Returns the index of the node / the context that owns the given key. */
+int redisShardGetNode(redisShardContext *sc, const char *key, size_t len);
+redisAsyncContext *redisShardGetContext(redisShardContext *sc, const char *key, size_t len);
+
+/* Route a command by its first key. MGET, MSET, DEL, UNLINK, EXISTS and TOUCH
+ * are split per node, pipelined on every node involved and the replies are
+ * merged back in the original key order before the callback is called.
+ * When a node replies with an error, or with a reply that doesn't fit the
+ * command, the callback gets that error instead. Merging requires the default
+ * reply object functions. */
+int redisShardAsyncCommand(redisShardContext *sc, redisCallbackFn *fn, void *privdata, const char *format, ...);
+int redisvShardAsyncCommand(redisShardContext *sc, redisCallbackFn *fn, void *privdata, const char *format, va_list ap);
+int redisShardAsyncCommandArgv(redisShardContext *sc, redisCallbackFn *fn, void *privdata, int argc, const char **argv, const size_t *argvlen);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
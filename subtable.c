@@ -0,0 +1,281 @@
+#include "fmacros.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "subtable.h"
+
+/* ----------------------------- hash function ------------------------------ */
+
+static uint64_t subTableMix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/* Consumes the key 8 bytes at a time. The seed differs for every table, so
+ * names that collide in one table don't collide in the next. */
+static uint32_t subTableHash(const subTable *t, const char *key, size_t len) {
+    uint64_t h = t->seed ^ (len * 0x9e3779b97f4a7c15ULL), w;
+    uint32_t hash;
+
+    while (len >= 8) {
+        memcpy(&w,key,8);
+        h ^= w * 0x87c37b91114253d5ULL;
+        h = ((h << 27) | (h >> 37)) * 0x4cf5ad432745937fULL;
+        key += 8;
+        len -= 8;
+    }
+    if (len > 0) {
+        w = 0;
+        memcpy(&w,key,len);
+        h ^= w * 0x87c37b91114253d5ULL;
+    }
+    hash = (uint32_t)subTableMix(h);
+    return hash > SUBTABLE_DELETED ? hash : hash+2;
+}
+
+/* ---------------------------- single tables ------------------------------- */
+
+static const char *subEntryKey(const subEntry *e) {
+    return e->len > SUBTABLE_INLINE_KEY ? e->key.ptr : e->key.inl;
+}
+
+static subEntry *subTableHtFind(subTableHt *ht, uint32_t hash, const char *key, size_t len) {
+    unsigned long mask = ht->size-1, i;
+    subEntry *e;
+
+    if (ht->size == 0)
+        return NULL;
+    for (i = hash & mask; ; i = (i+1) & mask) {
+        e = &ht->slots[i];
+        if (e->hash == SUBTABLE_EMPTY)
+            return NULL;
+        if (e->hash == hash && e->len == len && memcmp(subEntryKey(e),key,len) == 0)
+            return e;
+    }
+}
+
+/* First free slot on the probe sequence of the hash. Tables are never more
+ * than 3/4 full, counting deleted slots, so there always is one. */
+static subEntry *subTableHtFree(subTableHt *ht, uint32_t hash) {
+    unsigned long mask = ht->size-1, i;
+
+    for (i = hash & mask; ht->slots[i].hash > SUBTABLE_DELETED; i = (i+1) & mask);
+    return &ht->slots[i];
+}
+
+static void subTableHtRelease(subTableHt *ht) {
+    unsigned long i;
+
+    for (i = 0; i < ht->size; i++) {
+        if (ht->slots[i].hash > SUBTABLE_DELETED && ht->slots[i].len > SUBTABLE_INLINE_KEY)
+            free(ht->slots[i].key.ptr);
+    }
+    free(ht->slots);
+    memset(ht,0,sizeof(*ht));
+}
+
+/* -------------------------------- growing --------------------------------- */
+
+/* Moves up to n slots of the old table to the new one. Moved slots are
+ * marked deleted, so lookups of the keys further down the old table still
+ * find them. */
+static void subTableRehashStep(subTable *t, unsigned long n) {
+    subTableHt *from = &t->ht[0], *to = &t->ht[1];
+    subEntry *e, *slot;
+
+    while (t->rehashidx >= 0) {
+        if ((unsigned long)t->rehashidx == from->size) {
+            free(from->slots);
+            *from = *to;
+            memset(to,0,sizeof(*to));
+            t->rehashidx = -1;
+            break;
+        }
+        if (n-- == 0)
+            break;
+
+        e = &from->slots[t->rehashidx++];
+        if (e->hash > SUBTABLE_DELETED) {
+            slot = subTableHtFree(to,e->hash);
+            if (slot->hash == SUBTABLE_DELETED)
+                to->deleted--;
+            *slot = *e;
+            to->used++;
+            e->hash = SUBTABLE_DELETED;
+            from->used--;
+            from->deleted++;
+        }
+    }
+}
+
+/* Moves every key of a table to a fresh one and frees its slots. */
+static void subTableHtMove(subTableHt *from, subTableHt *to) {
+    unsigned long i;
+    subEntry *e;
+
+    for (i = 0; i < from->size; i++) {
+        e = &from->slots[i];
+        if (e->hash > SUBTABLE_DELETED) {
+            *subTableHtFree(to,e->hash) = *e;
+            to->used++;
+        }
+    }
+    free(from->slots);
+    memset(from,0,sizeof(*from));
+}
+
+/* Starts moving everything over to a table that is at most half full with
+ * the keys of both tables. */
+static int subTableExpand(subTable *t) {
+    unsigned long size = SUBTABLE_MIN_SIZE;
+    subTableHt fresh;
+
+    while (size < (t->ht[0].used+t->ht[1].used+1)*2)
+        size <<= 1;
+    if ((fresh.slots = calloc(size,sizeof(*fresh.slots))) == NULL)
+        return -1;
+    fresh.size = size;
+    fresh.used = 0;
+    fresh.deleted = 0;
+
+    /* The new table of a running round was sized for fewer keys, so both
+     * tables move to the fresh one at once. */
+    if (t->rehashidx >= 0) {
+        subTableHtMove(&t->ht[0],&fresh);
+        subTableHtMove(&t->ht[1],&fresh);
+        t->ht[0] = fresh;
+        t->rehashidx = -1;
+        return 0;
+    }
+
+    t->ht[1] = fresh;
+    t->rehashidx = 0;
+    if (t->ht[0].size == 0)
+        subTableRehashStep(t,0);
+    return 0;
+}
+
+/* ---------------------------------- API ----------------------------------- */
+
+static subTable *subTableCreate(void) {
+    subTable *t = calloc(1,sizeof(*t));
+
+    if (t == NULL)
+        return NULL;
+    t->rehashidx = -1;
+    t->seed = subTableMix((uint64_t)(uintptr_t)t ^ (uint64_t)time(NULL) ^
+                          ((uint64_t)getpid() << 32));
+    return t;
+}
+
+static subEntry *subTableLookup(subTable *t, uint32_t hash, const char *key, size_t len) {
+    subEntry *e = subTableHtFind(&t->ht[0],hash,key,len);
+
+    if (e == NULL && t->rehashidx >= 0)
+        e = subTableHtFind(&t->ht[1],hash,key,len);
+    return e;
+}
+
+/* Adds the key with a copy of the callback, or replaces the callback of the
+ * key. Returns 1 when added, 0 when replaced and -1 when out of memory. */
+static int subTableReplace(subTable *t, const char *key, size_t len, const redisCallback *cb) {
+    uint32_t hash = subTableHash(t,key,len);
+    unsigned long pending;
+    subTableHt *ht;
+    subEntry *e;
+    char *copy = NULL;
+
+    if (t->rehashidx >= 0)
+        subTableRehashStep(t,SUBTABLE_REHASH_STEP);
+    if ((e = subTableLookup(t,hash,key,len)) != NULL) {
+        e->cb = *cb;
+        return 0;
+    }
+
+    /* New keys go to the new table while growing, where the keys left in
+     * the old table end up as well. */
+    ht = &t->ht[t->rehashidx >= 0];
+    pending = t->rehashidx >= 0 ? t->ht[0].used : 0;
+    if ((ht->used+ht->deleted+pending+1)*4 > ht->size*3) {
+        if (subTableExpand(t) != 0)
+            return -1;
+        ht = &t->ht[t->rehashidx >= 0];
+    }
+    if (len > SUBTABLE_INLINE_KEY && (copy = malloc(len)) == NULL)
+        return -1;
+
+    e = subTableHtFree(ht,hash);
+    if (e->hash == SUBTABLE_DELETED)
+        ht->deleted--;
+    e->hash = hash;
+    e->len = len;
+    if (copy != NULL) {
+        memcpy(copy,key,len);
+        e->key.ptr = copy;
+    } else {
+        memcpy(e->key.inl,key,len);
+    }
+    e->cb = *cb;
+    ht->used++;
+    return 1;
+}
+
+/* The callback stays valid until the table is changed. */
+static redisCallback *subTableFind(subTable *t, const char *key, size_t len) {
+    subEntry *e;
+
+    if (t->rehashidx >= 0)
+        subTableRehashStep(t,SUBTABLE_REHASH_STEP);
+    e = subTableLookup(t,subTableHash(t,key,len),key,len);
+    return e ? &e->cb : NULL;
+}
+
+/* Returns 1 when the key was found and deleted. */
+static int subTableDelete(subTable *t, const char *key, size_t len) {
+    uint32_t hash = subTableHash(t,key,len);
+    subEntry *e;
+    int j;
+
+    if (t->rehashidx >= 0)
+        subTableRehashStep(t,SUBTABLE_REHASH_STEP);
+    for (j = 0; j <= (t->rehashidx >= 0); j++) {
+        if ((e = subTableHtFind(&t->ht[j],hash,key,len)) == NULL)
+            continue;
+        if (e->len > SUBTABLE_INLINE_KEY)
+            free(e->key.ptr);
+        e->hash = SUBTABLE_DELETED;
+        t->ht[j].used--;
+        t->ht[j].deleted++;
+        return 1;
+    }
+    return 0;
+}
+
+/* Iterates the callbacks, starting with *pos set to 0, until NULL is
+ * returned. The table must not change in between. */
+static redisCallback *subTableNext(subTable *t, unsigned long *pos) {
+    subTableHt *ht;
+    unsigned long i;
+
+    while ((i = (*pos)++) < t->ht[0].size+t->ht[1].size) {
+        ht = &t->ht[0];
+        if (i >= ht->size) {
+            i -= ht->size;
+            ht = &t->ht[1];
+        }
+        if (ht->slots[i].hash > SUBTABLE_DELETED)
+            return &ht->slots[i].cb;
+    }
+    return NULL;
+}
+
+static void subTableRelease(subTable *t) {
+    subTableHtRelease(&t->ht[0]);
+    subTableHtRelease(&t->ht[1]);
+    free(t);
+}
@@ -0,0 +1,56 @@
+/* Open addressing hash table for the pub/sub callbacks of async contexts,
+ * keyed by channel or pattern name. Slots keep the hash of their key and
+ * short keys inline, so lookups mostly stay within one cache line per probe.
+ * Growing moves a few slots over to the new table on every operation
+ * instead of all of them at once. */
+
+#ifndef __SUBTABLE_H
+#define __SUBTABLE_H
+
+#include <stdint.h>
+
+/* Keys up to this length are stored in the slot */
+#define SUBTABLE_INLINE_KEY 24
+
+/* Size of the first table, a power of two */
+#define SUBTABLE_MIN_SIZE 8
+
+/* Slots of the old table moved by every operation while growing */
+#define SUBTABLE_REHASH_STEP 32
+
+/* Hash values marking free slots; key hashes are never below 2. A deleted
+ * slot still continues the probe sequences running through it. */
+#define SUBTABLE_EMPTY 0
+#define SUBTABLE_DELETED 1
+
+typedef struct subEntry {
+    uint32_t hash;
+    uint32_t len;
+    union {
+        char inl[SUBTABLE_INLINE_KEY];
+        char *ptr;
+    } key;
+    redisCallback cb;
+} subEntry;
+
+typedef struct subTableHt {
+    subEntry *slots;
+    unsigned long size; /* a power of two, or 0 */
+    unsigned long used;
+    unsigned long deleted;
+} subTableHt;
+
+typedef struct subTable {
+    subTableHt ht[2]; /* ht[1] is only used while growing */
+    long rehashidx; /* next slot of ht[0] to move, -1 when not growing */
+    uint64_t seed;
+} subTable;
+
+static subTable *subTableCreate(void);
+static int subTableReplace(subTable *t, const char *key, size_t len, const redisCallback *cb);
+static redisCallback *subTableFind(subTable *t, const char *key, size_t len);
+static int subTableDelete(subTable *t, const char *key, size_t len);
+static redisCallback *subTableNext(subTable *t, unsigned long *pos);
+static void subTableRelease(subTable *t);
+
+#endif /* __SUBTABLE_H */
@@ -0,0 +1,129 @@
+/* Tests for adapters/coroutine.h, which needs a C++20 compiler. The test
+ * plays the server over loopback and drives the context by hand. */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "hiredis.h"
+#include "async.h"
+#include "adapters/coroutine.h"
+
+static int tests = 0, fails = 0;
+#define test(_s) { printf("#%02d ", ++tests); printf(_s); }
+#define test_cond(_c) if(_c) printf("\033[0;32mPASSED\033[0;0m\n"); else {printf("\033[0;31mFAILED\033[0;0m\n"); fails++;}
+
+/* The assert() calls below have side effects, so we need assert()
+ * even if we are compiling without asserts (-DNDEBUG). */
+#ifdef NDEBUG
+#undef assert
+#define assert(e) (void)(e)
+#endif
+
+static redisAsyncContext *async_pair(int *srv) {
+    struct sockaddr_in sa;
+    socklen_t len = sizeof(sa);
+    redisAsyncContext *ac;
+    int fd = socket(AF_INET,SOCK_STREAM,0);
+
+    memset(&sa,0,sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    assert(fd != -1 && bind(fd,(struct sockaddr*)&sa,sizeof(sa)) == 0);
+    assert(listen(fd,1) == 0 && getsockname(fd,(struct sockaddr*)&sa,&len) == 0);
+
+    ac = redisAsyncConnect("127.0.0.1",ntohs(sa.sin_port));
+    assert(ac != NULL && ac->err == 0);
+    assert((*srv = accept(fd,NULL,NULL)) != -1);
+    close(fd);
+    redisAsyncHandleWrite(ac);
+    return ac;
+}
+
+/* What a task saw, checked once it stopped. */
+struct seen {
+    int step;
+    int refused;
+    char str[32];
+};
+
+static RedisTask get_twice(RedisCoroutineContext redis, seen *s) {
+    redisReply *reply;
+
+    reply = co_await redis.command("GET %s", "key");
+    if (reply == NULL) co_return;
+    snprintf(s->str,sizeof(s->str),"%s",reply->str);
+    s->step++;
+
+    const char *argv[2] = { "GET", "other" };
+    reply = co_await redis.commandArgv(2,argv);
+    if (reply == NULL) co_return;
+    s->str[0] = '\0';
+    strncat(s->str,reply->str,sizeof(s->str)-1);
+    s->step++;
+}
+
+static RedisTask refused(RedisCoroutineContext redis, seen *s) {
+    const char *argv[2] = { "psubscribe", "news.*" };
+
+    s->refused += co_await redis.command("SUBSCRIBE %s", "news") == NULL;
+    s->refused += co_await redis.command("punsubscribe") == NULL;
+    s->refused += co_await redis.command("MONITOR") == NULL;
+    s->refused += co_await redis.commandArgv(2,argv) == NULL;
+    s->step++;
+}
+
+static RedisTask pending(RedisCoroutineContext redis, seen *s) {
+    redisReply *reply = co_await redis.command("GET key");
+    s->refused += reply == NULL;
+    s->step++;
+}
+
+static void reply(redisAsyncContext *ac, int srv, const char *str) {
+    assert(write(srv,str,strlen(str)) == (ssize_t)strlen(str));
+    redisAsyncHandleRead(ac);
+}
+
+int main(void) {
+    redisAsyncContext *ac;
+    seen s;
+    int srv;
+
+    ac = async_pair(&srv);
+
+    test("Coroutines resume with the reply to every command they await: ");
+    memset(&s,0,sizeof(s));
+    get_twice(RedisCoroutineContext(ac),&s);
+    assert(s.step == 0);
+    redisAsyncHandleWrite(ac);
+    reply(ac,srv,"$5\r\nfirst\r\n");
+    assert(s.step == 1 && strcmp(s.str,"first") == 0);
+    redisAsyncHandleWrite(ac);
+    reply(ac,srv,"$6\r\nsecond\r\n");
+    test_cond(s.step == 2 && strcmp(s.str,"second") == 0);
+
+    test("Coroutines refuse subscriptions and MONITOR without suspending: ");
+    memset(&s,0,sizeof(s));
+    refused(RedisCoroutineContext(ac),&s);
+    test_cond(s.step == 1 && s.refused == 4 && sdslen(ac->c.obuf) == 0 &&
+              !(ac->c.flags & (REDIS_SUBSCRIBED | REDIS_MONITORING)));
+
+    test("Coroutines resume with a NULL reply when the context is free'd: ");
+    memset(&s,0,sizeof(s));
+    pending(RedisCoroutineContext(ac),&s);
+    assert(s.step == 0);
+    redisAsyncFree(ac);
+    test_cond(s.step == 1 && s.refused == 1);
+    close(srv);
+
+    if (fails) {
+        printf("*** %d TESTS FAILED ***\n", fails);
+        return 1;
+    }
+    printf("ALL TESTS PASSED\n");
+    return 0;
+}
@@ -9,9 +9,29 @@
 #include <signal.h>
 #include <errno.h>
 #include <limits.h>
+#include <poll.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <pthread.h>
+#ifdef USE_SSL
+#include <openssl/x509.h>
+#endif
 
 #include "hiredis.h"
 #include "net.h"
+#include "shard.h"
+#include "cluster.h"
+#include "sentinel.h"
+#include "subtable.c"
+#ifdef USE_SSL
+#include "tls.h"
+#endif
+#ifdef __linux__
+#include "adapters/epoll.h"
+#endif
 
 enum connection_type {
     CONN_TCP,
@@ -91,7 +111,7 @@ static int disconnect(redisContext *c, int keep_fd) {
     return -1;
 }
 
-static redisContext *connect(struct config config) {
+static redisContext *do_connect(struct config config) {
     redisContext *c = NULL;
 
     if (config.type == CONN_TCP) {
@@ -248,7 +268,7 @@ static void test_append_formatted_commands(struct config config) {
     char *cmd;
     int len;
 
-    c = connect(config);
+    c = do_connect(config);
 
     test("Append format command: ");
 
@@ -341,6 +361,22 @@ static void test_reply_reader(void) {
         ((redisReply*)reply)->elements == 0);
     freeReplyObject(reply);
     redisReaderFree(reader);
+
+    test("Reader counts replies and the objects built for them: ");
+    {
+        redisStats stats;
+
+        memset(&stats,0,sizeof(stats));
+        reader = redisReaderCreate();
+        reader->stats = &stats;
+        redisReaderFeed(reader,(char*)"*2\r\n$3\r\nfoo\r\n:1\r\n+OK\r\n",23);
+        ret = redisReaderGetReply(reader,&reply);
+        assert(ret == REDIS_OK && reply != NULL);
+        freeReplyObject(reply);
+        test_cond(stats.replies == 1 && stats.reply_objects == 3 &&
+            stats.reply_allocs == 5 && stats.reader_buf_peak == 23);
+        redisReaderFree(reader);
+    }
 }
 
 static void test_free_null(void) {
@@ -356,6 +392,1774 @@ static void test_free_null(void) {
     test_cond(reply == NULL);
 }
 
+static void test_shard_routing(void) {
+    const char *hosts[] = { "127.0.0.1", "127.0.0.1", "127.0.0.1", "127.0.0.1" };
+    const int ports[] = { 1, 2, 3, 4 };
+    redisShardContext *sc;
+    int counts[4] = { 0 };
+    char key[32];
+    int j, len, node;
+
+    sc = redisShardInit(hosts,ports,4);
+    assert(sc != NULL);
+
+    test("Shard ring routes keys with the same hash tag to the same node: ");
+    node = redisShardGetNode(sc,"{user:1}.name",13);
+    test_cond(redisShardGetNode(sc,"{user:1}.email",14) == node &&
+              redisShardGetNode(sc,"user:1",6) == node);
+
+    test("Shard ring hashes the whole key for empty hash tags: ");
+    node = redisShardGetNode(sc,"{}foo",5);
+    redisShardSetHashTags(sc,0);
+    test_cond(redisShardGetNode(sc,"{}foo",5) == node);
+    redisShardSetHashTags(sc,1);
+
+    test("Shard ring spreads keys over all nodes: ");
+    for (j = 0; j < 10000; j++) {
+        len = snprintf(key,sizeof(key),"key:%d",j);
+        counts[redisShardGetNode(sc,key,len)]++;
+    }
+    test_cond(counts[0] > 1500 && counts[1] > 1500 && counts[2] > 1500 && counts[3] > 1500);
+
+    redisShardFree(sc);
+}
+
+static void test_cluster_slots(void) {
+    test("Cluster key slots match the CRC16 used by Redis Cluster: ");
+    test_cond(redisClusterKeySlot("123456789",9) == (0x31c3 & 16383) &&
+              redisClusterKeySlot("foo",3) == 12182 &&
+              redisClusterKeySlot("",0) == 0);
+
+    test("Cluster key slots only hash non-empty hash tags: ");
+    test_cond(redisClusterKeySlot("{user1000}.following",20) == redisClusterKeySlot("user1000",8) &&
+              redisClusterKeySlot("{user1000}.followers",20) == redisClusterKeySlot("user1000",8) &&
+              redisClusterKeySlot("{}foo",5) != redisClusterKeySlot("foo",3) &&
+              redisClusterKeySlot("foo{}{bar}",10) != redisClusterKeySlot("bar",3));
+}
+
+/* Bit by bit CRC16, to check the table driven one against. */
+static uint16_t crc16_reference(const char *buf, size_t len) {
+    uint16_t crc = 0;
+    size_t j;
+    int k;
+
+    for (j = 0; j < len; j++) {
+        crc ^= (unsigned char)buf[j] << 8;
+        for (k = 0; k < 8; k++)
+            crc = crc & 0x8000 ? (crc<<1) ^ 0x1021 : crc<<1;
+    }
+    return crc;
+}
+
+static void test_cluster_partition(void) {
+    const char *hosts[] = { "127.0.0.1", "127.0.0.1" };
+    const int ports[] = { 1, 2 };
+    const char *cmd1[] = { "SET", "foo", "1" }, *cmd2[] = { "SET", "bar", "2" };
+    const char *cmd3[] = { "GET", "foo" }, *cmd4[] = { "PING" };
+    const char **argv[] = { cmd1, cmd2, cmd3, cmd4 };
+    const int argc[] = { 3, 3, 2, 1 };
+    const char *keys[64];
+    size_t lens[64];
+    uint16_t slots[64];
+    redisClusterContext *cc;
+    redisClusterPartition *part;
+    redisClusterPipeline *p0, *p1;
+    char buf[64], *cmd;
+    int j, ok, len;
+
+    test("Cluster key slots hash keys of every length like a bitwise CRC16: ");
+    for (j = 0; j < (int)sizeof(buf); j++)
+        buf[j] = (char)(j*37+11);
+    ok = 1;
+    for (j = 0; j <= (int)sizeof(buf); j++)
+        ok &= redisClusterKeySlot(buf,j) == (crc16_reference(buf,j) & 16383);
+    test_cond(ok);
+
+    test("Cluster key slots can be computed in batches: ");
+    for (j = 0; j < 64; j++) {
+        keys[j] = buf+j/2;
+        lens[j] = j/2;
+    }
+    redisClusterKeySlots(keys,lens,64,slots);
+    ok = 1;
+    for (j = 0; j < 64; j++)
+        ok &= slots[j] == redisClusterKeySlot(keys[j],lens[j]);
+    test_cond(ok);
+
+    cc = redisClusterInit(hosts,ports,2);
+    assert(cc != NULL);
+    for (j = 0; j < REDIS_CLUSTER_SLOTS; j++)
+        cc->slots[j] = cc->nodes[j < 8192 ? 0 : 1];
+
+    test("Cluster partitions commands per node in their original order: ");
+    part = redisClusterPartitionArgv(cc,4,argc,argv,NULL);
+    assert(part != NULL && part->len == 2);
+    p1 = part->pipelines[0].node == cc->nodes[1] ? &part->pipelines[0] : &part->pipelines[1];
+    p0 = p1 == &part->pipelines[0] ? &part->pipelines[1] : &part->pipelines[0];
+    len = redisFormatCommand(&cmd,"SET foo 1");
+    ok = p1->len == 2 && p1->index[0] == 0 && p1->index[1] == 2 &&
+         p0->len == 2 && p0->index[0] == 1 && p0->index[1] == 3 &&
+         sdslen(p1->cmds) > (size_t)len && memcmp(p1->cmds,cmd,len) == 0;
+    free(cmd);
+    len = redisFormatCommand(&cmd,"GET foo");
+    ok &= memcmp(p1->cmds+sdslen(p1->cmds)-len,cmd,len) == 0;
+    free(cmd);
+    test_cond(ok);
+
+    redisClusterFreePartition(part);
+    redisClusterFree(cc);
+}
+
+static int subscription_name(char *buf, size_t len, int j) {
+    return snprintf(buf,len,j % 2 ? "channel:%d" : "a-much-longer-channel-name:%d",j);
+}
+
+static void test_subscription_table(void) {
+    subTable *t = subTableCreate();
+    redisCallback cb = {0}, *found;
+    unsigned long pos = 0;
+    char key[64];
+    int j, len, ok = 1, n = 0;
+
+    /* Short names are stored inline, long ones are not. */
+    test("Subscription table finds every key while growing: ");
+    for (j = 0; j < 20000; j++) {
+        len = subscription_name(key,sizeof(key),j);
+        cb.privdata = (void*)(long)j;
+        ok &= subTableReplace(t,key,len,&cb) == 1;
+        len = subscription_name(key,sizeof(key),j/2);
+        found = subTableFind(t,key,len);
+        ok &= found != NULL && found->privdata == (void*)(long)(j/2);
+    }
+    test_cond(ok);
+
+    test("Subscription table deletes and replaces keys: ");
+    for (j = 0; j < 20000; j += 2) {
+        len = subscription_name(key,sizeof(key),j);
+        ok &= subTableDelete(t,key,len) == 1 && subTableDelete(t,key,len) == 0;
+    }
+    cb.privdata = NULL;
+    ok &= subTableReplace(t,"channel:1",9,&cb) == 0;
+    while ((found = subTableNext(t,&pos)) != NULL)
+        n++;
+    found = subTableFind(t,"channel:1",9);
+    test_cond(ok && n == 10000 && found != NULL && found->privdata == NULL &&
+        subTableFind(t,"a-much-longer-channel-name:0",28) == NULL);
+    subTableRelease(t);
+
+    /* A few keys left in a large table make the next round grow into a
+     * small one, which then fills up before the round is done. */
+    test("Subscription table keeps working when it fills up while growing: ");
+    t = subTableCreate();
+    ok = 1;
+    for (j = 0; j < 5000; j++) {
+        len = subscription_name(key,sizeof(key),j);
+        subTableReplace(t,key,len,&cb);
+    }
+    for (j = 10; j < 5000; j++) {
+        len = subscription_name(key,sizeof(key),j);
+        subTableDelete(t,key,len);
+    }
+    for (j = 5000; t->rehashidx == -1; j++) {
+        len = subscription_name(key,sizeof(key),j);
+        subTableReplace(t,key,len,&cb);
+        ok &= subTableDelete(t,key,len) == 1;
+    }
+    for (n = j; j < n+200; j++) {
+        len = subscription_name(key,sizeof(key),j);
+        ok &= subTableReplace(t,key,len,&cb) == 1;
+        len = subscription_name(key,sizeof(key),j-100);
+        if (j-100 >= n) ok &= subTableDelete(t,key,len) == 1;
+        ok &= subTableFind(t,"missing",7) == NULL;
+    }
+    for (n = 0, pos = 0; subTableNext(t,&pos) != NULL; n++);
+    test_cond(ok && n == 110 && subTableFind(t,"channel:1",9) != NULL);
+    subTableRelease(t);
+}
+
+static void resolve_cb(const char *host, int port, int status, void *privdata) {
+    int *fds = privdata;
+    ((void)host); ((void)port);
+    assert(write(fds[1],&status,sizeof(status)) == sizeof(status));
+}
+
+static void test_resolve_cache(void) {
+    int fds[2], status = REDIS_ERR;
+    struct pollfd pfd;
+
+    test("Prefetching an address fails while the resolver cache is disabled: ");
+    test_cond(redisResolvePrefetch("localhost",6379,NULL,NULL) == REDIS_ERR);
+
+    test("Prefetched addresses are resolved by the resolver thread: ");
+    assert(pipe(fds) == 0);
+    redisSetResolveCacheTtl(60000);
+    assert(redisResolvePrefetch("localhost",6379,resolve_cb,fds) == REDIS_OK);
+    pfd.fd = fds[0];
+    pfd.events = POLLIN;
+    if (poll(&pfd,1,5000) == 1)
+        assert(read(fds[0],&status,sizeof(status)) == sizeof(status));
+    test_cond(status == REDIS_OK);
+
+    redisSetResolveCacheTtl(0);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+/* Listening socket on a free port of the loopback interface. Connects
+ * succeed, but nothing is answered until the test accepts them. */
+static int listen_loopback(int *port) {
+    struct sockaddr_in sa;
+    socklen_t len = sizeof(sa);
+    int fd = socket(AF_INET,SOCK_STREAM,0);
+
+    memset(&sa,0,sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    assert(fd != -1 && bind(fd,(struct sockaddr*)&sa,sizeof(sa)) == 0);
+    assert(listen(fd,16) == 0 && getsockname(fd,(struct sockaddr*)&sa,&len) == 0);
+    *port = ntohs(sa.sin_port);
+    return fd;
+}
+
+/* Contexts are driven by hand in the tests, without an event library. */
+static int attach_none(redisAsyncContext *ac, void *privdata) {
+    ((void)ac); ((void)privdata);
+    return REDIS_OK;
+}
+
+static void discovered(redisSentinelContext *sc, redisAsyncContext *ac, int status) {
+    int *calls = sc->attach_privdata;
+    ((void)ac); ((void)status);
+    (*calls)++;
+}
+
+static void test_sentinel_discovery(void) {
+    const char *hosts[1] = { "127.0.0.1" };
+    redisSentinelContext *sc;
+    int port, fd = listen_loopback(&port), calls = 0;
+
+    sc = redisSentinelInit("mymaster",hosts,&port,1);
+    redisSentinelSetAttach(sc,attach_none,&calls);
+    sc->timeout->tv_usec = 50000;
+
+    test("Resolving sentinel groups asynchronously needs a callback: ");
+    test_cond(redisSentinelAsyncResolveGroups(sc,NULL) == REDIS_ERR && sc->resolve == NULL);
+
+    test("Sentinel discovery waits for the sentinels within the timeout: ");
+    assert(redisSentinelAsyncDiscover(sc,discovered) == REDIS_OK);
+    redisSentinelCheckTimeouts(sc);
+    test_cond(calls == 0 && sc->discovery != NULL);
+
+    test("Sentinel discovery fails once the sentinels didn't answer in time: ");
+    usleep(60000);
+    redisSentinelCheckTimeouts(sc);
+    test_cond(calls == 1 && sc->discovery == NULL && sc->err &&
+              strstr(sc->errstr,"Timed out") != NULL && sc->sentinels[0].failures == 1);
+
+    redisSentinelFree(sc);
+    close(fd);
+}
+
+/* Subscribes with the given health of three sentinels and returns the one
+ * that was connected to first. */
+static int sentinel_picked(int *fds, int *ports, const long long *rtt,
+                           const int *failures, const long long *retry_after) {
+    const char *hosts[3] = { "127.0.0.1", "127.0.0.1", "127.0.0.1" };
+    redisSentinelContext *sc;
+    struct pollfd pfd[3];
+    int j, picked = -1;
+
+    sc = redisSentinelInit("mymaster",hosts,ports,3);
+    redisSentinelSetAttach(sc,attach_none,NULL);
+    for (j = 0; j < 3; j++) {
+        sc->sentinels[j].rtt = rtt[j];
+        sc->sentinels[j].failures = failures[j];
+        sc->sentinels[j].retry_after = retry_after[j];
+        pfd[j].fd = fds[j];
+        pfd[j].events = POLLIN;
+    }
+    assert(redisSentinelAsyncWatch(sc,NULL) == REDIS_OK);
+    assert(poll(pfd,3,1000) == 1);
+    for (j = 0; j < 3; j++) {
+        if (pfd[j].revents & POLLIN) {
+            close(accept(fds[j],NULL,NULL));
+            picked = j;
+        }
+    }
+    redisSentinelFree(sc);
+    return picked;
+}
+
+static void test_sentinel_order(void) {
+    const long long none[3] = { 0, 0, 0 }, rtt[3] = { 5000, 1000, 3000 };
+    const long long later[3] = { 0, LLONG_MAX/2, 0 };
+    const long long all_later[3] = { LLONG_MAX/2, LLONG_MAX/2-1, LLONG_MAX/2-2 };
+    const int healthy[3] = { 0, 0, 0 }, failing[3] = { 0, 9, 0 };
+    int fds[3], ports[3], j;
+
+    for (j = 0; j < 3; j++)
+        fds[j] = listen_loopback(&ports[j]);
+
+    test("Sentinels that are equally good are tried in configured order: ");
+    test_cond(sentinel_picked(fds,ports,none,healthy,none) == 0);
+
+    test("Sentinels with a shorter round trip time are tried first: ");
+    test_cond(sentinel_picked(fds,ports,rtt,healthy,none) == 1);
+
+    test("Sentinels that failed in a row are tried later: ");
+    test_cond(sentinel_picked(fds,ports,rtt,failing,none) == 2);
+
+    test("Sentinels in backoff are only tried after all others: ");
+    test_cond(sentinel_picked(fds,ports,rtt,healthy,later) == 2);
+
+    test("Sentinels all in backoff are tried in the order their backoff ends: ");
+    test_cond(sentinel_picked(fds,ports,rtt,healthy,all_later) == 2);
+
+    for (j = 0; j < 3; j++)
+        close(fds[j]);
+}
+
+static void test_sentinel_watch(void) {
+    const char *hosts[1] = { "127.0.0.1" };
+    redisSentinelContext *sc;
+    int port, fd = listen_loopback(&port), calls = 0;
+
+    sc = redisSentinelInit("mymaster",hosts,&port,1);
+    redisSentinelSetAttach(sc,attach_none,&calls);
+
+    test("Losing every sentinel of the failover subscription is reported: ");
+    assert(redisSentinelAsyncWatch(sc,discovered) == REDIS_OK);
+    close(accept(fd,NULL,NULL));
+    redisAsyncHandleWrite(sc->watch);
+    if (sc->watch != NULL)
+        redisAsyncHandleRead(sc->watch);
+    test_cond(calls == 1 && sc->watch == NULL && sc->err &&
+              sc->sentinels[0].failures == 1 && sc->watch_retry > 0);
+
+    test("The failover subscription is set up again after the backoff: ");
+    redisSentinelCheckTimeouts(sc);
+    assert(sc->watch == NULL);
+    usleep(110000);
+    redisSentinelCheckTimeouts(sc);
+    test_cond(sc->watch != NULL && sc->watch_retry == 0 && calls == 1);
+
+    redisSentinelFree(sc);
+    close(fd);
+}
+
+/* Async context connected to a loopback listener. The test plays the
+ * server on *srv, and drives the context by hand. */
+static redisAsyncContext *async_pair(int *srv) {
+    redisAsyncContext *ac;
+    int port, fd = listen_loopback(&port);
+
+    ac = redisAsyncConnect("127.0.0.1",port);
+    assert(ac != NULL && ac->err == 0);
+    assert((*srv = accept(fd,NULL,NULL)) != -1);
+    close(fd);
+    redisAsyncHandleWrite(ac);
+    assert(ac->c.flags & REDIS_CONNECTED);
+    return ac;
+}
+
+/* Sends the replies and handles them. */
+static void async_reply(redisAsyncContext *ac, int srv, const char *replies) {
+    assert(write(srv,replies,strlen(replies)) == (ssize_t)strlen(replies));
+    redisAsyncHandleRead(ac);
+}
+
+static void count_reply(redisAsyncContext *ac, void *r, void *privdata) {
+    ((void)ac); ((void)r);
+    (*(int*)privdata)++;
+}
+
+static void flow_changed(redisAsyncContext *ac, int full, void *privdata) {
+    ((void)ac);
+    *(int*)privdata = full ? 1 : 2;
+}
+
+/* Keeps the contexts created by the sentinel layer, so the test can play
+ * the event loop. */
+struct attached {
+    redisAsyncContext *acs[8];
+    int len;
+};
+
+static int attach_keep(redisAsyncContext *ac, void *privdata) {
+    struct attached *a = privdata;
+    assert(a->len < 8);
+    a->acs[a->len++] = ac;
+    return REDIS_OK;
+}
+
+static void test_sentinel_buffer(void) {
+    const char *hosts[1] = { "127.0.0.1" };
+    const char *ping = "*1\r\n$4\r\nPING\r\n", *echo = "*2\r\n$4\r\nECHO\r\n$1\r\na\r\n";
+    redisSentinelContext *sc;
+    struct attached att = { { NULL }, 0 };
+    int sport, mport, sfd = listen_loopback(&sport), mfd = listen_loopback(&mport);
+    int srv, failed = 0, replies = 0;
+    char addr[64];
+    sds obuf;
+
+    sc = redisSentinelInit("mymaster",hosts,&sport,1);
+    redisSentinelSetAttach(sc,attach_keep,&att);
+
+    test("Sentinel commands fail without a master when buffering is off: ");
+    test_cond(redisSentinelAsyncCommand(sc,count_reply,&failed,"PING") == REDIS_ERR);
+
+    test("Sentinel failover buffer holds commands up to its length: ");
+    redisSentinelSetFailoverBuffer(sc,2,0,50000);
+    assert(redisSentinelAsyncCommand(sc,count_reply,&failed,"PING") == REDIS_OK);
+    assert(redisSentinelAsyncCommand(sc,count_reply,&failed,"PING") == REDIS_OK);
+    test_cond(redisSentinelAsyncCommand(sc,count_reply,&failed,"PING") == REDIS_ERR &&
+              sc->buffer_len == 2 && failed == 0);
+
+    test("Sentinel failover buffer fails commands once they are too old: ");
+    redisSentinelCheckTimeouts(sc);
+    assert(failed == 0);
+    usleep(60000);
+    redisSentinelCheckTimeouts(sc);
+    test_cond(failed == 2 && sc->buffer_len == 0 && sc->buffer_bytes == 0);
+
+    test("Sentinel failover buffer holds commands up to its size: ");
+    redisSentinelSetFailoverBuffer(sc,10,strlen(ping)+strlen(echo),0);
+    assert(redisSentinelAsyncCommand(sc,count_reply,&replies,"PING") == REDIS_OK);
+    assert(redisSentinelAsyncCommand(sc,count_reply,&replies,"ECHO a") == REDIS_OK);
+    test_cond(redisSentinelAsyncCommand(sc,count_reply,&failed,"PING") == REDIS_ERR &&
+              sc->buffer_len == 2 && failed == 2);
+
+    test("Sentinel failover buffer goes to the discovered master in order: ");
+    assert(redisSentinelAsyncDiscover(sc,NULL) == REDIS_OK && att.len == 1);
+    assert((srv = accept(sfd,NULL,NULL)) != -1);
+    redisAsyncHandleWrite(att.acs[0]);
+    snprintf(addr,sizeof(addr),"*2\r\n$9\r\n127.0.0.1\r\n$%d\r\n%d\r\n",
+             snprintf(NULL,0,"%d",mport),mport);
+    async_reply(att.acs[0],srv,addr);
+    close(srv);
+    assert(att.len == 2 && (srv = accept(mfd,NULL,NULL)) != -1);
+    redisAsyncHandleWrite(att.acs[1]);
+    async_reply(att.acs[1],srv,"*3\r\n$6\r\nmaster\r\n:0\r\n*0\r\n");
+    obuf = sdscatfmt(sdsempty(),"%s%s",ping,echo);
+    test_cond(sc->ac == att.acs[1] && sc->buffer_len == 0 &&
+              strcmp(sc->ac->c.obuf,obuf) == 0);
+    sdsfree(obuf);
+
+    test("Sentinel commands go straight to a usable master: ");
+    redisAsyncHandleWrite(sc->ac);
+    assert(redisSentinelAsyncCommand(sc,count_reply,&replies,"PING") == REDIS_OK);
+    async_reply(sc->ac,srv,"+PONG\r\n$1\r\na\r\n+PONG\r\n");
+    test_cond(replies == 3 && sc->buffer_len == 0);
+
+    /* The master connection belongs to the caller */
+    redisSentinelFree(sc);
+    redisAsyncFree(att.acs[1]);
+    close(srv);
+    close(sfd);
+    close(mfd);
+}
+
+/* Accepts the connection of ac and answers its first command. */
+static int serve_reply(redisAsyncContext *ac, int lfd, const char *reply) {
+    int srv = accept(lfd,NULL,NULL);
+
+    assert(srv != -1);
+    redisAsyncHandleWrite(ac);
+    async_reply(ac,srv,reply);
+    return srv;
+}
+
+/* Plays a server for blocking contexts: accepts a connection on every
+ * listener in turn and answers its first request, kept in got. */
+struct scripted {
+    int lfds[4];
+    const char *replies[4];
+    int conns[4];
+    char got[4][256];
+    int n;
+};
+
+static void *scripted_thread(void *arg) {
+    struct scripted *s = arg;
+    ssize_t len;
+    int j;
+
+    for (j = 0; j < s->n; j++) {
+        assert((s->conns[j] = accept(s->lfds[j],NULL,NULL)) != -1);
+        assert((len = read(s->conns[j],s->got[j],sizeof(s->got[j])-1)) > 0);
+        s->got[j][len] = '\0';
+        assert(write(s->conns[j],s->replies[j],strlen(s->replies[j])) ==
+               (ssize_t)strlen(s->replies[j]));
+    }
+    return NULL;
+}
+
+static void scripted_run(struct scripted *s, pthread_t *thread) {
+    assert(pthread_create(thread,NULL,scripted_thread,s) == 0);
+}
+
+static void scripted_close(struct scripted *s, pthread_t thread) {
+    int j;
+
+    pthread_join(thread,NULL);
+    for (j = 0; j < s->n; j++)
+        close(s->conns[j]);
+}
+
+static void test_sentinel_cached_master(void) {
+    const char *hosts[1] = { "127.0.0.1" };
+    const char *master = "*3\r\n$6\r\nmaster\r\n:0\r\n*0\r\n";
+    const char *replica = "*5\r\n$5\r\nslave\r\n$9\r\n127.0.0.1\r\n:1\r\n$9\r\nconnected\r\n:0\r\n";
+    redisSentinelContext *sc;
+    struct attached att = { { NULL }, 0 };
+    struct scripted script;
+    pthread_t thread;
+    redisContext *c;
+    int sport, mport, sfd = listen_loopback(&sport), mfd = listen_loopback(&mport), srv[3];
+    char addr[64];
+
+    sc = redisSentinelInit("mymaster",hosts,&sport,1);
+    redisSentinelSetAttach(sc,attach_keep,&att);
+    snprintf(addr,sizeof(addr),"*2\r\n$9\r\n127.0.0.1\r\n$%d\r\n%d\r\n",
+             snprintf(NULL,0,"%d",mport),mport);
+
+    test("Sentinel discovery remembers the master it connected to: ");
+    assert(redisSentinelAsyncDiscover(sc,NULL) == REDIS_OK);
+    close(serve_reply(att.acs[0],sfd,addr));
+    srv[0] = serve_reply(att.acs[1],mfd,master);
+    test_cond(sc->ac == att.acs[1] && sc->master_port == mport);
+
+    test("Sentinel discovery goes to the cached master first: ");
+    assert(redisSentinelAsyncDiscover(sc,NULL) == REDIS_OK);
+    assert(att.acs[2]->c.tcp.port == mport);
+    srv[1] = serve_reply(att.acs[2],mfd,master);
+    test_cond(sc->ac == att.acs[2] && att.len == 3);
+
+    test("Sentinel discovery asks the sentinels when the cached master isn't one: ");
+    assert(redisSentinelAsyncDiscover(sc,NULL) == REDIS_OK);
+    srv[2] = serve_reply(att.acs[3],mfd,replica);
+    test_cond(att.len == 5 && att.acs[4]->c.tcp.port == sport && sc->discovery != NULL);
+
+    redisSentinelFree(sc);
+    redisAsyncFree(att.acs[2]);
+
+    close(srv[0]);
+    close(srv[1]);
+    close(srv[2]);
+    close(sfd);
+    close(mfd);
+
+    sfd = listen_loopback(&sport);
+    mfd = listen_loopback(&mport);
+    snprintf(addr,sizeof(addr),"*2\r\n$9\r\n127.0.0.1\r\n$%d\r\n%d\r\n",
+             snprintf(NULL,0,"%d",mport),mport);
+    test("Sentinel connect only caches a master once ROLE confirmed it: ");
+    sc = redisSentinelInit("mymaster",hosts,&sport,1);
+    script.lfds[0] = sfd;
+    script.replies[0] = addr;
+    script.lfds[1] = mfd;
+    script.replies[1] = replica;
+    script.n = 2;
+    scripted_run(&script,&thread);
+    c = redisSentinelConnect(sc);
+    scripted_close(&script,thread);
+    test_cond(c->err && sc->master_port == 0);
+    free(c);
+    redisSentinelFree(sc);
+    close(sfd);
+    close(mfd);
+}
+
+static int group_changes[2];
+
+static void group_changed(redisSentinelContext *sc, int group) {
+    ((void)sc);
+    group_changes[group]++;
+}
+
+static void groups_resolved(redisSentinelContext *sc, int status) {
+    int *calls = sc->attach_privdata;
+    (*calls) += status == REDIS_OK ? 1 : 100;
+}
+
+static void test_sentinel_groups(void) {
+    const char *a = "*2\r\n$9\r\n127.0.0.1\r\n$4\r\n7000\r\n";
+    const char *b = "*2\r\n$9\r\n127.0.0.1\r\n$4\r\n7001\r\n";
+    const char *get = "*3\r\n$8\r\nSENTINEL\r\n$23\r\nget-master-addr-by-name\r\n$5\r\ncache\r\n";
+    const char *text = "cache 127.0.0.1 7001 127.0.0.1 7101";
+    const char *subscribed = "*3\r\n$9\r\nsubscribe\r\n$14\r\n+switch-master\r\n:1\r\n";
+    const char *hosts[2] = { "127.0.0.1", "127.0.0.1" };
+    int ports[2], fds[2], srv, calls = 0;
+    struct scripted script;
+    redisSentinelContext *sc;
+    pthread_t thread;
+    char both[128], message[128];
+
+    fds[0] = listen_loopback(&ports[0]);
+    fds[1] = listen_loopback(&ports[1]);
+    sc = redisSentinelInit("mymaster",hosts,ports,2);
+    redisSentinelSetAttach(sc,attach_none,&calls);
+    redisSentinelSetGroupCallback(sc,group_changed);
+    snprintf(both,sizeof(both),"%s%s",a,b);
+
+    test("Sentinel groups are added once by name after the cluster: ");
+    test_cond(redisSentinelAddGroup(sc,"cache") == 1 && redisSentinelAddGroup(sc,"cache") == -1 &&
+              redisSentinelGetGroup(sc,"mymaster") == 0 && redisSentinelGetGroup(sc,"cache") == 1 &&
+              sc->ngroups == 2 && sc->groups[1].port == 0);
+
+    test("Sentinel groups are resolved with one round trip to a sentinel: ");
+    memset(&script,0,sizeof(script));
+    script.lfds[0] = fds[0];
+    script.replies[0] = both;
+    script.n = 1;
+    scripted_run(&script,&thread);
+    assert(redisSentinelResolveGroups(sc) == REDIS_OK);
+    scripted_close(&script,thread);
+    test_cond(sc->groups[0].port == 7000 && sc->groups[1].port == 7001 &&
+              sc->master_port == 7000 && strstr(script.got[0],get) != NULL);
+
+    test("Sentinel groups left unresolved are asked from the next sentinel: ");
+    memset(&script,0,sizeof(script));
+    script.lfds[0] = fds[0];
+    script.replies[0] = "*2\r\n$9\r\n127.0.0.1\r\n$4\r\n7002\r\n*-1\r\n";
+    script.lfds[1] = fds[1];
+    script.replies[1] = b;
+    script.n = 2;
+    scripted_run(&script,&thread);
+    assert(redisSentinelResolveGroups(sc) == REDIS_OK);
+    scripted_close(&script,thread);
+    test_cond(sc->groups[0].port == 7002 && sc->groups[1].port == 7001 &&
+              strcmp(script.got[1],get) == 0);
+
+    test("Sentinel groups are resolved asynchronously with pipelined queries: ");
+    sc->groups[0].port = sc->groups[1].port = 0;
+    assert(redisSentinelAsyncResolveGroups(sc,groups_resolved) == REDIS_OK);
+    assert(redisSentinelAsyncResolveGroups(sc,groups_resolved) == REDIS_ERR);
+    close(serve_reply(sc->resolve,fds[sc->resolve->c.tcp.port == ports[1]],both));
+    test_cond(calls == 1 && sc->resolve == NULL && sc->groups[0].port == 7000 &&
+              sc->groups[1].port == 7001);
+
+    test("Sentinel groups follow +switch-master with their callback: ");
+    assert(redisSentinelAsyncWatch(sc,discovered) == REDIS_OK);
+    snprintf(message,sizeof(message),"*3\r\n$7\r\nmessage\r\n$14\r\n+switch-master\r\n$%d\r\n%s\r\n",
+             (int)strlen(text),text);
+    srv = serve_reply(sc->watch,fds[sc->watch->c.tcp.port == ports[1]],subscribed);
+    async_reply(sc->watch,srv,message);
+    test_cond(group_changes[1] == 1 && group_changes[0] == 0 && sc->groups[1].port == 7101 &&
+              sc->groups[0].port == 7000 && sc->discovery == NULL);
+
+    redisSentinelFree(sc);
+    close(srv);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+/* Appends a multi bulk reply of the strings. */
+static sds resp_strings(sds s, int n, const char **strs) {
+    int j;
+
+    s = sdscatfmt(s,"*%i\r\n",n);
+    for (j = 0; j < n; j++)
+        s = sdscatfmt(s,"$%u\r\n%s\r\n",(unsigned)strlen(strs[j]),strs[j]);
+    return s;
+}
+
+static sds resp_info(const char *info) {
+    return sdscatfmt(sdsempty(),"$%u\r\n%s\r\n",(unsigned)strlen(info),info);
+}
+
+static void test_sentinel_read(void) {
+    const char *hosts[1] = { "127.0.0.1" };
+    const char *up = "# Replication\r\nrole:slave\r\nmaster_link_status:up\r\nslave_repl_offset:950";
+    const char *down = "# Replication\r\nrole:slave\r\nmaster_link_status:down\r\nslave_repl_offset:100";
+    const char *fields[6] = { "ip", "127.0.0.1", "port", NULL, "flags", "slave" };
+    redisSentinelContext *sc;
+    redisSentinelReadContext *rc;
+    redisSentinelReplica *rep[2];
+    struct attached att = { { NULL }, 0 };
+    int sport, sfd = listen_loopback(&sport), ports[3], fds[3], srv[2], replies = 0, j;
+    char port[3][16];
+    sds reply;
+
+    for (j = 0; j < 3; j++) {
+        fds[j] = listen_loopback(&ports[j]);
+        snprintf(port[j],sizeof(port[j]),"%d",ports[j]);
+    }
+    sc = redisSentinelInit("mymaster",hosts,&sport,1);
+    redisSentinelSetAttach(sc,attach_keep,&att);
+    rc = redisSentinelReadInit(sc);
+
+    test("Sentinel read context skips replicas the sentinels see as down: ");
+    assert(redisSentinelReadRefresh(rc) == REDIS_OK);
+    reply = sdscatfmt(sdsempty(),"*3\r\n");
+    for (j = 0; j < 3; j++) {
+        fields[3] = port[j];
+        fields[5] = j == 2 ? "s_down,slave" : "slave";
+        reply = resp_strings(reply,6,fields);
+    }
+    close(serve_reply(att.acs[0],sfd,reply));
+    sdsfree(reply);
+    test_cond(rc->len == 2 && rc->replicas[0]->port == ports[0] &&
+              rc->replicas[1]->port == ports[1] && att.len == 3);
+
+    test("Sentinel read context only picks replicas linked to the master: ");
+    rep[0] = rc->replicas[0];
+    rep[1] = rc->replicas[1];
+    reply = resp_info(up);
+    srv[0] = serve_reply(rep[0]->ac,fds[0],reply);
+    sdsfree(reply);
+    reply = resp_info(down);
+    srv[1] = serve_reply(rep[1]->ac,fds[1],reply);
+    sdsfree(reply);
+    test_cond(rep[0]->healthy && !rep[1]->healthy && rep[0]->offset == 950 &&
+              redisSentinelReadPick(rc) == rep[0]);
+
+    test("Sentinel read context weighs the round trip time by pending commands: ");
+    rep[1]->healthy = 1;
+    rep[0]->rtt = 1000;
+    rep[1]->rtt = 3000;
+    assert(redisSentinelReadPick(rc) == rep[0]);
+    for (j = 0; j < 2; j++)
+        assert(redisSentinelReadCommand(rc,count_reply,&replies,"GET foo") == REDIS_OK);
+    test_cond(rep[0]->ac->flow.pending == 2 && redisSentinelReadPick(rc) == rep[1]);
+
+    test("Sentinel read context skips replicas that lag behind too much: ");
+    rc->master_offset = 1000;
+    redisSentinelReadSetMaxLag(rc,100);
+    test_cond(redisSentinelReadPick(rc) == rep[0] && rep[1]->offset == 100);
+
+    test("Sentinel read context falls back to the master without replicas: ");
+    rep[0]->healthy = 0;
+    test_cond(redisSentinelReadPick(rc) == NULL &&
+              redisSentinelReadCommand(rc,count_reply,&replies,"GET foo") == REDIS_ERR);
+
+    redisSentinelReadFree(rc);
+    redisSentinelFree(sc);
+    close(srv[0]);
+    close(srv[1]);
+    for (j = 0; j < 3; j++)
+        close(fds[j]);
+    close(sfd);
+}
+
+static void cluster_reply(redisAsyncContext *ac, void *r, void *privdata) {
+    redisReply *reply = r;
+    char *buf = privdata;
+    ((void)ac);
+    snprintf(buf,64,"%s",reply && reply->str ? reply->str : "(none)");
+}
+
+static void test_cluster_redirects(void) {
+    const char *hosts[1] = { "127.0.0.1" };
+    redisClusterContext *cc;
+    struct attached att = { { NULL }, 0 };
+    int ports[2], fds[2], srv[3], j;
+    char got[64], buf[128];
+    sds slots;
+
+    for (j = 0; j < 2; j++)
+        fds[j] = listen_loopback(&ports[j]);
+    cc = redisClusterInit(hosts,ports,1);
+    redisClusterSetAttach(cc,attach_keep,&att);
+
+    test("Cluster commands for unknown slots go to the first node: ");
+    assert(redisClusterAsyncCommand(cc,cluster_reply,got,"GET foo") == REDIS_OK);
+    test_cond(att.len == 1 && att.acs[0]->c.tcp.port == ports[0]);
+
+    test("Cluster MOVED sends the command to the new owner of the slot: ");
+    snprintf(buf,sizeof(buf),"-MOVED 12182 127.0.0.1:%d\r\n",ports[1]);
+    srv[0] = serve_reply(att.acs[0],fds[0],buf);
+    assert(att.len == 2 && att.acs[1]->c.tcp.port == ports[1]);
+    srv[1] = serve_reply(att.acs[1],fds[1],"$3\r\nbar\r\n");
+    test_cond(strcmp(got,"bar") == 0 && cc->slots[12182]->port == ports[1] &&
+              cc->refresh == att.acs[0]);
+
+    test("Cluster slot map is fetched again after MOVED: ");
+    slots = sdscatfmt(sdsempty(),"*1\r\n*3\r\n:0\r\n:16383\r\n*2\r\n$9\r\n127.0.0.1\r\n:%i\r\n",ports[1]);
+    redisAsyncHandleWrite(att.acs[0]);
+    async_reply(att.acs[0],srv[0],slots);
+    sdsfree(slots);
+    test_cond(cc->refresh == NULL && cc->slots[0]->port == ports[1] &&
+              cc->nodes[0]->slots == 0 && cc->nodes[0]->ac == NULL);
+
+    test("Cluster ASK sends the command once more with ASKING: ");
+    assert(redisClusterAsyncCommand(cc,cluster_reply,got,"GET foo") == REDIS_OK);
+    redisAsyncHandleWrite(att.acs[1]);
+    snprintf(buf,sizeof(buf),"-ASK 12182 127.0.0.1:%d\r\n",ports[0]);
+    async_reply(att.acs[1],srv[1],buf);
+    assert(att.len == 3 && strstr(att.acs[2]->c.obuf,"ASKING") != NULL);
+    srv[2] = serve_reply(att.acs[2],fds[0],"+OK\r\n$3\r\nbaz\r\n");
+    test_cond(strcmp(got,"baz") == 0 && cc->slots[12182]->port == ports[1]);
+
+    test("Cluster redirections beyond the limit are passed to the callback: ");
+    redisClusterSetMaxRedirects(cc,0);
+    assert(redisClusterAsyncCommand(cc,cluster_reply,got,"GET foo") == REDIS_OK);
+    redisAsyncHandleWrite(att.acs[1]);
+    async_reply(att.acs[1],srv[1],buf);
+    test_cond(strncmp(got,"ASK 12182",9) == 0 && att.len == 3);
+
+    redisClusterFree(cc);
+    for (j = 0; j < 3; j++)
+        close(srv[j]);
+    close(fds[0]);
+    close(fds[1]);
+}
+
+static void test_async_flow(void) {
+    redisAsyncContext *ac;
+    int srv, replies = 0, flow = 0;
+
+    ac = async_pair(&srv);
+    redisAsyncSetFlowControl(ac,0,0,2,0,flow_changed,&flow);
+
+    test("Async flow control refuses commands at the high water mark: ");
+    assert(redisAsyncCommand(ac,count_reply,&replies,"PING") == REDIS_OK);
+    assert(redisAsyncCommand(ac,count_reply,&replies,"PING") == REDIS_OK);
+    test_cond(flow == 1 && ac->flow.full && ac->flow.pending == 2 &&
+              redisAsyncCommand(ac,count_reply,&replies,"PING") == REDIS_ERR);
+
+    test("Async flow control accepts commands again at the low water mark: ");
+    redisAsyncHandleWrite(ac);
+    async_reply(ac,srv,"+PONG\r\n");
+    assert(ac->flow.full && ac->flow.pending == 1);
+    async_reply(ac,srv,"+PONG\r\n");
+    test_cond(flow == 2 && !ac->flow.full && ac->flow.pending == 0 && replies == 2);
+
+    test("Async flow control counts replies to commands sent before MONITOR: ");
+    assert(redisAsyncCommand(ac,count_reply,&replies,"GET key") == REDIS_OK);
+    assert(redisAsyncCommand(ac,count_reply,&replies,"MONITOR") == REDIS_OK);
+    redisAsyncHandleWrite(ac);
+    async_reply(ac,srv,"$-1\r\n+OK\r\n+1 \"SET\" \"key\"\r\n");
+    test_cond(replies == 5 && ac->flow.pending == 0 && (ac->c.flags & REDIS_MONITORING));
+
+    redisAsyncFree(ac);
+    close(srv);
+}
+
+static void batch_reply(redisAsyncContext *ac, void *r, void *privdata) {
+    redisReply *reply = r;
+    ((void)ac);
+    if (reply == NULL)
+        *(int*)privdata = -1;
+    else
+        *(int*)privdata = (int)reply->elements;
+}
+
+static void test_async_batch(void) {
+    redisAsyncContext *ac;
+    redisAsyncBatch *b;
+    int srv, got = 0;
+
+    ac = async_pair(&srv);
+
+    test("Async batch passes every reply at once: ");
+    b = redisAsyncBatchBegin(ac,batch_reply,&got);
+    assert(b != NULL);
+    assert(redisAsyncBatchAdd(b,"PING") == REDIS_OK);
+    assert(redisAsyncBatchAdd(b,"PING") == REDIS_OK);
+    assert(redisAsyncBatchCommit(b) == REDIS_OK);
+    redisAsyncHandleWrite(ac);
+    async_reply(ac,srv,"+PONG\r\n");
+    assert(got == 0);
+    async_reply(ac,srv,"+PONG\r\n");
+    test_cond(got == 2);
+
+    test("Async batch is free'd with a reader that doesn't build objects: ");
+    ac->c.reader->fn = NULL;
+    b = redisAsyncBatchBegin(ac,batch_reply,&got);
+    assert(b != NULL);
+    assert(redisAsyncBatchAdd(b,"PING") == REDIS_OK);
+    assert(redisAsyncBatchAdd(b,"PING") == REDIS_OK);
+    assert(redisAsyncBatchCommit(b) == REDIS_OK);
+    redisAsyncHandleWrite(ac);
+    async_reply(ac,srv,"+PONG\r\n");
+    redisAsyncFree(ac);
+    test_cond(got == -1);
+    close(srv);
+}
+
+static void test_async_budget(void) {
+    redisAsyncContext *ac;
+    int srv, replies = 0, j;
+
+    ac = async_pair(&srv);
+    redisAsyncSetReadBudget(ac,2,0,0);
+    for (j = 0; j < 5; j++)
+        assert(redisAsyncCommand(ac,count_reply,&replies,"PING") == REDIS_OK);
+    redisAsyncHandleWrite(ac);
+
+    test("Async read budget isn't spent when no reply is left: ");
+    async_reply(ac,srv,"+PONG\r\n+PONG\r\n");
+    test_cond(replies == 2 && !ac->budget.deferred);
+
+    test("Async read budget leaves the replies that were read for later: ");
+    async_reply(ac,srv,"+PONG\r\n+PONG\r\n+PONG\r\n");
+    assert(replies == 4 && ac->budget.deferred);
+    redisAsyncHandleWrite(ac);
+    test_cond(replies == 5 && !ac->budget.deferred);
+
+    redisAsyncFree(ac);
+    close(srv);
+}
+
+#define QUEUE_PRODUCERS 4
+#define QUEUE_COMMANDS 2000
+
+struct queue_producer {
+    redisAsyncQueue *q;
+    pthread_t thread;
+    int seq[QUEUE_COMMANDS];
+};
+
+static int queued_orphans;
+
+static void queued_reply(redisAsyncContext *ac, void *r, void *privdata) {
+    ((void)r); ((void)privdata);
+    if (ac == NULL)
+        queued_orphans++;
+}
+
+static void *queue_producer_thread(void *arg) {
+    struct queue_producer *p = arg;
+    int j;
+
+    for (j = 0; j < QUEUE_COMMANDS; j++) {
+        p->seq[j] = j;
+        assert(redisAsyncQueueCommand(p->q,queued_reply,&p->seq[j],"PING") == REDIS_OK);
+    }
+    return NULL;
+}
+
+static void test_async_queue(void) {
+    struct queue_producer producers[QUEUE_PRODUCERS];
+    redisAsyncContext *ac;
+    redisAsyncQueue *q;
+    redisCallback *cb;
+    struct pollfd pfd;
+    int srv, j, k, next[QUEUE_PRODUCERS] = {0}, total = 0, ordered = 1;
+
+    ac = async_pair(&srv);
+    q = redisAsyncQueueCreate(ac);
+    assert(q != NULL);
+
+    test("Async queue keeps the order of every producer: ");
+    for (j = 0; j < QUEUE_PRODUCERS; j++) {
+        producers[j].q = q;
+        assert(pthread_create(&producers[j].thread,NULL,queue_producer_thread,&producers[j]) == 0);
+    }
+    pfd.fd = redisAsyncQueueFd(q);
+    pfd.events = POLLIN;
+    while (ac->flow.pending < QUEUE_PRODUCERS*QUEUE_COMMANDS) {
+        assert(poll(&pfd,1,1000) == 1);
+        redisAsyncQueueDrain(q);
+    }
+    for (j = 0; j < QUEUE_PRODUCERS; j++)
+        pthread_join(producers[j].thread,NULL);
+    for (cb = ac->replies.head; cb != NULL; cb = cb->next, total++) {
+        for (k = 0; k < QUEUE_PRODUCERS; k++) {
+            if ((int*)cb->privdata >= producers[k].seq &&
+                (int*)cb->privdata < producers[k].seq+QUEUE_COMMANDS)
+                break;
+        }
+        assert(k < QUEUE_PRODUCERS);
+        if (*(int*)cb->privdata != next[k]++)
+            ordered = 0;
+    }
+    test_cond(ordered && total == QUEUE_PRODUCERS*QUEUE_COMMANDS &&
+              sdslen(ac->c.obuf) == (size_t)total*strlen("*1\r\n$4\r\nPING\r\n"));
+
+    test("Async queue calls back commands that never reached the context with a NULL context: ");
+    assert(redisAsyncQueueCommand(q,queued_reply,NULL,"PING") == REDIS_OK);
+    assert(redisAsyncQueueCommand(q,queued_reply,NULL,"PING") == REDIS_OK);
+    redisAsyncFree(ac);
+    assert(queued_orphans == 2);
+    assert(redisAsyncQueueCommand(q,queued_reply,NULL,"PING") == REDIS_OK);
+    redisAsyncQueueFree(q);
+    test_cond(queued_orphans == 3);
+    close(srv);
+}
+
+static void shard_reply(redisAsyncContext *ac, void *r, void *privdata) {
+    redisReply *reply = r, *copy = privdata;
+    ((void)ac);
+    copy->type = reply ? reply->type : 0;
+    copy->elements = reply ? reply->elements : 0;
+}
+
+#ifdef __linux__
+struct epoll_case {
+    redisAsyncContext *free; /* free'd by the callback */
+    size_t len;
+    int calls;
+};
+
+static void epoll_reply(redisAsyncContext *ac, void *r, void *privdata) {
+    struct epoll_case *ec = privdata;
+    redisReply *reply = r;
+    ((void)ac);
+
+    ec->calls++;
+    if (reply == NULL)
+        return;
+    ec->len = reply->len;
+    if (ec->free != NULL)
+        redisAsyncFree(ec->free);
+}
+
+/* A bulk reply of len bytes. */
+static sds epoll_bulk(size_t len) {
+    sds s = sdscatfmt(sdsempty(),"$%u\r\n",(unsigned)len);
+    size_t start = sdslen(s);
+
+    s = sdsgrowzero(s,start+len);
+    memset(s+start,'x',len);
+    return sdscatlen(s,"\r\n",2);
+}
+
+static void test_epoll_loop(void) {
+    size_t total = REDIS_IOBUF_LEN*8;
+    struct epoll_case big = { NULL, 0, 0 }, small = { NULL, 0, 0 };
+    redisEpollLoop *loop = redisEpollLoopCreate(16);
+    redisAsyncContext *ac1, *ac2;
+    sds bulk = epoll_bulk(total);
+    size_t off = 0;
+    ssize_t n;
+    int srv1, srv2, iterations = 0;
+
+    test("Epoll loop reads a large reply in pieces within the read budget: ");
+    ac1 = async_pair(&srv1);
+    assert(redisEpollAttach(ac1,loop) == REDIS_OK);
+    redisAsyncSetReadBudget(ac1,0,0,1);
+    big.free = ac1;
+    assert(redisAsyncCommand(ac1,epoll_reply,&big,"GET big") == REDIS_OK);
+    assert(fcntl(srv1,F_SETFL,O_NONBLOCK) == 0);
+    do {
+        if (off < sdslen(bulk) && (n = write(srv1,bulk+off,sdslen(bulk)-off)) > 0)
+            off += n;
+        assert(++iterations < 100000);
+    } while (redisEpollLoopRunOnce(loop,10) > 0);
+    test_cond(big.calls == 1 && big.len == total && iterations >= 8);
+    close(srv1);
+
+    test("Epoll loop drops a context free'd while it is on the ready list: ");
+    ac1 = async_pair(&srv1);
+    ac2 = async_pair(&srv2);
+    assert(redisEpollAttach(ac1,loop) == REDIS_OK && redisEpollAttach(ac2,loop) == REDIS_OK);
+    redisAsyncSetReadBudget(ac2,0,0,1);
+    memset(&big,0,sizeof(big));
+    small.free = ac2;
+    assert(redisAsyncCommand(ac1,epoll_reply,&small,"PING") == REDIS_OK);
+    assert(redisAsyncCommand(ac2,epoll_reply,&big,"GET big") == REDIS_OK);
+    assert(write(srv2,bulk,REDIS_IOBUF_LEN*3) == REDIS_IOBUF_LEN*3);
+    redisEpollLoopRunOnce(loop,100);
+    assert(loop->ready == ac2->ev.data && big.calls == 0);
+    assert(write(srv1,"+PONG\r\n",7) == 7);
+    test_cond(redisEpollLoopRunOnce(loop,100) == 1 && small.calls == 1 &&
+              big.calls == 1 && big.len == 0 &&
+              (loop->ready == NULL || loop->ready->context == ac1));
+
+    test("Epoll loop runs until the last context was free'd from a callback: ");
+    small.free = ac1;
+    assert(write(srv1,"+PONG\r\n",7) == 7);
+    assert(redisAsyncCommand(ac1,epoll_reply,&small,"PING") == REDIS_OK);
+    redisEpollLoopRun(loop);
+    test_cond(small.calls == 2 && loop->contexts == 0 && loop->ready == NULL);
+
+    redisEpollLoopFree(loop);
+    sdsfree(bulk);
+    close(srv1);
+    close(srv2);
+}
+#endif
+
+static void test_shard_merge(void) {
+    const char *hosts[] = { "127.0.0.1", "127.0.0.1" };
+    int ports[2], fds[2], srv[2], found[2] = { 0 }, j, k, len;
+    char key[16], keys[2][16];
+    redisShardContext *sc;
+    redisReply got;
+
+    for (j = 0; j < 2; j++)
+        fds[j] = listen_loopback(&ports[j]);
+    sc = redisShardInit(hosts,ports,2);
+    assert(sc != NULL && sc->err == 0);
+    for (j = 0; j < 2; j++) {
+        assert((srv[j] = accept(fds[j],NULL,NULL)) != -1);
+        redisAsyncHandleWrite(sc->nodes[j].ac);
+    }
+    /* A key on every node */
+    for (k = 0; !found[0] || !found[1]; k++) {
+        len = snprintf(key,sizeof(key),"key:%d",k);
+        j = redisShardGetNode(sc,key,len);
+        if (!found[j]) {
+            memcpy(keys[j],key,len+1);
+            found[j] = 1;
+        }
+    }
+
+    test("Shard MGET merges the replies of every node: ");
+    memset(&got,0,sizeof(got));
+    assert(redisShardAsyncCommand(sc,shard_reply,&got,"MGET %s %s",keys[0],keys[1]) == REDIS_OK);
+    for (j = 0; j < 2; j++)
+        redisAsyncHandleWrite(sc->nodes[j].ac);
+    async_reply(sc->nodes[0].ac,srv[0],"*1\r\n$1\r\na\r\n");
+    async_reply(sc->nodes[1].ac,srv[1],"*1\r\n$1\r\nb\r\n");
+    test_cond(got.type == REDIS_REPLY_ARRAY && got.elements == 2);
+
+    test("Shard MGET fails when a node replies with something else: ");
+    memset(&got,0,sizeof(got));
+    assert(redisShardAsyncCommand(sc,shard_reply,&got,"MGET %s %s",keys[0],keys[1]) == REDIS_OK);
+    for (j = 0; j < 2; j++)
+        redisAsyncHandleWrite(sc->nodes[j].ac);
+    async_reply(sc->nodes[0].ac,srv[0],"*1\r\n$1\r\na\r\n");
+    async_reply(sc->nodes[1].ac,srv[1],"+OK\r\n");
+    test_cond(got.type == REDIS_REPLY_ERROR);
+
+    test("Shard node can be reconnected after losing its connection: ");
+    close(srv[1]);
+    redisAsyncHandleRead(sc->nodes[1].ac);
+    assert(sc->nodes[1].ac == NULL);
+    assert(redisShardAsyncCommand(sc,shard_reply,&got,"GET %s",keys[1]) == REDIS_ERR);
+    assert(redisShardReconnect(sc,0) == REDIS_ERR);
+    assert(redisShardReconnect(sc,1) == REDIS_OK);
+    assert((srv[1] = accept(fds[1],NULL,NULL)) != -1);
+    redisAsyncHandleWrite(sc->nodes[1].ac);
+    test_cond(sc->nodes[1].ac != NULL &&
+              redisShardAsyncCommand(sc,shard_reply,&got,"GET %s",keys[1]) == REDIS_OK);
+
+    redisShardFree(sc);
+    for (j = 0; j < 2; j++) {
+        close(srv[j]);
+        close(fds[j]);
+    }
+}
+
+static char setup_error[128];
+
+static void setup_disconnected(const redisAsyncContext *ac, int status) {
+    ((void)status);
+    snprintf(setup_error,sizeof(setup_error),"%s",ac->errstr);
+}
+
+static void test_setup_commands(void) {
+    redisConnectOptions good = { NULL, "secret", NULL, 2, 0 };
+    redisConnectOptions bad = { NULL, "wrong", NULL, 0, 0 };
+    const char *setup = "*2\r\n$4\r\nAUTH\r\n$6\r\nsecret\r\n*2\r\n$6\r\nSELECT\r\n$1\r\n2\r\n";
+    const char *wrong = "*2\r\n$4\r\nAUTH\r\n$5\r\nwrong\r\n";
+    const char *ping = "*1\r\n$4\r\nPING\r\n";
+    redisAsyncContext *ac;
+    redisContext *c;
+    char buf[128];
+    ssize_t n;
+    int srv, port, fd, replies = 0;
+
+    fd = listen_loopback(&port);
+    c = redisConnect("127.0.0.1",port);
+    assert(c != NULL && c->err == 0);
+    assert((srv = accept(fd,NULL,NULL)) != -1);
+
+    test("Connect options are kept once the setup commands succeeded: ");
+    assert(write(srv,"+OK\r\n+OK\r\n",10) == 10);
+    test_cond(redisSetConnectOptions(c,&good) == REDIS_OK &&
+              strcmp(c->options->password,"secret") == 0);
+
+    test("Connect options that failed don't replace the previous ones: ");
+    assert(write(srv,"-WRONGPASS nope\r\n",17) == 17);
+    test_cond(redisSetConnectOptions(c,&bad) == REDIS_ERR &&
+              strcmp(c->errstr,"AUTH failed: WRONGPASS nope") == 0 &&
+              strcmp(c->options->password,"secret") == 0);
+    redisFree(c);
+    close(srv);
+
+    test("Connect options are refused while replies are pending: ");
+    c = redisConnect("127.0.0.1",port);
+    assert(c != NULL && c->err == 0);
+    assert((srv = accept(fd,NULL,NULL)) != -1);
+    assert(redisAppendCommand(c,"PING") == REDIS_OK);
+    test_cond(redisSetConnectOptions(c,&good) == REDIS_ERR &&
+              c->err == REDIS_ERR_OTHER && c->options == NULL);
+    redisFree(c);
+    close(srv);
+    close(fd);
+
+    test("Async connect options hold other commands back until they succeeded: ");
+    ac = async_pair(&srv);
+    assert(redisAsyncSetConnectOptions(ac,&good) == REDIS_OK);
+    assert(redisAsyncCommand(ac,count_reply,&replies,"PING") == REDIS_OK);
+    assert(strcmp(ac->c.obuf,setup) == 0);
+    redisAsyncHandleWrite(ac);
+    async_reply(ac,srv,"+OK\r\n");
+    assert(sdslen(ac->c.obuf) == 0 && ac->setup.held != NULL);
+    async_reply(ac,srv,"+OK\r\n");
+    test_cond(ac->setup.held == NULL && strcmp(ac->c.obuf,ping) == 0);
+
+    test("Async connect options that succeed let the next commands through: ");
+    redisAsyncHandleWrite(ac);
+    async_reply(ac,srv,"+PONG\r\n");
+    test_cond(replies == 1 && ac->err == 0);
+
+    test("Async connect options are refused while replies are pending: ");
+    assert(redisAsyncCommand(ac,count_reply,&replies,"PING") == REDIS_OK);
+    test_cond(redisAsyncSetConnectOptions(ac,&good) == REDIS_ERR &&
+              ac->err == REDIS_ERR_OTHER && ac->errstr != NULL);
+    redisAsyncFree(ac);
+    close(srv);
+    replies = 0;
+
+    test("Async connect options disconnect when a setup command failed: ");
+    ac = async_pair(&srv);
+    redisAsyncSetDisconnectCallback(ac,setup_disconnected);
+    assert(redisAsyncSetConnectOptions(ac,&bad) == REDIS_OK);
+    assert(redisAsyncCommand(ac,count_reply,&replies,"PING") == REDIS_OK);
+    redisAsyncHandleWrite(ac);
+    async_reply(ac,srv,"-WRONGPASS nope\r\n");
+    test_cond(replies == 1 && strcmp(setup_error,"AUTH failed: WRONGPASS nope") == 0);
+
+    test("Async commands held back never reach the server when setup failed: ");
+    memset(buf,0,sizeof(buf));
+    n = recv(srv,buf,sizeof(buf)-1,MSG_WAITALL);
+    test_cond(n == (ssize_t)strlen(wrong) && strcmp(buf,wrong) == 0);
+    close(srv);
+}
+
+static struct addrinfo *loopback_addr(int port) {
+    struct addrinfo hints, *info;
+    char service[16];
+
+    memset(&hints,0,sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(service,sizeof(service),"%d",port);
+    assert(getaddrinfo("127.0.0.1",service,&hints,&info) == 0);
+    return info;
+}
+
+/* Returns a listener that doesn't take any more connections, so connecting
+ * to it hangs, and the sockets filling its backlog in conns. */
+static int listen_full(int *port, int *conns, int n) {
+    struct sockaddr_in sa;
+    socklen_t len = sizeof(sa);
+    int fd = listen_loopback(port), j;
+
+    assert(listen(fd,0) == 0);
+    memset(&sa,0,sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sa.sin_port = htons(*port);
+    for (j = 0; j < n; j++) {
+        conns[j] = socket(AF_INET,SOCK_STREAM,0);
+        fcntl(conns[j],F_SETFL,O_NONBLOCK);
+        connect(conns[j],(struct sockaddr*)&sa,len);
+    }
+    return fd;
+}
+
+static int peer_port(int fd) {
+    struct sockaddr_in sa;
+    socklen_t len = sizeof(sa);
+
+    assert(getpeername(fd,(struct sockaddr*)&sa,&len) == 0);
+    return ntohs(sa.sin_port);
+}
+
+static void test_connect_race(void) {
+    struct addrinfo fake[5], *good, *bad, *addrs[2], **ordered;
+    int families[5] = { AF_INET6, AF_INET6, AF_INET, AF_INET, AF_INET };
+    int conns[4], fd, full, port, refused, hanging, n, j;
+    redisContext c;
+    long long start;
+
+    for (j = 0; j < 5; j++) {
+        memset(&fake[j],0,sizeof(fake[j]));
+        fake[j].ai_family = families[j];
+        fake[j].ai_next = j < 4 ? &fake[j+1] : NULL;
+    }
+
+    test("Resolved addresses start with IPv4 and alternate families: ");
+    ordered = redisOrderAddrs(fake,0,&n);
+    test_cond(n == 5 && ordered[0] == &fake[2] && ordered[1] == &fake[0] &&
+              ordered[2] == &fake[3] && ordered[3] == &fake[1] && ordered[4] == &fake[4]);
+    free(ordered);
+
+    test("Resolved addresses can be limited to the first family: ");
+    ordered = redisOrderAddrs(fake,1,&n);
+    assert(n == 3 && ordered[0] == &fake[2] && ordered[2] == &fake[4]);
+    free(ordered);
+    fake[1].ai_next = NULL;
+    ordered = redisOrderAddrs(fake,1,&n);
+    test_cond(n == 2 && ordered[0] == &fake[0] && ordered[1] == &fake[1]);
+    free(ordered);
+
+    close(listen_loopback(&refused));
+    fd = listen_loopback(&port);
+    full = listen_full(&hanging,conns,4);
+    good = loopback_addr(port);
+
+    test("Connect race moves on right away when an address refuses: ");
+    memset(&c,0,sizeof(c));
+    addrs[0] = bad = loopback_addr(refused);
+    addrs[1] = good;
+    start = usec();
+    test_cond(redisContextConnectRace(&c,addrs,2,1000) == REDIS_OK &&
+              peer_port(c.fd) == port && usec()-start < REDIS_CONNECT_ATTEMPT_DELAY*1000);
+    close(c.fd);
+
+    test("Connect race reports the first error when no address connects: ");
+    memset(&c,0,sizeof(c));
+    addrs[1] = bad;
+    test_cond(redisContextConnectRace(&c,addrs,2,1000) == REDIS_ERR &&
+              c.err == REDIS_ERR_IO && strstr(c.errstr,"refused") != NULL);
+    freeaddrinfo(bad);
+
+    test("Connect race starts the next attempt when an address hangs: ");
+    memset(&c,0,sizeof(c));
+    addrs[0] = bad = loopback_addr(hanging);
+    addrs[1] = good;
+    start = usec();
+    test_cond(redisContextConnectRace(&c,addrs,2,5000) == REDIS_OK &&
+              peer_port(c.fd) == port && usec()-start >= REDIS_CONNECT_ATTEMPT_DELAY*1000);
+    close(c.fd);
+
+    test("Connect race gives up at the timeout: ");
+    memset(&c,0,sizeof(c));
+    test_cond(redisContextConnectRace(&c,addrs,1,100) == REDIS_ERR &&
+              c.err == REDIS_ERR_IO && strstr(c.errstr,"timed out") != NULL);
+    freeaddrinfo(bad);
+    freeaddrinfo(good);
+
+    for (j = 0; j < 4; j++)
+        close(conns[j]);
+    close(full);
+    close(fd);
+}
+
+/* Returns 1 when a connection waits to be accepted on the listener. */
+static int pending_accept(int lfd) {
+    struct pollfd pfd;
+
+    pfd.fd = lfd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return poll(&pfd,1,0) == 1;
+}
+
+static void connected_status(const redisAsyncContext *ac, int status) {
+    *(int*)ac->data = status == REDIS_OK ? 1 : 2;
+}
+
+static void test_fast_open(void) {
+    const char *ping = "*1\r\n$4\r\nPING\r\n";
+    redisTransport none = { NULL, NULL, NULL, NULL, NULL };
+    redisAsyncContext *ac;
+    redisContext *c;
+    redisReply *reply;
+    char buf[64];
+    int port, lfd = listen_loopback(&port), srv, done, status = 0, replies = 0;
+
+    test("Fast Open contexts connect on the first write: ");
+    c = redisConnectFastOpen("127.0.0.1",port);
+    assert(c->err == 0 && (c->flags & REDIS_CONNECT_DEFERRED));
+    assert(!pending_accept(lfd));
+    redisAppendCommand(c,"PING");
+    do {
+        assert(redisBufferWrite(c,&done) == REDIS_OK);
+    } while (!done);
+    test_cond(!(c->flags & REDIS_CONNECT_DEFERRED) && pending_accept(lfd));
+
+    test("Fast Open connects carry the commands issued before: ");
+    assert((srv = accept(lfd,NULL,NULL)) != -1);
+    memset(buf,0,sizeof(buf));
+    assert(recv(srv,buf,strlen(ping),MSG_WAITALL) == (ssize_t)strlen(ping));
+    assert(write(srv,"+PONG\r\n",7) == 7);
+    assert(redisGetReply(c,(void**)&reply) == REDIS_OK);
+    test_cond(strcmp(buf,ping) == 0 && reply->type == REDIS_REPLY_STATUS &&
+              strcmp(reply->str,"PONG") == 0);
+    freeReplyObject(reply);
+    redisFree(c);
+    close(srv);
+
+    test("Fast Open contexts refuse transports before connecting: ");
+    c = redisConnectNonBlockFastOpen("127.0.0.1",port);
+    test_cond(redisSetTransport(c,&none,NULL) == REDIS_ERR &&
+              c->err == REDIS_ERR_OTHER && (c->flags & REDIS_CONNECT_DEFERRED));
+    redisFree(c);
+
+    test("Fast Open connects without commands fall back to connect(2): ");
+    c = redisConnectNonBlockFastOpen("127.0.0.1",port);
+    assert(redisBufferWrite(c,&done) == REDIS_OK && done);
+    assert((srv = accept(lfd,NULL,NULL)) != -1);
+    test_cond(!(c->flags & REDIS_CONNECT_DEFERRED) && redisCheckSocketError(c) == REDIS_OK);
+    redisFree(c);
+    close(srv);
+
+    test("Async Fast Open contexts connect on the first event: ");
+    ac = redisAsyncConnectFastOpen("127.0.0.1",port);
+    ac->data = &status;
+    redisAsyncSetConnectCallback(ac,connected_status);
+    redisAsyncCommand(ac,count_reply,&replies,"PING");
+    redisAsyncHandleWrite(ac);
+    assert((srv = accept(lfd,NULL,NULL)) != -1);
+    redisAsyncHandleWrite(ac);
+    memset(buf,0,sizeof(buf));
+    assert(recv(srv,buf,strlen(ping),MSG_WAITALL) == (ssize_t)strlen(ping));
+    async_reply(ac,srv,"+PONG\r\n");
+    test_cond(status == 1 && strcmp(buf,ping) == 0 && replies == 1);
+    redisAsyncFree(ac);
+    close(srv);
+    close(lfd);
+}
+
+static void test_stats(void) {
+    const char *ping = "*1\r\n$4\r\nPING\r\n";
+    redisContext *c;
+    redisReply *reply;
+    redisStats st;
+    int sv[2], fd, port, srv, sndbuf = 4096;
+    char buf[64], *big;
+
+    assert(socketpair(AF_UNIX,SOCK_STREAM,0,sv) == 0);
+    c = redisConnectFd(sv[0]);
+    assert(c != NULL && c->err == 0 && redisEnableStats(c) == REDIS_OK);
+
+    test("Stats count the reads and writes of a round trip: ");
+    assert(write(sv[1],"+PONG\r\n",7) == 7);
+    reply = redisCommand(c,"PING");
+    assert(reply != NULL && reply->type == REDIS_REPLY_STATUS);
+    freeReplyObject(reply);
+    assert(recv(sv[1],buf,sizeof(buf),0) == (ssize_t)strlen(ping));
+    redisGetStats(c,&st);
+    test_cond(st.write_calls == 1 && st.bytes_written == strlen(ping) &&
+              st.read_calls == 1 && st.bytes_read == 7 && st.replies == 1 &&
+              st.short_writes == 0 && st.would_block == 0);
+
+    test("Stats count reads and writes that would block and short writes: ");
+    assert(fcntl(c->fd,F_SETFL,fcntl(c->fd,F_GETFL)|O_NONBLOCK) == 0);
+    c->flags &= ~REDIS_BLOCK;
+    assert(setsockopt(c->fd,SOL_SOCKET,SO_SNDBUF,&sndbuf,sizeof(sndbuf)) == 0);
+    assert(redisBufferRead(c) == REDIS_OK);
+    big = calloc(1,1024*1024);
+    assert(redisAppendCommand(c,"SET key %b",big,(size_t)1024*1024) == REDIS_OK);
+    free(big);
+    assert(redisBufferWrite(c,NULL) == REDIS_OK);
+    assert(redisBufferWrite(c,NULL) == REDIS_OK);
+    redisGetStats(c,&st);
+    test_cond(st.read_calls == 2 && st.write_calls == 3 && st.short_writes == 1 &&
+              st.would_block == 2 && st.bytes_written > strlen(ping));
+
+    test("Stats are set to 0 by redisResetStats(): ");
+    redisResetStats(c);
+    redisGetStats(c,&st);
+    test_cond(st.read_calls == 0 && st.write_calls == 0 && st.bytes_read == 0 &&
+              st.bytes_written == 0 && st.would_block == 0 && st.replies == 0);
+    redisFree(c);
+    close(sv[1]);
+
+    test("Stats keep counting across reconnects: ");
+    fd = listen_loopback(&port);
+    c = redisConnect("127.0.0.1",port);
+    assert(c != NULL && c->err == 0 && redisEnableStats(c) == REDIS_OK);
+    assert((srv = accept(fd,NULL,NULL)) != -1);
+    assert(write(srv,"+PONG\r\n",7) == 7);
+    reply = redisCommand(c,"PING");
+    assert(reply != NULL);
+    freeReplyObject(reply);
+    close(srv);
+    assert(redisReconnect(c) == REDIS_OK);
+    assert((srv = accept(fd,NULL,NULL)) != -1);
+    assert(write(srv,"+PONG\r\n",7) == 7);
+    reply = redisCommand(c,"PING");
+    assert(reply != NULL);
+    freeReplyObject(reply);
+    redisGetStats(c,&st);
+    test_cond(st.write_calls == 2 && st.read_calls == 2 && st.replies == 2 &&
+              st.bytes_written == 2*strlen(ping) && c->reader->stats == c->stats);
+    redisFree(c);
+    close(srv);
+    close(fd);
+}
+
+static void test_resolve_cache_connects(void) {
+    redisAsyncContext *ac;
+    redisContext *c;
+    int port, fd = listen_loopback(&port), srv;
+
+    redisSetResolveCacheTtl(300);
+
+    test("Connects use a cached address without looking the host up: ");
+    assert(redisResolvedAdd("cached.invalid",port,loopback_addr(port)) == REDIS_OK);
+    c = redisConnect("cached.invalid",port);
+    assert((srv = accept(fd,NULL,NULL)) != -1);
+    test_cond(c->err == 0);
+    redisFree(c);
+    close(srv);
+
+    test("Async connects use a cached address without looking the host up: ");
+    ac = redisAsyncConnect("cached.invalid",port);
+    assert((srv = accept(fd,NULL,NULL)) != -1);
+    redisAsyncHandleWrite(ac);
+    test_cond(ac->err == 0 && (ac->c.flags & REDIS_CONNECTED));
+    redisAsyncFree(ac);
+    close(srv);
+
+    test("Stale cached addresses are used while the host is looked up again: ");
+    usleep(350000);
+    c = redisConnect("cached.invalid",port);
+    test_cond(c->err == 0);
+    redisFree(c);
+    close(accept(fd,NULL,NULL));
+
+    test("Cached addresses are dropped once they are stale for a TTL: ");
+    usleep(300000);
+    c = redisConnect("cached.invalid",port);
+    test_cond(c->err == REDIS_ERR_OTHER);
+    redisFree(c);
+
+    redisSetResolveCacheTtl(0);
+    close(fd);
+}
+
+static int socket_buffer(redisContext *c, int opt) {
+    int val = 0;
+    socklen_t len = sizeof(val);
+
+    assert(getsockopt(c->fd,SOL_SOCKET,opt,&val,&len) == 0);
+    return val;
+}
+
+static void test_socket_profile(void) {
+    redisSocketProfile p;
+    redisContext *c;
+    int sv[2], before;
+
+    test("Latency socket profile keeps queues short and acks quick: ");
+    redisSocketProfileInit(&p,REDIS_SOCKET_PROFILE_LATENCY);
+    test_cond(p.notsent_lowat > 0 && p.quickack && p.busy_poll > 0 &&
+              p.sndbuf == 0 && p.rcvbuf == 0 && p.max_buf == 0);
+
+    test("Bulk socket profile only grows the buffers: ");
+    redisSocketProfileInit(&p,REDIS_SOCKET_PROFILE_BULK);
+    test_cond(p.max_buf > 0 && p.sndbuf == 0 && p.notsent_lowat == 0 && !p.quickack);
+
+    assert(socketpair(AF_UNIX,SOCK_STREAM,0,sv) == 0);
+    c = redisConnectFd(sv[0]);
+    c->connection_type = REDIS_CONN_UNIX;
+
+    test("Socket profile sets the buffer sizes: ");
+    redisSocketProfileInit(&p,0);
+    p.sndbuf = 32768;
+    p.rcvbuf = 49152;
+    test_cond(redisSetSocketProfile(c,&p) == REDIS_OK &&
+              socket_buffer(c,SO_SNDBUF) >= 32768 &&
+              socket_buffer(c,SO_RCVBUF) >= 49152);
+
+    /* A full send buffer turned over within a window grows, at most to
+     * max_buf and never below its size. */
+    test("Socket profile grows a send buffer that held back writes: ");
+    before = socket_buffer(c,SO_SNDBUF);
+    p.max_buf = before*4;
+    assert(redisSetSocketProfile(c,&p) == REDIS_OK);
+    redisSocketAccount(c,0,before,1);
+    usleep(110000);
+    redisSocketAccount(c,0,0,0);
+    test_cond(socket_buffer(c,SO_SNDBUF) > before);
+
+    test("Socket profile leaves buffers alone at max_buf: ");
+    before = socket_buffer(c,SO_SNDBUF);
+    p.sndbuf = 0;
+    p.max_buf = before;
+    assert(redisSetSocketProfile(c,&p) == REDIS_OK);
+    redisSocketAccount(c,0,before,1);
+    usleep(110000);
+    redisSocketAccount(c,0,0,0);
+    test_cond(socket_buffer(c,SO_SNDBUF) == before);
+
+    test("Removing the socket profile keeps the socket as it is: ");
+    test_cond(redisSetSocketProfile(c,NULL) == REDIS_OK && c->sockstate == NULL &&
+              socket_buffer(c,SO_SNDBUF) == before);
+
+    redisFree(c);
+    close(sv[1]);
+}
+
+#ifdef USE_SSL
+struct tls_server {
+    SSL_CTX *ctx;
+    int fd;
+    int go[2]; /* the server reads once a byte arrives here */
+};
+
+/* Self-signed certificate for localhost. */
+static X509 *tls_certificate(EVP_PKEY **key) {
+    EVP_PKEY_CTX *kctx = EVP_PKEY_CTX_new_id(EVP_PKEY_EC,NULL);
+    X509 *cert = X509_new();
+    X509_NAME *name;
+
+    *key = NULL;
+    assert(kctx && cert && EVP_PKEY_keygen_init(kctx) == 1);
+    assert(EVP_PKEY_CTX_set_ec_paramgen_curve_nid(kctx,NID_X9_62_prime256v1) == 1);
+    assert(EVP_PKEY_keygen(kctx,key) == 1);
+    EVP_PKEY_CTX_free(kctx);
+
+    ASN1_INTEGER_set(X509_get_serialNumber(cert),1);
+    X509_gmtime_adj(X509_getm_notBefore(cert),0);
+    X509_gmtime_adj(X509_getm_notAfter(cert),3600);
+    name = X509_get_subject_name(cert);
+    X509_NAME_add_entry_by_txt(name,"CN",MBSTRING_ASC,(const unsigned char*)"localhost",-1,-1,0);
+    X509_set_issuer_name(cert,name);
+    X509_set_pubkey(cert,*key);
+    assert(X509_sign(cert,*key,EVP_sha256()) > 0);
+    return cert;
+}
+
+/* Answers every PING with a PONG until the client goes away. */
+static void *tls_server_thread(void *arg) {
+    struct tls_server *srv = arg;
+    SSL *ssl = SSL_new(srv->ctx);
+    char buf[16384], go;
+    int n, i, m = 0;
+
+    SSL_set_fd(ssl,srv->fd);
+    if (SSL_accept(ssl) == 1 && read(srv->go[0],&go,1) == 1) {
+        while ((n = SSL_read(ssl,buf,sizeof(buf))) > 0) {
+            for (i = 0; i < n; i++) {
+                m = buf[i] == "PING"[m] ? m+1 : buf[i] == 'P';
+                if (m == 4) {
+                    SSL_write(ssl,"+PONG\r\n",7);
+                    m = 0;
+                }
+            }
+        }
+    }
+    SSL_free(ssl);
+    close(srv->fd);
+    return NULL;
+}
+
+/* Context over one end of a socket pair, the server thread on the other. */
+static redisContext *tls_pair(struct tls_server *srv, pthread_t *thread, int go) {
+    int sv[2];
+
+    assert(socketpair(AF_UNIX,SOCK_STREAM,0,sv) == 0);
+    assert(pipe(srv->go) == 0);
+    srv->fd = sv[1];
+    if (go)
+        assert(write(srv->go[1],"x",1) == 1);
+    assert(pthread_create(thread,NULL,tls_server_thread,srv) == 0);
+    return redisConnectFd(sv[0]);
+}
+
+static void tls_pair_free(redisContext *c, struct tls_server *srv, pthread_t thread) {
+    redisFree(c);
+    close(srv->go[1]);
+    pthread_join(thread,NULL);
+    close(srv->go[0]);
+}
+
+/* Writes and reads on the non-blocking context until a reply arrives. */
+static redisReply *tls_nonblocking_reply(redisContext *c) {
+    struct pollfd pfd;
+    void *reply = NULL;
+    int done = 0, j;
+
+    for (j = 0; j < 1000 && reply == NULL; j++) {
+        if (!done && redisBufferWrite(c,&done) != REDIS_OK)
+            break;
+        if (redisBufferRead(c) != REDIS_OK || redisGetReplyFromReader(c,&reply) != REDIS_OK)
+            break;
+        pfd.fd = c->fd;
+        pfd.events = POLLIN;
+        if ((c->flags & REDIS_HANDSHAKE_WRITE) ||
+            (!(c->flags & REDIS_HANDSHAKE) && !done))
+            pfd.events |= POLLOUT;
+        pfd.revents = 0;
+        if (reply == NULL)
+            poll(&pfd,1,100);
+    }
+    return reply;
+}
+
+static void test_tls(void) {
+    SSL_CTX *sctx = SSL_CTX_new(TLS_server_method());
+    SSL_CTX *cctx = SSL_CTX_new(TLS_client_method());
+    struct tls_server srv;
+    pthread_t thread;
+    redisContext *c;
+    redisReply *reply;
+    EVP_PKEY *key;
+    X509 *cert = tls_certificate(&key);
+    size_t big = 4*1024*1024, before;
+    char *value;
+    int done = 0, j;
+
+    assert(SSL_CTX_use_certificate(sctx,cert) == 1 && SSL_CTX_use_PrivateKey(sctx,key) == 1);
+    X509_STORE_add_cert(SSL_CTX_get_cert_store(cctx),cert);
+    SSL_CTX_set_verify(cctx,SSL_VERIFY_PEER,NULL);
+    srv.ctx = sctx;
+
+    test("TLS handshake of a blocking context: ");
+    c = tls_pair(&srv,&thread,1);
+    assert(redisTLSInitiate(c,cctx,"localhost") == REDIS_OK);
+    reply = redisCommand(c,"PING");
+    test_cond(reply && reply->type == REDIS_REPLY_STATUS && strcmp(reply->str,"PONG") == 0);
+    freeReplyObject(reply);
+    tls_pair_free(c,&srv,thread);
+
+    test("TLS handshake fails for a certificate of another name: ");
+    c = tls_pair(&srv,&thread,1);
+    test_cond(redisTLSInitiate(c,cctx,"example.com") == REDIS_ERR &&
+              strstr(c->errstr,"certificate verify failed") != NULL);
+    tls_pair_free(c,&srv,thread);
+
+    test("TLS handshake of a non-blocking context goes on with reads and writes: ");
+    c = tls_pair(&srv,&thread,1);
+    assert(fcntl(c->fd,F_SETFL,fcntl(c->fd,F_GETFL)|O_NONBLOCK) == 0);
+    c->flags &= ~REDIS_BLOCK;
+    assert(redisTLSInitiate(c,cctx,"localhost") == REDIS_OK);
+    redisAppendCommand(c,"PING");
+    reply = tls_nonblocking_reply(c);
+    test_cond(reply && reply->type == REDIS_REPLY_STATUS && strcmp(reply->str,"PONG") == 0);
+    freeReplyObject(reply);
+    tls_pair_free(c,&srv,thread);
+
+    /* The write blocks halfway, then the output buffer grows and moves
+     * before it is retried. */
+    test("TLS writes are retried with a moved output buffer: ");
+    c = tls_pair(&srv,&thread,0);
+    assert(fcntl(c->fd,F_SETFL,fcntl(c->fd,F_GETFL)|O_NONBLOCK) == 0);
+    c->flags &= ~REDIS_BLOCK;
+    assert(redisTLSInitiate(c,cctx,"localhost") == REDIS_OK);
+    value = malloc(big);
+    memset(value,'x',big);
+    redisAppendCommand(c,"SET key %b",value,big);
+    free(value);
+    for (j = 0; j < 1000 && !done; j++) {
+        before = sdslen(c->obuf);
+        assert(redisBufferWrite(c,&done) == REDIS_OK);
+        if (!(c->flags & REDIS_HANDSHAKE) && sdslen(c->obuf) == before)
+            break;
+        if (c->flags & REDIS_HANDSHAKE)
+            assert(redisBufferRead(c) == REDIS_OK);
+        usleep(1000);
+    }
+    value = calloc(1,65536);
+    for (j = 0; j < 64; j++)
+        redisAppendCommand(c,"SET key %b",value,(size_t)65536);
+    free(value);
+    redisAppendCommand(c,"PING");
+    assert(write(srv.go[1],"x",1) == 1);
+    reply = tls_nonblocking_reply(c);
+    test_cond(!done && reply && reply->type == REDIS_REPLY_STATUS &&
+              strcmp(reply->str,"PONG") == 0);
+    freeReplyObject(reply);
+    tls_pair_free(c,&srv,thread);
+
+    X509_free(cert);
+    EVP_PKEY_free(key);
+    SSL_CTX_free(sctx);
+    SSL_CTX_free(cctx);
+}
+#endif
+
 static void test_blocking_connection_errors(void) {
     redisContext *c;
 
@@ -377,6 +2181,63 @@ static void test_blocking_connection_errors(void) {
         strcmp(c->errstr,"Connection refused") == 0);
     redisFree(c);
 
+    test("Fast Open connects report errors on the first write: ");
+    c = redisConnectFastOpen((char*)"localhost", 1);
+    assert(c->err == 0 && (c->flags & REDIS_CONNECT_DEFERRED));
+    test_cond(redisCommand(c,"PING") == NULL && c->err == REDIS_ERR_IO &&
+        strcmp(c->errstr,"Connection refused") == 0);
+    redisFree(c);
+
+    test("Connects many at once and reports errors per target: ");
+    {
+        const char *hosts[] = {"localhost", "idontexist.invalid"};
+        const int ports[] = {1, 1};
+        redisContext *cs[2];
+        struct timeval tv = {1, 0};
+
+        test_cond(redisConnectMany(hosts,ports,2,&tv,cs) == 0 &&
+            cs[0]->err == REDIS_ERR_IO &&
+            strcmp(cs[0]->errstr,"Connection refused") == 0 &&
+            cs[1]->err == REDIS_ERR_OTHER &&
+            (cs[0]->flags & REDIS_BLOCK) && (cs[1]->flags & REDIS_BLOCK));
+        redisFree(cs[0]);
+        redisFree(cs[1]);
+    }
+
+    test("Connects many at once to blocking contexts ready for commands: ");
+    {
+        const char *hosts[] = {"127.0.0.1", "127.0.0.1", "127.0.0.1"};
+        int ports[3], srv[3], fd = listen_loopback(&ports[0]), ok = 1, j;
+        redisContext *cs[3];
+        struct timeval tv = {1, 0};
+        redisReply *reply;
+
+        ports[1] = ports[2] = ports[0];
+        assert(redisConnectMany(hosts,ports,3,&tv,cs) == 3);
+        for (j = 0; j < 3; j++) {
+            assert((srv[j] = accept(fd,NULL,NULL)) != -1);
+            assert(write(srv[j],"+PONG\r\n",7) == 7);
+        }
+        for (j = 0; j < 3; j++) {
+            reply = redisCommand(cs[j],"PING");
+            ok &= cs[j]->err == 0 && (cs[j]->flags & REDIS_BLOCK) && reply != NULL &&
+                  reply->type == REDIS_REPLY_STATUS && strcmp(reply->str,"PONG") == 0;
+            freeReplyObject(reply);
+            redisFree(cs[j]);
+            close(srv[j]);
+        }
+        test_cond(ok);
+
+        test("Connecting many at once doesn't start connects past the deadline: ");
+        tv.tv_sec = 0;
+        test_cond(redisConnectMany(hosts,ports,3,&tv,cs) == 0 && !pending_accept(fd) &&
+            cs[2]->err == REDIS_ERR_IO && strcmp(cs[2]->errstr,"Connection timed out") == 0 &&
+            cs[2]->tcp.host == NULL);
+        for (j = 0; j < 3; j++)
+            redisFree(cs[j]);
+        close(fd);
+    }
+
     test("Returns error when the unix_sock socket path doesn't accept connections: ");
     c = redisConnectUnix((char*)"/tmp/idontexist.sock");
     test_cond(c->err == REDIS_ERR_IO); /* Don't care about the message... */
@@ -387,7 +2248,7 @@ static void test_blocking_connection(struct config config) {
     redisContext *c;
     redisReply *reply;
 
-    c = connect(config);
+    c = do_connect(config);
 
     test("Is able to deliver commands: ");
     reply = redisCommand(c,"PING");
@@ -461,6 +2322,34 @@ static void test_blocking_connection(struct config config) {
     disconnect(c, 0);
 }
 
+static void test_connect_options(struct config config) {
+    redisConnectOptions opts = { NULL, NULL, "hiredis-test", 9, 0 };
+    redisContext *c;
+    redisReply *reply;
+
+    c = do_connect(config);
+
+    test("Connect options are sent as setup commands: ");
+    assert(redisSetConnectOptions(c,&opts) == REDIS_OK);
+    reply = redisCommand(c,"CLIENT GETNAME");
+    test_cond(reply->type == REDIS_REPLY_STRING &&
+        strcmp(reply->str,"hiredis-test") == 0);
+    freeReplyObject(reply);
+
+    test("Connect options are sent again on reconnect: ");
+    assert(redisReconnect(c) == REDIS_OK);
+    reply = redisCommand(c,"CLIENT GETNAME");
+    test_cond(reply->type == REDIS_REPLY_STRING &&
+        strcmp(reply->str,"hiredis-test") == 0);
+    freeReplyObject(reply);
+
+    test("Failed setup commands are reported as errors: ");
+    opts.password = "idontexist";
+    test_cond(redisSetConnectOptions(c,&opts) == REDIS_ERR &&
+        c->err == REDIS_ERR_OTHER && strncmp(c->errstr,"AUTH failed: ",13) == 0);
+    redisFree(c);
+}
+
 static void test_blocking_connection_timeouts(struct config config) {
     redisContext *c;
     redisReply *reply;
@@ -468,7 +2357,7 @@ static void test_blocking_connection_timeouts(struct config config) {
     const char *cmd = "DEBUG SLEEP 3\r\n";
     struct timeval tv;
 
-    c = connect(config);
+    c = do_connect(config);
     test("Successfully completes a command when the timeout is not exceeded: ");
     reply = redisCommand(c,"SET foo fast");
     freeReplyObject(reply);
@@ -480,7 +2369,7 @@ static void test_blocking_connection_timeouts(struct config config) {
     freeReplyObject(reply);
     disconnect(c, 0);
 
-    c = connect(config);
+    c = do_connect(config);
     test("Does not return a reply when the command times out: ");
     s = write(c->fd, cmd, strlen(cmd));
     tv.tv_sec = 0;
@@ -514,7 +2403,7 @@ static void test_blocking_io_errors(struct config config) {
     int major, minor;
 
     /* Connect to target given by config. */
-    c = connect(config);
+    c = do_connect(config);
     {
         /* Find out Redis version to determine the path for the next test */
         const char *field = "redis_version:";
@@ -549,7 +2438,7 @@ static void test_blocking_io_errors(struct config config) {
         strcmp(c->errstr,"Server closed the connection") == 0);
     redisFree(c);
 
-    c = connect(config);
+    c = do_connect(config);
     test("Returns I/O error on socket timeout: ");
     struct timeval tv = { 0, 1000 };
     assert(redisSetTimeout(c,tv) == REDIS_OK);
@@ -583,7 +2472,7 @@ static void test_invalid_timeout_errors(struct config config) {
 }
 
 static void test_throughput(struct config config) {
-    redisContext *c = connect(config);
+    redisContext *c = do_connect(config);
     redisReply **replies;
     int i, num;
     long long t1, t2;
@@ -787,12 +2676,43 @@ int main(int argc, char **argv) {
 
     test_format_commands();
     test_reply_reader();
+    test_shard_routing();
+    test_cluster_slots();
+    test_cluster_partition();
+    test_subscription_table();
     test_blocking_connection_errors();
+    test_resolve_cache();
     test_free_null();
+    test_socket_profile();
+    test_stats();
+    test_connect_race();
+    test_resolve_cache_connects();
+    test_fast_open();
+    test_sentinel_discovery();
+    test_sentinel_order();
+    test_sentinel_watch();
+    test_sentinel_buffer();
+    test_sentinel_cached_master();
+    test_sentinel_groups();
+    test_sentinel_read();
+    test_cluster_redirects();
+    test_async_flow();
+    test_async_batch();
+    test_async_budget();
+    test_async_queue();
+#ifdef __linux__
+    test_epoll_loop();
+#endif
+    test_shard_merge();
+    test_setup_commands();
+#ifdef USE_SSL
+    test_tls();
+#endif
 
     printf("\nTesting against TCP connection (%s:%d):\n", cfg.tcp.host, cfg.tcp.port);
     cfg.type = CONN_TCP;
     test_blocking_connection(cfg);
+    test_connect_options(cfg);
     test_blocking_connection_timeouts(cfg);
     test_blocking_io_errors(cfg);
     test_invalid_timeout_errors(cfg);
@@ -0,0 +1,275 @@
+#include "fmacros.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <openssl/err.h>
+
+#include "tls.h"
+
+/* Forward declaration of function in hiredis.c */
+void __redisSetError(redisContext *c, int type, const char *str);
+
+typedef struct redisTLS {
+    SSL_CTX *ctx;
+    SSL *ssl;
+    char *servername;
+    int ktls; /* REDIS_TLS_KTLS_* of the current connection */
+} redisTLS;
+
+static void redisTLSSetError(redisContext *c, const char *prefix) {
+    char msg[128];
+    unsigned long e = ERR_get_error();
+    int len;
+
+    if (e == 0) {
+        __redisSetError(c,REDIS_ERR_IO,NULL);
+        return;
+    }
+    len = snprintf(msg,sizeof(msg),"%s: ",prefix);
+    ERR_error_string_n(e,msg+len,sizeof(msg)-len);
+    ERR_clear_error();
+    __redisSetError(c,REDIS_ERR_OTHER,msg);
+}
+
+/* Maps a failed SSL_read() or SSL_write() to the return value read(2) or
+ * write(2) would have had. */
+static int redisTLSFailed(redisContext *c, SSL *ssl, int rv) {
+    switch (SSL_get_error(ssl,rv)) {
+    case SSL_ERROR_WANT_READ:
+    case SSL_ERROR_WANT_WRITE:
+        errno = EAGAIN;
+        return -1;
+    case SSL_ERROR_ZERO_RETURN:
+        return 0;
+    case SSL_ERROR_SYSCALL:
+        if (errno == 0)
+            return 0;
+        return -1;
+    default:
+        redisTLSSetError(c,"TLS I/O failed");
+        return -1;
+    }
+}
+
+/* Takes the handshake a step further. Returns REDIS_OK when it is done or
+ * when it waits for the socket, with REDIS_HANDSHAKE_* set then. */
+static int redisTLSHandshake(redisContext *c) {
+    redisTLS *t = c->transport_privdata;
+    int rv;
+
+    c->flags &= ~REDIS_HANDSHAKE;
+    ERR_clear_error();
+    errno = 0;
+    if ((rv = SSL_connect(t->ssl)) == 1) {
+#ifdef BIO_get_ktls_send
+        if (BIO_get_ktls_send(SSL_get_wbio(t->ssl)))
+            t->ktls |= REDIS_TLS_KTLS_SEND;
+#endif
+#ifdef BIO_get_ktls_recv
+        if (BIO_get_ktls_recv(SSL_get_rbio(t->ssl)))
+            t->ktls |= REDIS_TLS_KTLS_RECV;
+#endif
+        return REDIS_OK;
+    }
+
+    switch (SSL_get_error(t->ssl,rv)) {
+    case SSL_ERROR_WANT_READ:
+        c->flags |= REDIS_HANDSHAKE_READ;
+        return REDIS_OK;
+    case SSL_ERROR_WANT_WRITE:
+        c->flags |= REDIS_HANDSHAKE_WRITE;
+        return REDIS_OK;
+    case SSL_ERROR_SYSCALL:
+        if (errno != 0) {
+            __redisSetError(c,REDIS_ERR_IO,NULL);
+            return REDIS_ERR;
+        }
+        /* fall through */
+    default:
+        redisTLSSetError(c,"TLS handshake failed");
+        return REDIS_ERR;
+    }
+}
+
+/* Reads and writes finish a pending handshake first. Returns 0 when it is
+ * done, -1 as read(2) would otherwise. */
+static int redisTLSPending(redisContext *c) {
+    if (redisTLSHandshake(c) != REDIS_OK)
+        return -1;
+    if (c->flags & REDIS_HANDSHAKE) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return 0;
+}
+
+static int redisTLSRead(redisContext *c, char *buf, size_t len) {
+    redisTLS *t = c->transport_privdata;
+    int rv;
+
+    if ((c->flags & REDIS_HANDSHAKE) && redisTLSPending(c) != 0)
+        return -1;
+
+    ERR_clear_error();
+    errno = 0;
+    if ((rv = SSL_read(t->ssl,buf,len)) > 0)
+        return rv;
+    return redisTLSFailed(c,t->ssl,rv);
+}
+
+static int redisTLSWrite(redisContext *c, const char *buf, size_t len) {
+    redisTLS *t = c->transport_privdata;
+    int rv;
+
+    if ((c->flags & REDIS_HANDSHAKE) && redisTLSPending(c) != 0)
+        return -1;
+
+    /* The kernel encrypts, the socket takes the plain bytes. */
+    if (t->ktls & REDIS_TLS_KTLS_SEND)
+        return write(c->fd,buf,len);
+
+    ERR_clear_error();
+    errno = 0;
+    if ((rv = SSL_write(t->ssl,buf,len)) > 0)
+        return rv;
+    return redisTLSFailed(c,t->ssl,rv);
+}
+
+static long long redisTLSMsec(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (long long)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+/* Blocking contexts run the whole handshake over the socket made
+ * non-blocking for the time being, bounded by the connect timeout. */
+static int redisTLSHandshakeBlocking(redisContext *c) {
+    struct pollfd pfd;
+    long long deadline = -1, msec = -1;
+    int flags, res, rv = REDIS_ERR;
+
+    if ((flags = fcntl(c->fd,F_GETFL)) == -1 ||
+        fcntl(c->fd,F_SETFL,flags|O_NONBLOCK) == -1) {
+        __redisSetError(c,REDIS_ERR_IO,"fcntl(F_SETFL)");
+        return REDIS_ERR;
+    }
+    if (c->timeout != NULL)
+        deadline = redisTLSMsec() + c->timeout->tv_sec*1000 +
+                   (c->timeout->tv_usec+999)/1000;
+
+    while (redisTLSHandshake(c) == REDIS_OK) {
+        if (!(c->flags & REDIS_HANDSHAKE)) {
+            rv = REDIS_OK;
+            break;
+        }
+        if (deadline != -1 && (msec = deadline-redisTLSMsec()) <= 0) {
+            errno = ETIMEDOUT;
+            __redisSetError(c,REDIS_ERR_IO,NULL);
+            break;
+        }
+        pfd.fd = c->fd;
+        pfd.events = (c->flags & REDIS_HANDSHAKE_READ) ? POLLIN : POLLOUT;
+        pfd.revents = 0;
+        if ((res = poll(&pfd,1,(int)msec)) == -1 && errno != EINTR) {
+            __redisSetError(c,REDIS_ERR_IO,"poll(2)");
+            break;
+        }
+    }
+
+    c->flags &= ~REDIS_HANDSHAKE;
+    fcntl(c->fd,F_SETFL,flags);
+    return rv;
+}
+
+/* Starts a handshake over the current socket of the context. */
+static int redisTLSConnect(redisContext *c) {
+    redisTLS *t = c->transport_privdata;
+
+    if (t->ssl != NULL)
+        SSL_free(t->ssl);
+    t->ktls = 0;
+    if ((t->ssl = SSL_new(t->ctx)) == NULL) {
+        redisTLSSetError(c,"SSL_new() failed");
+        return REDIS_ERR;
+    }
+    /* redisBufferWrite() retries with the output buffer as it is then,
+     * which may have moved or grown in between. */
+    SSL_set_mode(t->ssl,SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER|SSL_MODE_ENABLE_PARTIAL_WRITE);
+#ifdef SSL_OP_ENABLE_KTLS
+    SSL_set_options(t->ssl,SSL_OP_ENABLE_KTLS);
+#endif
+#ifdef SSL_OP_IGNORE_UNEXPECTED_EOF
+    SSL_set_options(t->ssl,SSL_OP_IGNORE_UNEXPECTED_EOF);
+#endif
+    if (t->servername != NULL) {
+        SSL_set_tlsext_host_name(t->ssl,t->servername);
+        SSL_set1_host(t->ssl,t->servername);
+    }
+    if (!SSL_set_fd(t->ssl,c->fd)) {
+        redisTLSSetError(c,"SSL_set_fd() failed");
+        return REDIS_ERR;
+    }
+
+    if (c->flags & REDIS_BLOCK)
+        return redisTLSHandshakeBlocking(c);
+    return redisTLSHandshake(c);
+}
+
+static void redisTLSFree(void *privdata) {
+    redisTLS *t = privdata;
+
+    if (t->ssl != NULL)
+        SSL_free(t->ssl);
+    SSL_CTX_free(t->ctx);
+    free(t->servername);
+    free(t);
+}
+
+static const redisTransport redisTLSTransport = {
+    redisTLSRead,
+    redisTLSWrite,
+    redisTLSConnect,
+    redisTLSHandshake,
+    redisTLSFree
+};
+
+int redisTLSInitiate(redisContext *c, SSL_CTX *ctx, const char *servername) {
+    redisTLS *t;
+
+    if (c->err)
+        return REDIS_ERR;
+    if (c->transport != NULL) {
+        __redisSetError(c,REDIS_ERR_OTHER,"Context already has a transport");
+        return REDIS_ERR;
+    }
+    if ((t = calloc(1,sizeof(*t))) == NULL)
+        goto oom;
+    if (servername != NULL && (t->servername = strdup(servername)) == NULL) {
+        free(t);
+        goto oom;
+    }
+    SSL_CTX_up_ref(ctx);
+    t->ctx = ctx;
+
+    if (redisSetTransport(c,&redisTLSTransport,t) != REDIS_OK) {
+        redisTLSFree(t);
+        return REDIS_ERR;
+    }
+    return redisTLSConnect(c);
+
+oom:
+    __redisSetError(c,REDIS_ERR_OOM,"Out of memory");
+    return REDIS_ERR;
+}
+
+int redisTLSKernelOffload(redisContext *c) {
+    if (c->transport != &redisTLSTransport)
+        return 0;
+    return ((redisTLS*)c->transport_privdata)->ktls;
+}
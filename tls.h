@@ -0,0 +1,35 @@
+#ifndef __HIREDIS_TLS_H
+#define __HIREDIS_TLS_H
+
+#include <openssl/ssl.h>
+
+#include "hiredis.h"
+
+/* Offload reported by redisTLSKernelOffload() */
+#define REDIS_TLS_KTLS_SEND 0x1
+#define REDIS_TLS_KTLS_RECV 0x2
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Runs a TLS handshake over the connected socket of the context and makes
+ * it the transport of the context, so every later read and write, and every
+ * reconnect, goes through TLS. servername is used for SNI and checked against
+ * the certificate when ctx verifies peers; it can be NULL. Kernel TLS is
+ * asked for when OpenSSL supports it. Blocking contexts wait for the
+ * handshake, bounded by the connect timeout. Non-blocking contexts, also the
+ * one of an async context right after redisAsyncConnect(), go on with it as
+ * the socket becomes ready: reads and writes fail with EAGAIN until it is
+ * done, and async contexts are connected once it is. */
+int redisTLSInitiate(redisContext *c, SSL_CTX *ctx, const char *servername);
+
+/* Directions the kernel encrypts, a mask of REDIS_TLS_KTLS_*. Writes bypass
+ * OpenSSL then and go to the socket as they are. */
+int redisTLSKernelOffload(redisContext *c);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif